@@ -0,0 +1,240 @@
+#include "archive.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+#include "layout.hpp"
+#include "throttle.hpp"
+
+// first four bytes of every directory VPK
+static constexpr std::uint32_t VPK_SIGNATURE{ 0x55AA1234 };
+
+ArchiveCache::ArchiveCache( std::uint64_t budget ) : budget{ budget } { }
+
+auto ArchiveCache::open( const std::string& path ) -> std::shared_ptr<vpkpp::PackFile> {
+	std::unique_lock guard{ this->lock };
+	while ( true ) {
+		if ( auto it{ this->archives.find( path ) }; it != this->archives.end() ) {
+			this->uses.splice( this->uses.begin(), this->uses, it->second.use );
+			return it->second.archive;
+		}
+		// someone else is parsing it already
+		if (! this->opening.contains( path ) )
+			break;
+		this->archiveOpened.wait( guard );
+	}
+	this->opening.emplace( path, false );
+	const auto linked{ this->links.find( path ) };
+	const auto source{ linked != this->links.end() ? linked->second : std::string{} };
+
+	// parsing a tree takes a while, the VPKs already open stay available meanwhile
+	guard.unlock();
+	Slot slot{};
+	if (! source.empty() ) {
+		slot.archive = this->open( source );
+		slot.source = source;
+	} else if ( ( slot.archive = vpkpp::VPK::open( path ) ) ) {
+		std::error_code err;
+		slot.cost = std::filesystem::file_size( path, err );
+
+		std::map<EntryPayload, unsigned> aliases;
+		slot.archive->runForAllEntries( [ &aliases ]( const std::string&, const vpkpp::Entry& entry ) {
+			if ( const auto payload{ getEntryPayload( entry ) } )
+				aliases[ *payload ] += 1;
+		} );
+		for ( const auto& [ payload, count ] : aliases )
+			if ( count > 1 )
+				slot.payloads.emplace( payload, SharedPayload{} );
+		slot.cost += slot.payloads.size() * sizeof( std::pair<EntryPayload, SharedPayload> );
+	}
+	guard.lock();
+
+	if (! source.empty() ) {
+		// which payloads have several entries is all it takes from the other, its own aliases are read from its files
+		const auto other{ this->archives.find( source ) };
+		if ( other != this->archives.end() && other->second.archive == slot.archive ) {
+			for ( const auto& [ payload, shared ] : other->second.payloads )
+				slot.payloads.emplace( payload, SharedPayload{} );
+		} else {
+			// closed meanwhile, the tree is only kept alive by this one now
+			std::error_code err;
+			slot.cost = std::filesystem::file_size( source, err );
+		}
+		slot.cost += slot.payloads.size() * sizeof( std::pair<EntryPayload, SharedPayload> );
+	}
+
+	auto archive{ slot.archive };
+	const auto opened{ this->opening.find( path ) };
+	const bool closed{ opened->second };
+	this->opening.erase( opened );
+	// closed while it was being parsed, which means the file changed and what was parsed may be stale already
+	if (! closed ) {
+		this->uses.push_front( path );
+		slot.use = this->uses.begin();
+		this->used += slot.cost;
+		this->archives.insert_or_assign( path, std::move( slot ) );
+
+		// the one just opened always stays, even if it's over budget on its own
+		while ( this->budget != 0 && this->used > this->budget && this->uses.size() > 1 ) {
+			const auto victim{ this->uses.back() };
+			this->closeLocked( victim );
+		}
+	}
+	guard.unlock();
+	this->archiveOpened.notify_all();
+
+	return archive;
+}
+
+auto ArchiveCache::close( const std::string& path ) -> void {
+	const std::scoped_lock guard{ this->lock };
+	this->closeLocked( path );
+	if ( const auto opened{ this->opening.find( path ) }; opened != this->opening.end() )
+		opened->second = true;
+}
+
+auto ArchiveCache::link( const std::string& path, const std::string& source ) -> void {
+	const std::scoped_lock guard{ this->lock };
+	if ( path != source )
+		this->links.try_emplace( path, source );
+}
+
+auto ArchiveCache::isLinked( const std::string& path ) -> bool {
+	const std::scoped_lock guard{ this->lock };
+	return this->links.contains( path );
+}
+
+auto ArchiveCache::claimPayload( const std::string& path, const vpkpp::Entry& entry, PayloadDigests& digests ) -> PayloadClaim {
+	const auto payload{ getEntryPayload( entry ) };
+	if (! payload )
+		return PayloadClaim::Unshared;
+
+	std::unique_lock guard{ this->lock };
+	while ( true ) {
+		// closed meanwhile, nothing is shared anymore
+		const auto archive{ this->archives.find( path ) };
+		if ( archive == this->archives.end() )
+			return PayloadClaim::Unshared;
+		const auto shared{ archive->second.payloads.find( *payload ) };
+		if ( shared == archive->second.payloads.end() )
+			return PayloadClaim::Unshared;
+
+		if ( shared->second.digests ) {
+			digests = *shared->second.digests;
+			return PayloadClaim::Known;
+		}
+		if (! shared->second.claimed ) {
+			shared->second.claimed = true;
+			return PayloadClaim::Claimed;
+		}
+		this->payloadShared.wait( guard );
+	}
+}
+
+auto ArchiveCache::sharePayload( const std::string& path, const vpkpp::Entry& entry, const PayloadDigests* digests ) -> void {
+	const auto payload{ getEntryPayload( entry ) };
+	if (! payload )
+		return;
+
+	{
+		const std::scoped_lock guard{ this->lock };
+		if ( const auto archive{ this->archives.find( path ) }; archive != this->archives.end() ) {
+			if ( const auto shared{ archive->second.payloads.find( *payload ) }; shared != archive->second.payloads.end() ) {
+				shared->second.claimed = false;
+				if ( digests )
+					shared->second.digests = *digests;
+			}
+		}
+	}
+	this->payloadShared.notify_all();
+}
+
+auto ArchiveCache::forgetPayloads( const std::string& path, std::uint32_t archiveIndex ) -> void {
+	const std::scoped_lock guard{ this->lock };
+	const auto archive{ this->archives.find( path ) };
+	if ( archive == this->archives.end() )
+		return;
+
+	for ( auto& [ payload, shared ] : archive->second.payloads )
+		if ( payload.archiveIndex == archiveIndex )
+			shared.digests.reset();
+}
+
+auto ArchiveCache::closeLocked( const std::string& path ) -> void {
+	const auto it{ this->archives.find( path ) };
+	if ( it == this->archives.end() )
+		return;
+
+	this->used -= it->second.cost;
+	this->uses.erase( it->second.use );
+	this->archives.erase( it );
+
+	// the trees linked to it would be kept alive without being counted
+	std::vector<std::string> linked;
+	for ( const auto& [ other, slot ] : this->archives )
+		if ( slot.source == path )
+			linked.push_back( other );
+	for ( const auto& other : linked )
+		this->closeLocked( other );
+}
+
+auto getEntryPayload( const vpkpp::Entry& entry ) -> std::optional<EntryPayload> {
+	// preloaded bytes are the entry's own, and unbaked entries are still in memory
+	if ( entry.unbaked || !entry.extraData.empty() || entry.length == 0 )
+		return std::nullopt;
+	return EntryPayload{ entry.archiveIndex, entry.offset, entry.length, entry.compressedLength };
+}
+
+EntryReader::EntryReader( const std::filesystem::path& vpkPath ) : vpkPath{ vpkPath } { }
+
+auto EntryReader::read( const vpkpp::Entry& entry, std::size_t pieceSize, const std::function<void( const std::byte*, std::size_t )>& consume ) -> bool {
+	if ( entry.compressedLength != 0 || entry.length < entry.extraData.size() )
+		return false;
+
+	// preloaded bytes come first, they are stored in the tree itself
+	if (! entry.extraData.empty() )
+		consume( entry.extraData.data(), entry.extraData.size() );
+
+	auto remaining{ entry.length - entry.extraData.size() };
+	if ( remaining == 0 )
+		return true;
+
+	auto& stream{ this->stream };
+	if ( !stream.is_open() || this->archiveIndex != entry.archiveIndex ) {
+		stream.close();
+		stream.open( getArchiveChunkPath( this->vpkPath, entry.archiveIndex ), std::ios::in | std::ios::binary );
+		this->archiveIndex = entry.archiveIndex;
+	}
+	// a failed read leaves the stream failed, the next entry starts over
+	stream.clear();
+
+	auto offset{ entry.offset };
+	if ( entry.archiveIndex == vpkpp::VPK::VPK_DIR_INDEX ) {
+		// offsets in the directory VPK are relative to the end of its tree
+		std::uint32_t header[ 3 ]{};
+		if (! stream.seekg( 0 ) || !stream.read( reinterpret_cast<char*>( header ), sizeof( header ) ) || header[ 0 ] != VPK_SIGNATURE )
+			return false;
+		offset += ( header[ 1 ] == 1 ? 12 : 28 ) + header[ 2 ];
+	}
+	if (! stream.seekg( static_cast<std::streamoff>( offset ) ) )
+		return false;
+
+	this->buffer.resize( static_cast<std::size_t>( std::min<std::uint64_t>( std::max<std::size_t>( pieceSize, 1 ), remaining ) ) );
+	while ( remaining > 0 ) {
+		const auto count{ static_cast<std::size_t>( std::min<std::uint64_t>( this->buffer.size(), remaining ) ) };
+		{
+			ThrottledRead throttle{ count };
+			if (! stream.read( reinterpret_cast<char*>( this->buffer.data() ), static_cast<std::streamsize>( count ) ) )
+				return false;
+		}
+		consume( this->buffer.data(), count );
+		remaining -= count;
+	}
+	return true;
+}
+
+auto readEntryInPieces( const std::filesystem::path& vpkPath, const vpkpp::Entry& entry, std::size_t pieceSize, const std::function<void( const std::byte*, std::size_t )>& consume ) -> bool {
+	EntryReader reader{ vpkPath };
+	return reader.read( entry, pieceSize, consume );
+}
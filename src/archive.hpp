@@ -0,0 +1,123 @@
+#pragma once
+
+#include <array>
+#include <compare>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cryptopp/crc.h>
+#include <cryptopp/sha.h>
+#include <vpkpp/format/VPK.h>
+
+// Where the data of an entry is stored, entries with the same one are aliases of a single payload
+struct EntryPayload {
+	std::uint32_t archiveIndex{ 0 };
+	std::uint64_t offset{ 0 };
+	std::uint64_t length{ 0 };
+	std::uint64_t compressedLength{ 0 };
+
+	auto operator<=>( const EntryPayload& ) const = default;
+};
+
+// Empty for entries with bytes of their own in the tree, or no data stored at all, those are never aliases
+auto getEntryPayload( const vpkpp::Entry& entry ) -> std::optional<EntryPayload>;
+
+// What reading a payload found, handed to its other aliases
+struct PayloadDigests {
+	std::uint64_t size{ 0 };
+	std::array<unsigned char, CryptoPP::SHA1::DIGESTSIZE> sha1{};
+	std::array<unsigned char, CryptoPP::CRC32::DIGESTSIZE> crc32{};
+};
+
+enum class PayloadClaim {
+	// no other entry shares it
+	Unshared,
+	// the caller reads it, then calls `sharePayload`
+	Claimed,
+	// another alias already read it
+	Known,
+};
+
+// VPKs opened while verifying, when over budget the least recently used ones are closed, safe to share between threads
+class ArchiveCache {
+public:
+	// a budget of zero keeps everything open
+	explicit ArchiveCache( std::uint64_t budget = 0 );
+
+	// Returns nullptr if the VPK failed to open, failures are remembered so that it is only tried once,
+	// a closed VPK stays alive for as long as someone is still using it
+	auto open( const std::string& path ) -> std::shared_ptr<vpkpp::PackFile>;
+	auto close( const std::string& path ) -> void;
+	// Makes `path` open the tree parsed from `source`, a directory VPK known to have the same contents, its entries
+	// are still read from the numbered files next to `path`
+	auto link( const std::string& path, const std::string& source ) -> void;
+	[[nodiscard]] auto isLinked( const std::string& path ) -> bool;
+	// Entries of an open VPK sharing their payload are only read once, for the first of them, while the others wait
+	// for it and take its digests, which makes them `Known`
+	auto claimPayload( const std::string& path, const vpkpp::Entry& entry, PayloadDigests& digests ) -> PayloadClaim;
+	// Hands a claimed payload's digests to its aliases, nullptr if it couldn't be read and the next of them should try
+	auto sharePayload( const std::string& path, const vpkpp::Entry& entry, const PayloadDigests* digests ) -> void;
+	// Drops the digests shared for the payloads stored in a numbered VPK, once it changed they have to be read again
+	auto forgetPayloads( const std::string& path, std::uint32_t archiveIndex ) -> void;
+private:
+	auto closeLocked( const std::string& path ) -> void;
+
+	struct SharedPayload {
+		bool claimed{ false };
+		std::optional<PayloadDigests> digests;
+	};
+	struct Slot {
+		std::shared_ptr<vpkpp::PackFile> archive;
+		// an estimate, the size of the directory VPK its tree was parsed from
+		std::uint64_t cost{ 0 };
+		std::list<std::string>::iterator use;
+		// only the payloads with more than one entry
+		std::map<EntryPayload, SharedPayload> payloads;
+		// where the tree was parsed from if it was linked, closed along with it
+		std::string source;
+	};
+
+	std::mutex lock;
+	std::condition_variable archiveOpened;
+	std::condition_variable payloadShared;
+	std::uint64_t budget;
+	std::uint64_t used{ 0 };
+	// most recently used first
+	std::list<std::string> uses;
+	std::unordered_map<std::string, Slot> archives;
+	// VPKs being parsed, without holding the lock, and whether they were closed meanwhile
+	std::unordered_map<std::string, bool> opening;
+	// by the path of the VPKs sharing another's tree
+	std::unordered_map<std::string, std::string> links;
+};
+
+// Reads the entries of a single VPK, keeping the file it last read from open for the next entry, one per thread
+class EntryReader {
+public:
+	explicit EntryReader( const std::filesystem::path& vpkPath );
+
+	// Feeds the contents of an entry to `consume` in pieces of at most `pieceSize` bytes, instead of reading it whole
+	// like `PackFile::readEntry` does, returns false if it can't be read this way (compressed) or the read failed
+	auto read( const vpkpp::Entry& entry, std::size_t pieceSize, const std::function<void( const std::byte*, std::size_t )>& consume ) -> bool;
+private:
+	std::filesystem::path vpkPath;
+	// entries are mostly read file by file, a single handle keeps a VPK with hundreds of them within the limits
+	std::uint32_t archiveIndex{ 0 };
+	std::ifstream stream;
+	std::vector<std::byte> buffer;
+};
+
+// Same as `EntryReader::read`, for a single entry
+auto readEntryInPieces( const std::filesystem::path& vpkPath, const vpkpp::Entry& entry, std::size_t pieceSize, const std::function<void( const std::byte*, std::size_t )>& consume ) -> bool;
@@ -0,0 +1,211 @@
+#include "calibrate.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cryptopp/crc.h>
+#include <cryptopp/sha.h>
+#include <fmt/format.h>
+
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#include "checkpoint.hpp"
+#include "layout.hpp"
+#include "log.hpp"
+
+// first value of the only row of a profile
+static constexpr std::string_view PROFILE_MAGIC{ "profile" };
+// how much of the install is read at most, spread over its files, and how long a single experiment may take
+static constexpr std::uint64_t SAMPLE_SIZE{ 512 * 1024 * 1024 };
+static constexpr std::chrono::seconds EXPERIMENT_TIME{ 3 };
+// settings tried, from the least demanding up
+static constexpr unsigned THREAD_COUNTS[]{ 1, 2, 4, 8, 16 };
+static constexpr std::size_t READ_SIZES[]{ 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+// a more demanding setting has to be at least this much faster to be picked, measurements are never exact
+static constexpr double MARGIN{ 1.05 };
+
+struct SampleFile {
+	std::string path;
+	std::uint64_t size{ 0 };
+};
+
+static auto collectSample( const std::filesystem::path& root, std::vector<SampleFile>& sample ) -> void;
+static auto measure( const std::vector<SampleFile>& sample, unsigned threads, std::size_t readSize ) -> double;
+static auto dropFromCache( const std::vector<SampleFile>& sample ) -> bool;
+static auto writeTuningProfile( const std::filesystem::path& indexPath, const TuningProfile& profile ) -> bool;
+
+auto readTuningProfile( const std::filesystem::path& indexPath, TuningProfile& profile ) -> bool {
+	std::ifstream reader{ std::filesystem::path{ indexPath }.concat( ".profile" ), std::ios::in | std::ios::binary };
+	std::string line;
+	if (! std::getline( reader, line, '\xFD' ) )
+		return false;
+
+	std::vector<std::string> values;
+	for ( std::size_t start{ 0 }, end; ( end = line.find( '\xFF', start ) ) != std::string::npos; start = end + 1 )
+		values.push_back( line.substr( start, end - start ) );
+	if ( values.size() < 4 || values[ 0 ] != PROFILE_MAGIC )
+		return false;
+
+	try {
+		profile.ioThreads = static_cast<unsigned>( std::stoul( values[ 1 ] ) );
+		profile.readSize = static_cast<std::size_t>( std::stoull( values[ 2 ] ) );
+		profile.physicalOrder = values[ 3 ] == "1";
+	} catch ( const std::exception& ) {
+		return false;
+	}
+	return true;
+}
+
+auto calibrate( std::string_view root_, std::string_view indexLocation ) -> int {
+	const std::filesystem::path root{ root_ };
+	const std::filesystem::path indexPath{ root / indexLocation };
+
+	std::vector<SampleFile> sample;
+	collectSample( root, sample );
+	if ( sample.empty() ) {
+		Log_Error( "No file to read under `{}`, there's nothing to calibrate with.", root.string() );
+		return 1;
+	}
+	std::uint64_t sampleSize{ 0 };
+	for ( const auto& file : sample )
+		sampleSize += file.size;
+	Log_Info( "Calibrating with {} files ({} MB) under `{}`", sample.size(), sampleSize / 1024 / 1024, root.string() );
+	if (! dropFromCache( sample ) )
+		Log_Warn( "Files can't be dropped from the cache on this system, the results may be off." );
+
+	// fewest threads that read and hash about as fast as more of them
+	const auto maxThreads{ std::max( 2 * std::thread::hardware_concurrency(), 2u ) };
+	TuningProfile profile{};
+	double best{ 0 };
+	for ( const auto threads : THREAD_COUNTS ) {
+		if ( threads > maxThreads )
+			break;
+		const auto speed{ measure( sample, threads, READ_SIZES[ 1 ] ) };
+		Log_Info( "{} threads: {:.1f} MB/s", threads, speed / 1024 / 1024 );
+		if ( speed > best * MARGIN ) {
+			best = speed;
+			profile.ioThreads = threads;
+		}
+	}
+
+	// then the smallest reads which are about as fast as larger ones
+	best = 0;
+	for ( const auto readSize : READ_SIZES ) {
+		const auto speed{ measure( sample, profile.ioThreads, readSize ) };
+		Log_Info( "{} KB reads: {:.1f} MB/s", readSize / 1024, speed / 1024 / 1024 );
+		if ( speed > best * MARGIN ) {
+			best = speed;
+			profile.readSize = readSize;
+		}
+	}
+
+	// and whether going through files in the order they are on disk makes a difference
+	auto physical{ sample };
+	std::vector<std::pair<PhysicalLocation, std::size_t>> order;
+	for ( std::size_t i = 0; i < sample.size(); i++ )
+		order.emplace_back( getPhysicalLocation( sample[ i ].path ), i );
+	std::sort( order.begin(), order.end() );
+	for ( std::size_t i = 0; i < order.size(); i++ )
+		physical[ i ] = sample[ order[ i ].second ];
+	const auto speed{ measure( physical, profile.ioThreads, profile.readSize ) };
+	Log_Info( "Physical order: {:.1f} MB/s", speed / 1024 / 1024 );
+	profile.physicalOrder = speed > best * MARGIN;
+
+	if (! writeTuningProfile( indexPath, profile ) )
+		return 1;
+	Log_Info( "Saved {} threads per device, {} KB reads{} to `{}.profile`, `--new-index` and verification will use them", profile.ioThreads, profile.readSize / 1024, profile.physicalOrder ? " and physical order" : "", indexPath.string() );
+	return 0;
+}
+
+static auto collectSample( const std::filesystem::path& root, std::vector<SampleFile>& sample ) -> void {
+	std::vector<SampleFile> files;
+	std::uint64_t total{ 0 };
+	std::error_code err;
+	for ( std::filesystem::recursive_directory_iterator iterator{ root, err }, end; !err && iterator != end; iterator.increment( err ) ) {
+		if (! iterator->is_regular_file( err ) )
+			continue;
+		const auto size{ iterator->file_size( err ) };
+		// the verifier's own files aren't what it will be reading
+		if ( err || size == 0 || iterator->path().filename().string().find( "verifier_index" ) != std::string::npos )
+			continue;
+		files.push_back( { iterator->path().string(), size } );
+		total += size;
+	}
+
+	// every few files, so that the sample has as many small and large ones as the install
+	const auto step{ std::max<std::uint64_t>( total / SAMPLE_SIZE, 1 ) };
+	for ( std::size_t i = 0; i < files.size(); i += step )
+		sample.push_back( std::move( files[ i ] ) );
+}
+
+static auto measure( const std::vector<SampleFile>& sample, unsigned threads, std::size_t readSize ) -> double {
+	// what was read by the previous experiment would come from memory
+	dropFromCache( sample );
+
+	std::atomic<std::size_t> next{ 0 };
+	std::atomic<std::uint64_t> read{ 0 };
+	const auto start{ std::chrono::steady_clock::now() };
+	const auto deadline{ start + EXPERIMENT_TIME };
+	std::vector<std::thread> workers;
+	for ( unsigned i = 0; i < threads; i++ ) {
+		workers.emplace_back( [ & ] {
+			// same work as verifying, a read is only as fast as it can be hashed
+			std::vector<unsigned char> buffer( readSize );
+			CryptoPP::SHA1 sha1er{};
+			CryptoPP::CRC32 crc32er{};
+			for ( std::size_t file; std::chrono::steady_clock::now() < deadline && ( file = next++ ) < sample.size(); ) {
+				// unbuffered, so that every read is as large as the one being measured
+				std::ifstream reader{};
+				reader.rdbuf()->pubsetbuf( nullptr, 0 );
+				reader.open( sample[ file ].path, std::ios::in | std::ios::binary );
+				// large files would make it run over by much
+				while ( std::chrono::steady_clock::now() < deadline && ( reader.read( reinterpret_cast<char*>( buffer.data() ), static_cast<std::streamsize>( buffer.size() ) ) || reader.gcount() > 0 ) ) {
+					const auto count{ static_cast<std::size_t>( reader.gcount() ) };
+					sha1er.Update( buffer.data(), count );
+					crc32er.Update( buffer.data(), count );
+					read += count;
+				}
+				unsigned char discarded[ CryptoPP::SHA1::DIGESTSIZE ];
+				sha1er.Final( discarded );
+				crc32er.Final( discarded );
+			}
+		} );
+	}
+	for ( auto& worker : workers )
+		worker.join();
+
+	const std::chrono::duration<double> elapsed{ std::chrono::steady_clock::now() - start };
+	return static_cast<double>( read ) / std::max( elapsed.count(), 0.001 );
+}
+
+static auto dropFromCache( const std::vector<SampleFile>& sample ) -> bool {
+#if defined( __linux__ )
+	// only clean pages can be dropped, which is all of them as nothing here writes
+	for ( const auto& file : sample ) {
+		const int handle{ ::open( file.path.c_str(), O_RDONLY | O_CLOEXEC ) };
+		if ( handle < 0 )
+			continue;
+		::posix_fadvise( handle, 0, 0, POSIX_FADV_DONTNEED );
+		::close( handle );
+	}
+	return true;
+#else
+	(void) sample;
+	return false;
+#endif
+}
+
+static auto writeTuningProfile( const std::filesystem::path& indexPath, const TuningProfile& profile ) -> bool {
+	std::error_code err;
+	std::filesystem::create_directories( indexPath.parent_path(), err );
+	return writeAtomically( std::filesystem::path{ indexPath }.concat( ".profile" ), fmt::format( "{}\xFF{}\xFF{}\xFF{}\xFF\xFD", PROFILE_MAGIC, profile.ioThreads, profile.readSize, profile.physicalOrder ? 1 : 0 ) );
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <string_view>
+
+// The settings that read and hashed the fastest on the storage holding an install, saved next to its index as
+// `<index>.profile` by `--calibrate`, zero is left to the defaults
+struct TuningProfile {
+	// files read at once from each device
+	unsigned ioThreads{ 0 };
+	// bytes read from a file at once
+	std::size_t readSize{ 0 };
+	// reading files in the order they are laid out on disk paid off
+	bool physicalOrder{ false };
+};
+
+// Returns false if the index has no profile, or it can't be read
+auto readTuningProfile( const std::filesystem::path& indexPath, TuningProfile& profile ) -> bool;
+
+// Reads and hashes a sample of the files of the install with different settings, and saves the fastest as the
+// profile of its index
+auto calibrate( std::string_view root, std::string_view indexLocation ) -> int;
@@ -0,0 +1,191 @@
+#include "checkpoint.hpp"
+
+#include <csignal>
+#include <fstream>
+#include <sstream>
+
+#include <fmt/format.h>
+
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <unistd.h>
+#else
+	#include <fcntl.h>
+	#include <io.h>
+#endif
+
+#include "log.hpp"
+
+static volatile std::sig_atomic_t s_Interrupted{ 0 };
+
+static auto onInterrupt( int signal ) -> void;
+static auto readRows( const std::filesystem::path& path ) -> std::vector<std::vector<std::string>>;
+
+auto getCheckpointPath( const std::filesystem::path& indexPath, std::string_view kind ) -> std::filesystem::path {
+	return std::filesystem::path{ indexPath }.concat( fmt::format( ".{}.checkpoint", kind ) );
+}
+
+auto writeVerifyCheckpoint( const std::filesystem::path& path, const VerifyCheckpoint& checkpoint ) -> bool {
+	auto contents{ fmt::format( "verify\xFF{}\xFF{}\xFF{}\xFF{}\xFF{}\xFF{}\xFF\xFD", checkpoint.indexOffset, checkpoint.indexSize, checkpoint.indexTime, checkpoint.entries, checkpoint.errors, checkpoint.indexLastPath ) };
+	for ( const auto& report : checkpoint.reports )
+		contents += fmt::format( "{}\xFF{}\xFF{}\xFF{}\xFF\xFD", report.file, report.message, report.got, report.expected );
+
+	return writeAtomically( path, contents );
+}
+
+auto readVerifyCheckpoint( const std::filesystem::path& path, VerifyCheckpoint& checkpoint ) -> bool {
+	const auto rows{ readRows( path ) };
+	if ( rows.empty() || rows[ 0 ].size() < 7 || rows[ 0 ][ 0 ] != "verify" )
+		return false;
+
+	try {
+		checkpoint.indexOffset = std::stoull( rows[ 0 ][ 1 ] );
+		checkpoint.indexSize = std::stoull( rows[ 0 ][ 2 ] );
+		checkpoint.indexTime = std::stoll( rows[ 0 ][ 3 ] );
+		checkpoint.entries = std::stoul( rows[ 0 ][ 4 ] );
+		checkpoint.errors = std::stoul( rows[ 0 ][ 5 ] );
+		checkpoint.indexLastPath = rows[ 0 ][ 6 ];
+	} catch ( const std::exception& ) {
+		return false;
+	}
+
+	checkpoint.reports.clear();
+	for ( std::size_t i = 1; i < rows.size(); i++ ) {
+		if ( rows[ i ].size() < 4 )
+			return false;
+		checkpoint.reports.push_back( { rows[ i ][ 0 ], rows[ i ][ 1 ], rows[ i ][ 2 ], rows[ i ][ 3 ] } );
+	}
+	return true;
+}
+
+auto writeCreateCheckpoint( const std::filesystem::path& path, const CreateCheckpoint& checkpoint ) -> bool {
+	return writeAtomically( path, fmt::format( "create\xFF{}\xFF{}\xFF\xFD", checkpoint.indexOffset, checkpoint.count ) );
+}
+
+auto readCreateCheckpoint( const std::filesystem::path& path, CreateCheckpoint& checkpoint ) -> bool {
+	const auto rows{ readRows( path ) };
+	if ( rows.empty() || rows[ 0 ].size() < 3 || rows[ 0 ][ 0 ] != "create" )
+		return false;
+
+	try {
+		checkpoint.indexOffset = std::stoull( rows[ 0 ][ 1 ] );
+		checkpoint.count = std::stoul( rows[ 0 ][ 2 ] );
+	} catch ( const std::exception& ) {
+		return false;
+	}
+	return true;
+}
+
+auto writeVerifyResults( const std::filesystem::path& path, const VerifyCheckpoint& results, int status ) -> bool {
+	auto contents{ fmt::format( "results\xFF{}\xFF{}\xFF{}\xFF{}\xFF{}\xFF\xFD", status, results.indexSize, results.indexTime, results.entries, results.errors ) };
+	for ( const auto& report : results.reports )
+		contents += fmt::format( "{}\xFF{}\xFF{}\xFF{}\xFF\xFD", report.file, report.message, report.got, report.expected );
+
+	return writeAtomically( path, contents );
+}
+
+auto readVerifyResults( const std::filesystem::path& path, VerifyCheckpoint& results, int& status ) -> bool {
+	const auto rows{ readRows( path ) };
+	if ( rows.empty() || rows[ 0 ].size() < 6 || rows[ 0 ][ 0 ] != "results" )
+		return false;
+
+	try {
+		status = std::stoi( rows[ 0 ][ 1 ] );
+		results.indexSize = std::stoull( rows[ 0 ][ 2 ] );
+		results.indexTime = std::stoll( rows[ 0 ][ 3 ] );
+		results.entries = std::stoul( rows[ 0 ][ 4 ] );
+		results.errors = std::stoul( rows[ 0 ][ 5 ] );
+	} catch ( const std::exception& ) {
+		return false;
+	}
+
+	results.reports.clear();
+	for ( std::size_t i = 1; i < rows.size(); i++ ) {
+		if ( rows[ i ].size() < 4 )
+			return false;
+		results.reports.push_back( { rows[ i ][ 0 ], rows[ i ][ 1 ], rows[ i ][ 2 ], rows[ i ][ 3 ] } );
+	}
+	return true;
+}
+
+auto removeCheckpoint( const std::filesystem::path& path ) -> void {
+	std::error_code err;
+	std::filesystem::remove( path, err );
+}
+
+auto writeAtomically( const std::filesystem::path& path, const std::string& contents ) -> bool {
+	auto tmpPath{ std::filesystem::path{ path }.concat( ".tmp" ) };
+	{
+		std::ofstream writer{ tmpPath, std::ios::out | std::ios::trunc | std::ios::binary };
+		writer << contents;
+		if (! writer.good() ) {
+			Log_Error( "Failed to write `{}`", tmpPath.string() );
+			return false;
+		}
+	}
+
+	// a crash right after the rename must not leave an empty file in its place
+	if (! syncFile( tmpPath ) ) {
+		Log_Error( "Failed to write `{}`", tmpPath.string() );
+		return false;
+	}
+
+	std::error_code err;
+	std::filesystem::rename( tmpPath, path, err );
+	if ( err ) {
+		Log_Error( "Failed to write `{}`: {}", path.string(), err.message() );
+		return false;
+	}
+	syncFile( path.parent_path().empty() ? std::filesystem::path{ "." } : path.parent_path() );
+	return true;
+}
+
+auto syncFile( const std::filesystem::path& path ) -> bool {
+#ifndef _WIN32
+	const int file{ ::open( path.c_str(), O_RDONLY | O_CLOEXEC ) };
+	if ( file < 0 )
+		return false;
+	const bool synced{ ::fsync( file ) == 0 };
+	::close( file );
+	return synced;
+#else
+	// directories can't be opened like this, and don't need it, renames are journaled
+	if ( std::filesystem::is_directory( path ) )
+		return true;
+	const int file{ ::_wopen( path.c_str(), _O_WRONLY | _O_BINARY ) };
+	if ( file < 0 )
+		return false;
+	const bool synced{ ::_commit( file ) == 0 };
+	::_close( file );
+	return synced;
+#endif
+}
+
+auto installInterruptHandler() -> void {
+	std::signal( SIGINT, onInterrupt );
+	std::signal( SIGTERM, onInterrupt );
+}
+
+auto wasInterrupted() -> bool {
+	return s_Interrupted != 0;
+}
+
+static auto onInterrupt( int signal ) -> void {
+	s_Interrupted = 1;
+	// a second signal terminates immediately
+	std::signal( signal, SIG_DFL );
+}
+
+static auto readRows( const std::filesystem::path& path ) -> std::vector<std::vector<std::string>> {
+	std::vector<std::vector<std::string>> rows{};
+	std::ifstream reader{ path, std::ios::in | std::ios::binary };
+
+	std::string line;
+	while ( std::getline( reader, line, '\xFD' ) && !reader.eof() ) {
+		auto& row{ rows.emplace_back() };
+		std::istringstream values{ line };
+		for ( std::string value; std::getline( values, value, '\xFF' ); )
+			row.push_back( std::move( value ) );
+	}
+	return rows;
+}
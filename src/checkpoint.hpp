@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// how often long-running operations save their progress
+constexpr std::chrono::seconds CHECKPOINT_INTERVAL{ 10 };
+
+struct ReportRow {
+	std::string file;
+	std::string message;
+	std::string got;
+	std::string expected;
+};
+
+struct VerifyCheckpoint {
+	// offset of the first index row that was not verified yet, and the path of the row before it
+	std::uint64_t indexOffset{ 0 };
+	std::string indexLastPath;
+	// identity of the index the offset refers to
+	std::uint64_t indexSize{ 0 };
+	std::int64_t indexTime{ 0 };
+	unsigned entries{ 0 };
+	unsigned errors{ 0 };
+	std::vector<ReportRow> reports;
+};
+
+struct CreateCheckpoint {
+	// length of the index file up to the last row known to be complete
+	std::uint64_t indexOffset{ 0 };
+	unsigned count{ 0 };
+};
+
+auto getCheckpointPath( const std::filesystem::path& indexPath, std::string_view kind ) -> std::filesystem::path;
+
+auto writeVerifyCheckpoint( const std::filesystem::path& path, const VerifyCheckpoint& checkpoint ) -> bool;
+auto readVerifyCheckpoint( const std::filesystem::path& path, VerifyCheckpoint& checkpoint ) -> bool;
+
+auto writeCreateCheckpoint( const std::filesystem::path& path, const CreateCheckpoint& checkpoint ) -> bool;
+auto readCreateCheckpoint( const std::filesystem::path& path, CreateCheckpoint& checkpoint ) -> bool;
+
+// What one of the parts of a verification split over several processes found, and what it exited with, the index
+// identity is that of the whole index
+auto writeVerifyResults( const std::filesystem::path& path, const VerifyCheckpoint& results, int status ) -> bool;
+auto readVerifyResults( const std::filesystem::path& path, VerifyCheckpoint& results, int& status ) -> bool;
+
+auto removeCheckpoint( const std::filesystem::path& path ) -> void;
+
+// Writes to a temporary file first, so that `path` is never left half-written
+auto writeAtomically( const std::filesystem::path& path, const std::string& contents ) -> bool;
+// Waits for what was written to `path` to reach the disk, for a directory that's the files renamed into it
+auto syncFile( const std::filesystem::path& path ) -> bool;
+
+// Ctrl-C/SIGTERM handling, the first signal only raises a flag so that progress can be saved
+auto installInterruptHandler() -> void;
+auto wasInterrupted() -> bool;
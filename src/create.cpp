@@ -7,8 +7,13 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <optional>
 #include <regex>
+#include <set>
 #include <string_view>
+#include <tuple>
+#include <unordered_set>
 
 #include <cryptopp/crc.h>
 #include <cryptopp/filters.h>
@@ -18,16 +23,100 @@
 #include <sourcepp/FS.h>
 #include <vpkpp/format/VPK.h>
 
+#include "archive.hpp"
+#include "checkpoint.hpp"
+#include "devices.hpp"
+#include "digest.hpp"
+#include "index.hpp"
+#include "layout.hpp"
 #include "log.hpp"
-
-static auto enterVPK( std::ofstream& writer, std::string_view vpkPath, std::string_view vpkPathRel, const std::vector<std::regex>& excludes, const std::vector<std::regex>& includes, unsigned int& count ) -> bool;
+#include "throttle.hpp"
+#include "trace.hpp"
+#include "trust.hpp"
+
+// how much of a VPK entry is hashed at once, they're never read whole unless compressed
+static constexpr std::size_t ENTRY_PIECE_SIZE{ 1024 * 1024 };
+// how much of a loose file is read at once, unless calibrated otherwise
+static constexpr std::size_t FILE_READ_SIZE{ 64 * 1024 };
+
+struct ShardWriter {
+	IndexWriter writer;
+	// rows are appended to the partial file as they come, and sorted into the final one once done
+	std::filesystem::path path;
+	std::filesystem::path partialPath;
+	std::filesystem::path checkpointPath;
+};
+
+// The data-related columns of a loose file
+struct HashedFile {
+	std::uint64_t size{ 0 };
+	std::string sha1;
+	std::string crc32;
+};
+
+struct CreateState {
+	std::filesystem::path indexPath;
+	ShardMode shardBy{ ShardMode::None };
+	bool physicalOrder{ false };
+	std::size_t readSize{ FILE_READ_SIZE };
+	// loose files are hashed on the threads of the device they are on, which it keeps until done
+	std::optional<DeviceQueues> queues;
+	// a single shard with an empty key when not sharding
+	std::map<std::string, ShardWriter> shards;
+	// `archive\xFFpath` of the rows already present in the index when resuming
+	std::unordered_set<std::string> completed;
+	// digests of the files with several hard links, by device and inode, so that each is only read once
+	std::map<std::pair<std::uint64_t, std::uint64_t>, HashedFile> linked;
+	unsigned count{ 0 };
+	std::chrono::high_resolution_clock::time_point lastCheckpoint;
+};
+
+// A file that passed the rules, waiting for its batch to be indexed
+struct PendingFile {
+	std::string path;
+	std::string pathRel;
+	std::string depots;
+};
+
+// The rules of a single depot, applied on top of the global ones
+struct DepotRules {
+	std::string id;
+	std::vector<std::regex> excludes;
+	std::vector<std::regex> includes;
+	unsigned count{ 0 };
+};
+
+struct IndexRules {
+	std::vector<std::regex> fileExcludes;
+	std::vector<std::regex> fileIncludes;
+	std::vector<std::regex> archiveExcludes;
+	std::vector<std::regex> archiveIncludes;
+	// when empty, every file passing the global rules is indexed
+	std::vector<DepotRules> depots;
+};
+
+static auto createIndex( const std::filesystem::path& root, std::string_view indexLocation, bool skipArchives, IndexRules& rules, const CreateOptions& options ) -> int;
+static auto indexFiles( CreateState& state, std::vector<PendingFile>& files, bool skipArchives, const IndexRules& rules ) -> void;
+static auto indexFile( CreateState& state, const PendingFile& file, bool skipArchives, const IndexRules& rules, const HashedFile* hashed ) -> void;
+static auto hashFile( const std::string& path, std::size_t readSize, HashedFile& hashed ) -> bool;
+static auto classifyPath( const std::string& pathRel, IndexRules& rules, std::string& depots ) -> bool;
+static auto enterVPK( CreateState& state, std::string_view vpkPath, std::string_view vpkPathRel, std::string_view depots, const std::vector<std::regex>& excludes, const std::vector<std::regex>& includes ) -> bool;
+// Hashes an entry through the worker's own handle on the VPK's files, or the tree if it's compressed
+static auto hashEntry( const vpkpp::PackFile& vpk, EntryReader& reader, const std::string& path, const vpkpp::Entry& entry, HashedFile& hashed ) -> bool;
+static auto indexChunks( CreateState& state, std::string_view vpkPath, std::string_view vpkPathRel, std::string_view depots, const std::vector<std::pair<std::string, vpkpp::Entry>>& entries ) -> void;
+static auto openShard( CreateState& state, const std::string& key, bool append ) -> ShardWriter*;
+static auto writeRow( CreateState& state, std::string_view archive, std::string_view path, std::uint64_t size, std::string_view sha1, std::string_view crc32, std::string_view depots ) -> void;
+static auto loadCompletedRows( CreateState& state ) -> void;
+static auto loadCompletedShardRows( CreateState& state, const std::string& key ) -> void;
+static auto saveManifest( CreateState& state ) -> void;
+static auto saveCheckpoint( CreateState& state ) -> void;
 static auto buildRegexCollection( const std::vector<std::string>& regexStrings, std::string_view collectionType ) -> std::vector<std::regex>;
 static auto matchPath( const std::string& path, const std::vector<std::regex>& regexes ) -> bool;
 static auto globToRegex( std::string_view glob ) -> std::string;
 
 auto createFromRoot( std::string_view root_, std::string_view indexLocation, bool skipArchives,
 					 const std::vector<std::string>& fileExcludes, const std::vector<std::string>& fileIncludes,
-					 const std::vector<std::string>& archiveExcludes, const std::vector<std::string>& archiveIncludes ) -> int {
+					 const std::vector<std::string>& archiveExcludes, const std::vector<std::string>& archiveIncludes, const CreateOptions& options ) -> int {
 
 #ifdef WIN32
 	char correctSeparator = '\\';
@@ -43,33 +132,61 @@ auto createFromRoot( std::string_view root_, std::string_view indexLocation, boo
 	std::string indexLocationTmp { indexLocation };
 	std::replace( indexLocationTmp.begin(), indexLocationTmp.end(), badSeparator, correctSeparator );
 
-	const std::filesystem::path root{ rootTmp };
-	const std::filesystem::path indexPath{ root / indexLocationTmp };
+	auto start{ std::chrono::high_resolution_clock::now() };
+
+	IndexRules rules{};
+	rules.archiveExcludes = buildRegexCollection( archiveExcludes, "archive exclusion" );
+	rules.archiveIncludes = buildRegexCollection( archiveIncludes, "archive inclusion" );
+	rules.fileExcludes = buildRegexCollection( fileExcludes, "file exclusion" );
+	rules.fileIncludes = buildRegexCollection( fileIncludes, "file inclusion" );
+
+	// We always pass some regexes in from main.cpp, so not need for an ugly check if we actually
+	// compiled anything - fileExclusionREs will always be non-empty.
+	Log_Info( "Done in {}", std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::high_resolution_clock::now() - start ) );
+
+	return createIndex( rootTmp, indexLocationTmp, skipArchives, rules, options );
+}
+
+static auto createIndex( const std::filesystem::path& root, std::string_view indexLocation, bool skipArchives, IndexRules& rules, const CreateOptions& options ) -> int {
+	const std::filesystem::path indexPath{ root / indexLocation };
 
 	auto start{ std::chrono::high_resolution_clock::now() };
 	Log_Info( "Creating index file at `{}`", indexPath.string() );
+	TraceSpan span{ "create index", indexPath.string() };
+
+	CreateState state{};
+	state.indexPath = indexPath;
+	state.shardBy = options.shardBy;
+	state.physicalOrder = options.physicalOrder;
+	if ( options.readSize != 0 )
+		state.readSize = options.readSize;
+	state.queues.emplace( options.ioThreads );
+	if ( options.resume ) {
+		loadCompletedRows( state );
+	}
 
-	// open index file with a writer stream
-	std::ofstream writer{ indexPath, std::ios::out | std::ios::app };
-	if (! writer.good() ) {
-		Log_Error( "Failed to open index file for writing: N/D" );
+	// open index file with a writer stream, shards are opened as they are needed
+	if ( options.shardBy == ShardMode::None && !openShard( state, "", options.resume ) ) {
 		return 1;
 	}
 
-	std::vector<std::regex> archiveExclusionREs = buildRegexCollection( archiveExcludes, "archive exclusion" );
-	std::vector<std::regex> archiveInclusionREs = buildRegexCollection( archiveIncludes, "archive inclusion" );
-	std::vector<std::regex> fileExclusionREs = buildRegexCollection( fileExcludes, "file exclusion" );
-	std::vector<std::regex> fileInclusionREs = buildRegexCollection( fileIncludes, "file inclusion" );
-
-	// We always pass some regexes in from main.cpp, so not need for an ugly check if we actually
-	// compiled anything - fileExclusionREs will always be non-empty.
-	Log_Info( "Done in {}", std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::high_resolution_clock::now() - start ) );
+	installInterruptHandler();
+	state.lastCheckpoint = std::chrono::high_resolution_clock::now();
 
-	unsigned count{ 0 };
+	const auto& count{ state.count };
 	unsigned errors{ 0 };
+	std::string depots;
+	// files are collected in batches, so that they can be read in the order they are laid out on disk, a few at a time
+	// from each device
+	std::vector<PendingFile> batch;
+	const auto batchSize{ PHYSICAL_ORDER_BATCH };
 	// read and create index
 	std::filesystem::recursive_directory_iterator iterator{ root };
 	for ( const auto& entry : iterator ) {
+		if ( wasInterrupted() ) {
+			break;
+		}
+
 		auto path{ entry.path().string() };
 		sourcepp::string::normalizeSlashes( path );
 
@@ -81,76 +198,203 @@ auto createFromRoot( std::string_view root_, std::string_view indexLocation, boo
 		auto pathRel{ std::filesystem::relative( path, root ).string() };
 		sourcepp::string::normalizeSlashes( pathRel );
 
-		if ( ( !fileExclusionREs.empty() && matchPath( pathRel, fileExclusionREs ) ) || ( !fileInclusionREs.empty() && !matchPath( pathRel, fileInclusionREs ) ) ) {
+		if (! classifyPath( pathRel, rules, depots ) ) {
 			// File is either excluded or not included
 			continue;
 		}
 
-		if ( !skipArchives && path.ends_with( ".vpk" ) ) {
-			if ( enterVPK( writer, path, pathRel, archiveExclusionREs, archiveInclusionREs, count ) ) {
-				Log_Info( "Processed VPK at `{}`", path );
+		batch.push_back( { std::move( path ), std::move( pathRel ), depots } );
+		if ( batch.size() >= batchSize ) {
+			indexFiles( state, batch, skipArchives, rules );
+		}
+	}
+	indexFiles( state, batch, skipArchives, rules );
+
+	if ( wasInterrupted() ) {
+		saveCheckpoint( state );
+		Log_Warn( "Interrupted after {} files, run again with `--resume` to continue.", count );
+		return 1;
+	}
+	int result{ 0 };
+	for ( auto& [ key, shard ] : state.shards ) {
+		if ( !shard.writer.close() || !compactIndex( shard.partialPath, shard.path ) ) {
+			// keep what we've got, so that it can be resumed
+			saveCheckpoint( state );
+			result = 1;
+			continue;
+		}
+		std::error_code err;
+		std::filesystem::remove( shard.partialPath, err );
+		removeCheckpoint( shard.checkpointPath );
+	}
+	if ( options.shardBy != ShardMode::None ) {
+		saveManifest( state );
+		Log_Info( "Wrote {} index shards.", state.shards.size() );
+	}
+
+	for ( const auto& depot : rules.depots )
+		Log_Info( "Depot with ID `{}` contains {} files.", depot.id, depot.count );
+
+	auto end{ std::chrono::high_resolution_clock::now() };
+	Log_Info( "Finished processing {} files in {}! (with {} errors)", count, std::chrono::duration_cast<std::chrono::seconds>( end - start ), errors );
+
+	return result;
+}
+
+static auto indexFiles( CreateState& state, std::vector<PendingFile>& files, bool skipArchives, const IndexRules& rules ) -> void {
+	if ( state.physicalOrder && files.size() > 1 ) {
+		std::vector<std::pair<PhysicalLocation, std::size_t>> order;
+		order.reserve( files.size() );
+		for ( std::size_t i = 0; i < files.size(); i++ )
+			order.emplace_back( getPhysicalLocation( files[ i ].path ), i );
+		std::sort( order.begin(), order.end() );
+
+		std::vector<PendingFile> sorted;
+		sorted.reserve( files.size() );
+		for ( const auto& [ location, i ] : order )
+			sorted.push_back( std::move( files[ i ] ) );
+		files = std::move( sorted );
+	}
+
+	// loose files are hashed ahead of time, VPKs are walked entry by entry while writing the rows
+	std::vector<std::optional<HashedFile>> hashed( files.size() );
+	// hard links to a file hashed earlier, or in this batch, take its digests instead of reading it again
+	std::vector<std::optional<std::pair<std::uint64_t, std::uint64_t>>> links( files.size() );
+	std::map<std::pair<std::uint64_t, std::uint64_t>, std::size_t> firstLinks;
+	for ( std::size_t i = 0; i < files.size(); i++ ) {
+		const auto& file{ files[ i ] };
+		if ( ( !skipArchives && file.path.ends_with( ".vpk" ) ) || state.completed.contains( ".\xFF" + file.pathRel ) )
+			continue;
+		if ( FileIdentity identity{}; getFileIdentity( file.path, identity ) && identity.links > 1 && identity.inode != 0 ) {
+			links[ i ].emplace( identity.device, identity.inode );
+			if ( const auto known{ state.linked.find( *links[ i ] ) }; known != state.linked.end() ) {
+				hashed[ i ] = known->second;
 				continue;
 			}
+			if (! firstLinks.try_emplace( *links[ i ], i ).second )
+				continue;
+		}
+		state.queues->push( file.path, [ &files, &hashed, i, readSize = state.readSize ]( std::size_t ) {
+			if ( wasInterrupted() )
+				return;
+			if ( HashedFile result{}; hashFile( files[ i ].path, readSize, result ) )
+				hashed[ i ] = std::move( result );
+		} );
+	}
+	{
+		TraceSpan span{ "hash batch" };
+		state.queues->run();
+	}
+	for ( std::size_t i = 0; i < files.size(); i++ ) {
+		if ( !links[ i ] || hashed[ i ] )
+			continue;
+		const auto first{ firstLinks.find( *links[ i ] ) };
+		if ( first != firstLinks.end() && hashed[ first->second ] )
+			hashed[ i ] = hashed[ first->second ];
+	}
+	for ( const auto& [ link, first ] : firstLinks )
+		if ( hashed[ first ] )
+			state.linked.emplace( link, *hashed[ first ] );
+
+	for ( std::size_t i = 0; i < files.size(); i++ ) {
+		// rows are only ever appended, the checkpoint doesn't care about the order
+		if ( wasInterrupted() ) {
+			break;
+		}
+		if ( std::chrono::high_resolution_clock::now() - state.lastCheckpoint >= CHECKPOINT_INTERVAL ) {
+			saveCheckpoint( state );
+		}
+		indexFile( state, files[ i ], skipArchives, rules, hashed[ i ] ? &*hashed[ i ] : nullptr );
+	}
+	files.clear();
+}
 
-			Log_Warn( "Unable to open VPK at `{}`. Treating as a regular file...", path );
+static auto indexFile( CreateState& state, const PendingFile& file, bool skipArchives, const IndexRules& rules, const HashedFile* hashed ) -> void {
+	const auto& path{ file.path };
+	const auto& pathRel{ file.pathRel };
+
+	if ( !skipArchives && path.ends_with( ".vpk" ) ) {
+		if ( enterVPK( state, path, pathRel, file.depots, rules.archiveExcludes, rules.archiveIncludes ) ) {
+			Log_Info( "Processed VPK at `{}`", path );
+			return;
 		}
 
-		// open file
+		Log_Warn( "Unable to open VPK at `{}`. Treating as a regular file...", path );
+	}
+
+	if ( state.completed.contains( ".\xFF" + pathRel ) ) {
+		Log_Verbose( "Skipping already indexed file `{}`", path );
+		return;
+	}
+
+	// VPKs that failed to open weren't hashed ahead of time, any other file missing its digests failed to be read
+	HashedFile local{};
+	if (! hashed ) {
+		if (! ( !skipArchives && path.ends_with( ".vpk" ) && hashFile( path, state.readSize, local ) ) )
+			return;
+		hashed = &local;
+	}
+
+	// write out entry
+	writeRow( state, ".", pathRel, hashed->size, hashed->sha1, hashed->crc32, file.depots );
+	Log_Verbose( "Processed file `{}`", path );
+	state.count += 1;
+}
+
+static auto hashFile( const std::string& path, std::size_t readSize, HashedFile& hashed ) -> bool {
+	TraceSpan span{ "hash file", path };
+	// open file
 #ifndef _WIN32
-		std::FILE* file{ std::fopen( path.c_str(), "rb" ) };
+	std::FILE* handle{ std::fopen( path.c_str(), "rb" ) };
 #else
-		std::FILE* file{ nullptr };
-		fopen_s( &file, path.c_str(), "rb" );
+	std::FILE* handle{ nullptr };
+	fopen_s( &handle, path.c_str(), "rb" );
 #endif
-		if (! file ) {
-			Log_Error( "Failed to open file: `{}`", path );
-			continue;
-		}
-
-		// data-related columns
-		// size
-		std::fseek( file, 0, SEEK_END );
-		const auto size{ std::ftell( file ) };
-		std::fseek( file, 0, 0 );
-
-		// sha1/crc32
-		CryptoPP::SHA1 sha1er{};
-		CryptoPP::CRC32 crc32er{};
+	if (! handle ) {
+		Log_Error( "Failed to open file: `{}`", path );
+		return false;
+	}
 
-		unsigned char buffer[ 2048 ];
-		while ( auto bufCount = std::fread( buffer, 1, sizeof( buffer ), file ) ) {
-			sha1er.Update( buffer, bufCount );
-			crc32er.Update( buffer, bufCount );
-		}
-		std::fclose( file );
+	// size
+	std::fseek( handle, 0, SEEK_END );
+	hashed.size = static_cast<std::uint64_t>( std::ftell( handle ) );
+	std::fseek( handle, 0, 0 );
 
-		std::array<CryptoPP::byte, CryptoPP::SHA1::DIGESTSIZE> sha1Hash{};
-		sha1er.Final( sha1Hash.data() );
-		std::array<CryptoPP::byte, CryptoPP::CRC32::DIGESTSIZE> crc32Hash{};
-		crc32er.Final( crc32Hash.data() );
+	// sha1/crc32
+	CryptoPP::SHA1 sha1er{};
+	CryptoPP::CRC32 crc32er{};
 
-		std::string sha1HashStr;
-		std::string crc32HashStr;
+	// kept by each thread, files are hashed one after the other
+	thread_local std::vector<unsigned char> buffer;
+	buffer.resize( readSize );
+	while ( true ) {
+		std::size_t bufCount;
 		{
-			CryptoPP::StringSource sha1HashStrSink{ sha1Hash.data(), sha1Hash.size(), true, new CryptoPP::HexEncoder{ new CryptoPP::StringSink{ sha1HashStr } } };
-			CryptoPP::StringSource crc32HashStrSink{ crc32Hash.data(), crc32Hash.size(), true, new CryptoPP::HexEncoder{ new CryptoPP::StringSink{ crc32HashStr } } };
+			ThrottledRead throttle{ buffer.size() };
+			bufCount = std::fread( buffer.data(), 1, buffer.size(), handle );
 		}
-
-		// write out entry
-		writer << fmt::format( ".\xFF{}\xFF{}\xFF{}\xFF{}\xFF\xFD", pathRel, size, sha1HashStr, crc32HashStr );
-		Log_Verbose( "Processed file `{}`", path );
-		count += 1;
+		if ( bufCount == 0 )
+			break;
+		sha1er.Update( buffer.data(), bufCount );
+		crc32er.Update( buffer.data(), bufCount );
 	}
+	std::fclose( handle );
 
-	auto end{ std::chrono::high_resolution_clock::now() };
-	Log_Info( "Finished processing {} files in {}! (with {} errors)", count, std::chrono::duration_cast<std::chrono::seconds>( end - start ), errors );
+	std::array<CryptoPP::byte, CryptoPP::SHA1::DIGESTSIZE> sha1Hash{};
+	sha1er.Final( sha1Hash.data() );
+	std::array<CryptoPP::byte, CryptoPP::CRC32::DIGESTSIZE> crc32Hash{};
+	crc32er.Final( crc32Hash.data() );
 
-	return 0;
+	{
+		CryptoPP::StringSource sha1HashStrSink{ sha1Hash.data(), sha1Hash.size(), true, new CryptoPP::HexEncoder{ new CryptoPP::StringSink{ hashed.sha1 } } };
+		CryptoPP::StringSource crc32HashStrSink{ crc32Hash.data(), crc32Hash.size(), true, new CryptoPP::HexEncoder{ new CryptoPP::StringSink{ hashed.crc32 } } };
+	}
+	return true;
 }
 
 auto createFromSteamDepotConfigs( const std::string& configPath, const std::vector<std::string>& depotIDs, std::string_view indexLocation,
 								  bool skipArchives, const std::vector<std::string>& fileExcludes, const std::vector<std::string>& fileIncludes,
-								  const std::vector<std::string>& archiveExcludes, const std::vector<std::string>& archiveIncludes ) -> int {
+								  const std::vector<std::string>& archiveExcludes, const std::vector<std::string>& archiveIncludes, const CreateOptions& options ) -> int {
 	using namespace kvpp;
 
 	/*
@@ -185,6 +429,15 @@ auto createFromSteamDepotConfigs( const std::string& configPath, const std::vect
 		return 1;
 	}
 
+	// compile the rules shared by all depots only once
+	const auto globalExcludes{ buildRegexCollection( fileExcludes, "file exclusion" ) };
+	const auto globalIncludes{ buildRegexCollection( fileIncludes, "file inclusion" ) };
+	const auto globalArchiveExcludes{ buildRegexCollection( archiveExcludes, "archive exclusion" ) };
+	const auto globalArchiveIncludes{ buildRegexCollection( archiveIncludes, "archive inclusion" ) };
+
+	// depots are grouped by content root, so that each root is only walked once
+	std::vector<std::pair<std::filesystem::path, IndexRules>> roots;
+
 	auto contentRoot{ std::filesystem::path{ configPath }.parent_path() / appBuildConfig[ "ContentRoot" ].getValue() };
 	const auto& depots = appBuildConfig[ "Depots" ];
 	for ( const auto& depot : depots.getChildren() ) {
@@ -192,9 +445,11 @@ auto createFromSteamDepotConfigs( const std::string& configPath, const std::vect
 			continue;
 		}
 
-		const auto createFromSteamDepotConfig{ [ &configPath, &indexLocation, skipArchives, &fileExcludes, &fileIncludes, &archiveExcludes, &archiveIncludes, &contentRoot ]( const auto& depotBuildConfig ) {
+		const auto addSteamDepotConfig{ [ &configPath, &contentRoot, &roots, &globalExcludes, &globalIncludes, &globalArchiveExcludes, &globalArchiveIncludes, &depot ]( const auto& depotBuildConfig ) {
+			DepotRules rules{};
+			rules.id = depot.getKey();
+
 			std::vector<std::string> exclusionRegexes;
-			exclusionRegexes.insert( exclusionRegexes.end(), fileExcludes.begin(), fileExcludes.end() );
 			for ( int i = 0; i < depotBuildConfig.getChildCount( "FileExclusion" ); i++ ) {
 				std::string exclusion{ depotBuildConfig( "FileExclusion", i ).getValue() };
 				sourcepp::string::normalizeSlashes( exclusion );
@@ -203,8 +458,9 @@ auto createFromSteamDepotConfigs( const std::string& configPath, const std::vect
 
 				exclusionRegexes.emplace_back( globToRegex( exclusion ) );
 			}
+			rules.excludes = buildRegexCollection( exclusionRegexes, "depot exclusion" );
 
-			std::vector<std::string> inclusionRegexes{ fileIncludes };
+			std::vector<std::string> inclusionRegexes;
 			for ( int i = 0; i < depotBuildConfig.getChildCount( "FileMapping" ); i++ ) {
 				std::string inclusion{ depotBuildConfig( "FileMapping", i )[ "LocalPath" ].getValue() };
 				sourcepp::string::normalizeSlashes( inclusion );
@@ -213,20 +469,18 @@ auto createFromSteamDepotConfigs( const std::string& configPath, const std::vect
 
 				inclusionRegexes.emplace_back( globToRegex( inclusion ) );
 			}
+			rules.includes = buildRegexCollection( inclusionRegexes, "depot inclusion" );
 
-			createFromRoot(
-				depotBuildConfig.hasChild( "ContentRoot" ) ? ( std::filesystem::path{ configPath }.parent_path() / depotBuildConfig[ "ContentRoot" ].getValue() ).string() : contentRoot.string(),
-				indexLocation,
-				skipArchives,
-				exclusionRegexes,
-				inclusionRegexes,
-				archiveExcludes,
-				archiveIncludes
-			);
+			const auto root{ depotBuildConfig.hasChild( "ContentRoot" ) ? std::filesystem::path{ configPath }.parent_path() / depotBuildConfig[ "ContentRoot" ].getValue() : contentRoot };
+			auto group{ std::find_if( roots.begin(), roots.end(), [ &root ]( const auto& item ) { return item.first == root; } ) };
+			if ( group == roots.end() ) {
+				group = roots.insert( roots.end(), { root, IndexRules{ globalExcludes, globalIncludes, globalArchiveExcludes, globalArchiveIncludes, {} } } );
+			}
+			group->second.depots.push_back( std::move( rules ) );
 		} };
 
 		if ( depot.getChildCount() > 0 ) {
-			createFromSteamDepotConfig( depot );
+			addSteamDepotConfig( depot );
 		} else {
 			auto depotPath{ ( std::filesystem::path{ configPath }.parent_path() / depot.getValue() ).string() };
 			if ( !std::filesystem::exists( depotPath ) ) {
@@ -242,62 +496,358 @@ auto createFromSteamDepotConfigs( const std::string& configPath, const std::vect
 				continue;
 			}
 
-			createFromSteamDepotConfig( depotBuildConfig );
+			addSteamDepotConfig( depotBuildConfig );
 		}
 
-		Log_Info( "Finished processing depot with ID `{}`.", depot.getKey() );
+		Log_Info( "Loaded depot with ID `{}`.", depot.getKey() );
 		configs++;
 	}
 
+	// a single walk per content root, every file is matched against all depots sharing it
+	int result{ 0 };
+	for ( auto& [ root, rules ] : roots ) {
+		if ( createIndex( root, indexLocation, skipArchives, rules, options ) != 0 )
+			result = 1;
+	}
+
 	Log_Info( "Finished processing {} depot configs in {}.", configs, std::chrono::duration_cast<std::chrono::seconds>( std::chrono::high_resolution_clock::now() - start ) );
-	return 0;
+	return result;
 }
 
-static auto enterVPK( std::ofstream& writer, std::string_view vpkPath, std::string_view vpkPathRel, const std::vector<std::regex>& excludes, const std::vector<std::regex>& includes, unsigned int& count ) -> bool {
+static auto enterVPK( CreateState& state, std::string_view vpkPath, std::string_view vpkPathRel, std::string_view depots, const std::vector<std::regex>& excludes, const std::vector<std::regex>& includes ) -> bool {
 	using namespace vpkpp;
+	TraceSpan span{ "enter VPK", vpkPath };
 
-	const auto vpk = VPK::open( std::string{ vpkPath } );
+	std::unique_ptr<PackFile> vpk;
+	{
+		TraceSpan openSpan{ "open VPK", vpkPath };
+		vpk = VPK::open( std::string{ vpkPath } );
+	}
 	if (! vpk ) {
 		return false;
 	}
 
-	vpk->runForAllEntries( [ &writer, &vpkPath, &vpkPathRel, &excludes, &includes, &count, &vpk ]( const std::string& path, const Entry& entry ) {
-		if ( !excludes.empty() && matchPath( path, excludes) ) {
-			return;
+	// collected first, so that they can be read in the order they are stored and the walk can be stopped
+	std::vector<std::pair<std::string, Entry>> entries;
+	vpk->runForAllEntries( [ &entries ]( const std::string& path, const Entry& entry ) {
+		entries.emplace_back( path, entry );
+	} );
+	indexChunks( state, vpkPath, vpkPathRel, depots, entries );
+	if ( state.physicalOrder ) {
+		std::stable_sort( entries.begin(), entries.end(), []( const auto& a, const auto& b ) {
+			return std::tie( a.second.archiveIndex, a.second.offset ) < std::tie( b.second.archiveIndex, b.second.offset );
+		} );
+	}
+
+	std::erase_if( entries, [ & ]( const auto& item ) {
+		const auto& path{ item.first };
+		if ( !excludes.empty() && matchPath( path, excludes ) )
+			return true;
+		if ( !includes.empty() && !matchPath( path, includes ) )
+			return true;
+		return state.completed.contains( fmt::format( "{}\xFF{}", vpkPathRel, path ) );
+	} );
+
+	// entries pointing at the same data are aliases of a single payload, which is hashed once for all of them, kept until
+	// its last alias is written
+	std::map<EntryPayload, unsigned> aliases;
+	for ( const auto& [ path, entry ] : entries )
+		if ( const auto payload{ getEntryPayload( entry ) } )
+			aliases[ *payload ] += 1;
+	std::erase_if( aliases, []( const auto& alias ) { return alias.second < 2; } );
+	std::map<EntryPayload, HashedFile> payloads;
+
+	// hashed in batches on the threads of the VPK's device, each with its own handle on the VPK's files, and written in
+	// the order they are listed in once their batch is done
+	auto& count{ state.count };
+	std::vector<std::unique_ptr<EntryReader>> readers;
+	std::vector<std::optional<HashedFile>> hashed;
+	std::vector<std::optional<EntryPayload>> shared;
+	std::map<EntryPayload, std::size_t> firstAliases;
+	for ( std::size_t first = 0; first < entries.size() && !wasInterrupted(); first += PHYSICAL_ORDER_BATCH ) {
+		const auto batchSize{ std::min( PHYSICAL_ORDER_BATCH, entries.size() - first ) };
+		hashed.assign( batchSize, std::nullopt );
+		shared.assign( batchSize, std::nullopt );
+		firstAliases.clear();
+		for ( std::size_t i = 0; i < batchSize; i++ ) {
+			if ( auto payload{ getEntryPayload( entries[ first + i ].second ) }; payload && aliases.contains( *payload ) ) {
+				shared[ i ] = payload;
+				if ( payloads.contains( *payload ) || !firstAliases.try_emplace( *payload, i ).second )
+					continue;
+			}
+			state.queues->push( getArchiveChunkPath( vpkPath, entries[ first + i ].second.archiveIndex ), [ &, first, i ]( std::size_t worker ) {
+				if ( wasInterrupted() )
+					return;
+				const auto& [ path, entry ]{ entries[ first + i ] };
+				if ( HashedFile result{}; hashEntry( *vpk, *readers[ worker ], path, entry, result ) )
+					hashed[ i ] = std::move( result );
+			} );
+		}
+		while ( readers.size() < state.queues->workerCount() )
+			readers.push_back( std::make_unique<EntryReader>( vpkPath ) );
+		{
+			TraceSpan batchSpan{ "hash entries", vpkPath };
+			state.queues->run();
 		}
+		for ( const auto& [ payload, i ] : firstAliases )
+			if ( hashed[ i ] )
+				payloads.emplace( payload, *hashed[ i ] );
+
+		for ( std::size_t i = 0; i < batchSize; i++ ) {
+			const auto& [ path, entry ]{ entries[ first + i ] };
+			if ( shared[ i ] ) {
+				const auto payload{ payloads.find( *shared[ i ] ) };
+				if ( !hashed[ i ] && payload != payloads.end() ) {
+					// the crc32 comes from the directory, an alias has its own
+					hashed[ i ] = payload->second;
+					hashed[ i ]->crc32 = toHex( { reinterpret_cast<const unsigned char*>( &entry.crc32 ), sizeof( entry.crc32 ) } );
+				}
+				if ( payload != payloads.end() && --aliases[ *shared[ i ] ] == 0 )
+					payloads.erase( payload );
+			}
+			if (! hashed[ i ] ) {
+				if (! wasInterrupted() )
+					Log_Error( "Failed to open file: `{}/{}`", vpkPath, path );
+				continue;
+			}
 
-		if ( !includes.empty() && !matchPath( path, includes ) ) {
-			return;
+			// write out entry
+			writeRow( state, vpkPathRel, path, hashed[ i ]->size, hashed[ i ]->sha1, hashed[ i ]->crc32, depots );
+			Log_Verbose( "Processed file `{}/{}`", vpkPath, path );
+			count += 1;
 		}
 
-		auto entryData{ vpk->readEntry( path ) };
-		if (! entryData ) {
-			Log_Error( "Failed to open file: `{}/{}`", vpkPath, path );
-			return;
+		if ( std::chrono::high_resolution_clock::now() - state.lastCheckpoint >= CHECKPOINT_INTERVAL ) {
+			saveCheckpoint( state );
 		}
+	}
 
-		// sha1 (crc32 is already computed)
-		CryptoPP::SHA1 sha1er{};
-		sha1er.Update( reinterpret_cast<const CryptoPP::byte*>( entryData->data() ), entryData->size() );
-		std::array<CryptoPP::byte, CryptoPP::SHA1::DIGESTSIZE> sha1Hash{};
-		sha1er.Final( sha1Hash.data() );
+	return true;
+}
 
-		std::string sha1HashStr;
-		std::string crc32HashStr;
+static auto hashEntry( const vpkpp::PackFile& vpk, EntryReader& reader, const std::string& path, const vpkpp::Entry& entry, HashedFile& hashed ) -> bool {
+	TraceSpan span{ "hash entry", path };
+
+	// sha1 (crc32 is already computed)
+	CryptoPP::SHA1 sha1er{};
+	std::uint64_t size{ 0 };
+	const auto hash{ [ &sha1er, &size ]( const std::byte* data, std::size_t count ) {
+		sha1er.Update( reinterpret_cast<const CryptoPP::byte*>( data ), count );
+		size += count;
+	} };
+	if (! reader.read( entry, ENTRY_PIECE_SIZE, hash ) ) {
+		sha1er.Restart();
+		size = 0;
+		std::optional<std::vector<std::byte>> entryData;
 		{
-			CryptoPP::StringSource sha1HashStrSink{ sha1Hash.data(), sha1Hash.size(), true, new CryptoPP::HexEncoder{ new CryptoPP::StringSink{ sha1HashStr } } };
-			CryptoPP::StringSource crc32HashStrSink{ reinterpret_cast<const CryptoPP::byte*>( &entry.crc32 ), sizeof( entry.crc32 ), true, new CryptoPP::HexEncoder{ new CryptoPP::StringSink{ crc32HashStr } } };
+			// decompression included
+			TraceSpan readSpan{ "read entry", path };
+			ThrottledRead throttle{ static_cast<std::size_t>( entry.length ) };
+			entryData = vpk.readEntry( path );
 		}
+		if (! entryData )
+			return false;
+		hash( entryData->data(), entryData->size() );
+	}
 
-		// write out entry
-		writer << fmt::format( "{}\xFF{}\xFF{}\xFF{}\xFF{}\xFF\xFD", vpkPathRel, path, entryData->size(), sha1HashStr, crc32HashStr );
-		Log_Verbose( "Processed file `{}/{}`", vpkPath, path );
-		count += 1;
-	} );
-
+	std::array<CryptoPP::byte, CryptoPP::SHA1::DIGESTSIZE> sha1Hash{};
+	sha1er.Final( sha1Hash.data() );
+	hashed.size = size;
+	{
+		CryptoPP::StringSource sha1HashStrSink{ sha1Hash.data(), sha1Hash.size(), true, new CryptoPP::HexEncoder{ new CryptoPP::StringSink{ hashed.sha1 } } };
+		CryptoPP::StringSource crc32HashStrSink{ reinterpret_cast<const CryptoPP::byte*>( &entry.crc32 ), sizeof( entry.crc32 ), true, new CryptoPP::HexEncoder{ new CryptoPP::StringSink{ hashed.crc32 } } };
+	}
 	return true;
 }
 
+static auto indexChunks( CreateState& state, std::string_view vpkPath, std::string_view vpkPathRel, std::string_view depots, const std::vector<std::pair<std::string, vpkpp::Entry>>& entries ) -> void {
+	// the directory file and every numbered file holding entries, all of them regardless of the archive rules
+	std::set<std::uint32_t> archiveIndices{ vpkpp::VPK::VPK_DIR_INDEX };
+	for ( const auto& [ path, entry ] : entries )
+		archiveIndices.insert( entry.archiveIndex );
+
+	std::vector<std::pair<std::string, std::string>> chunks;
+	for ( const auto archiveIndex : archiveIndices ) {
+		auto chunkRel{ getArchiveChunkPath( vpkPathRel, archiveIndex ).string() };
+		sourcepp::string::normalizeSlashes( chunkRel );
+		if ( state.completed.contains( ".\xFF" + chunkRel ) )
+			continue;
+		chunks.emplace_back( getArchiveChunkPath( vpkPath, archiveIndex ).string(), std::move( chunkRel ) );
+	}
+
+	// each is read whole, on the threads of its device
+	std::vector<std::optional<HashedFile>> hashed( chunks.size() );
+	for ( std::size_t i = 0; i < chunks.size(); i++ ) {
+		state.queues->push( chunks[ i ].first, [ &chunks, &hashed, i, readSize = state.readSize ]( std::size_t ) {
+			if ( wasInterrupted() )
+				return;
+			if ( HashedFile result{}; hashFile( chunks[ i ].first, readSize, result ) )
+				hashed[ i ] = std::move( result );
+		} );
+	}
+	{
+		TraceSpan span{ "hash VPK files", vpkPath };
+		state.queues->run();
+	}
+
+	for ( std::size_t i = 0; i < chunks.size(); i++ ) {
+		if (! hashed[ i ] ) {
+			// missing or unreadable, its entries will only ever be verified one by one
+			if (! wasInterrupted() )
+				Log_Warn( "Failed to read VPK file `{}`, it has no digest in the index", chunks[ i ].first );
+			continue;
+		}
+		writeRow( state, ".", chunks[ i ].second, hashed[ i ]->size, hashed[ i ]->sha1, hashed[ i ]->crc32, depots );
+		Log_Verbose( "Processed VPK chunk `{}`", chunks[ i ].first );
+		state.count += 1;
+	}
+}
+
+static auto classifyPath( const std::string& pathRel, IndexRules& rules, std::string& depots ) -> bool {
+	depots.clear();
+	if ( matchPath( pathRel, rules.fileExcludes ) ) {
+		return false;
+	}
+
+	const bool globallyIncluded{ matchPath( pathRel, rules.fileIncludes ) };
+	if ( rules.depots.empty() ) {
+		return rules.fileIncludes.empty() || globallyIncluded;
+	}
+
+	// a file may be shipped by several depots, it's still only hashed and written once
+	for ( auto& depot : rules.depots ) {
+		if ( matchPath( pathRel, depot.excludes ) ) {
+			continue;
+		}
+		const bool included{ ( rules.fileIncludes.empty() && depot.includes.empty() ) || globallyIncluded || matchPath( pathRel, depot.includes ) };
+		if (! included ) {
+			continue;
+		}
+
+		if (! depots.empty() )
+			depots += ',';
+		depots += depot.id;
+		depot.count += 1;
+	}
+	return !depots.empty();
+}
+
+static auto openShard( CreateState& state, const std::string& key, bool append ) -> ShardWriter* {
+	if ( const auto it{ state.shards.find( key ) }; it != state.shards.end() ) {
+		return &it->second;
+	}
+
+	auto path{ state.indexPath };
+	if (! key.empty() ) {
+		// `verifier_index.rsv` -> `verifier_index.<key>.rsv`
+		path.replace_filename( fmt::format( "{}.{}{}", state.indexPath.stem().string(), key, state.indexPath.extension().string() ) );
+	}
+
+	ShardWriter shard{};
+	shard.path = path;
+	shard.partialPath = std::filesystem::path{ path }.concat( ".partial" );
+	if (! shard.writer.open( shard.partialPath, append ) ) {
+		Log_Error( "Failed to open index file for writing: `{}`", shard.partialPath.string() );
+		return nullptr;
+	}
+	shard.checkpointPath = getCheckpointPath( path, "create" );
+	return &state.shards.emplace( key, std::move( shard ) ).first->second;
+}
+
+static auto writeRow( CreateState& state, std::string_view archive, std::string_view path, std::uint64_t size, std::string_view sha1, std::string_view crc32, std::string_view depots ) -> void {
+	const auto write{ [ & ]( const std::string& key ) {
+		if ( auto* shard{ openShard( state, key, false ) } )
+			shard->writer.write( archive, path, size, sha1, crc32, depots );
+	} };
+
+	switch ( state.shardBy ) {
+		case ShardMode::None:
+			write( "" );
+			break;
+		case ShardMode::Directory: {
+			// the archive's directory for VPK contents, files at the top level go in their own shard
+			const auto pathRel{ archive == "." ? path : archive };
+			const auto slash{ pathRel.find( '/' ) };
+			write( slash == std::string_view::npos ? std::string{ "_root" } : std::string{ pathRel.substr( 0, slash ) } );
+			break;
+		}
+		case ShardMode::Depot: {
+			// files shipped by more than one depot go in all of their shards
+			std::string_view rest{ depots.empty() ? std::string_view{ "_root" } : depots };
+			for ( std::size_t end; !rest.empty(); rest.remove_prefix( end == std::string_view::npos ? rest.size() : end + 1 ) ) {
+				end = rest.find( ',' );
+				write( std::string{ rest.substr( 0, end ) } );
+			}
+			break;
+		}
+	}
+}
+
+static auto loadCompletedRows( CreateState& state ) -> void {
+	if ( state.shardBy == ShardMode::None ) {
+		loadCompletedShardRows( state, "" );
+	} else {
+		// shards not in the manifest were created after the last checkpoint and are started over
+		std::vector<IndexShard> shards;
+		if ( readIndexManifest( state.indexPath, shards ) ) {
+			for ( const auto& shard : shards )
+				loadCompletedShardRows( state, shard.key );
+		}
+	}
+
+	state.count = static_cast<unsigned>( state.completed.size() );
+	Log_Info( "Resuming index creation, {} rows are already present", state.count );
+}
+
+static auto loadCompletedShardRows( CreateState& state, const std::string& key ) -> void {
+	auto* shard{ openShard( state, key, true ) };
+	if (! shard ) {
+		return;
+	}
+	shard->writer.close();
+
+	CreateCheckpoint checkpoint{};
+	const bool hasCheckpoint{ readCreateCheckpoint( shard->checkpointPath, checkpoint ) };
+
+	// everything up to the checkpoint is known good, past it only whole rows are kept
+	std::uint64_t validLength{ 0 };
+	{
+		IndexReader reader{ shard->partialPath };
+		IndexRow row{};
+		while ( !( hasCheckpoint && validLength >= checkpoint.indexOffset ) && reader.next( row ) ) {
+			state.completed.insert( fmt::format( "{}\xFF{}", row.archive, row.path ) );
+			validLength = reader.tell();
+		}
+	}
+	std::filesystem::resize_file( shard->partialPath, validLength );
+
+	shard->writer.open( shard->partialPath, true );
+}
+
+static auto saveManifest( CreateState& state ) -> void {
+	std::vector<IndexShard> shards;
+	for ( const auto& [ key, shard ] : state.shards )
+		shards.push_back( { key, shard.path.filename().string() } );
+	writeIndexManifest( state.indexPath, shards );
+}
+
+static auto saveCheckpoint( CreateState& state ) -> void {
+	for ( auto& [ key, shard ] : state.shards ) {
+		// the checkpoint only vouches for rows that are on disk
+		if (! shard.writer.flush() )
+			continue;
+		std::error_code err;
+		const auto length{ std::filesystem::file_size( shard.partialPath, err ) };
+		if (! err ) {
+			writeCreateCheckpoint( shard.checkpointPath, { length, state.count } );
+		}
+	}
+	if ( state.shardBy != ShardMode::None ) {
+		saveManifest( state );
+	}
+	state.lastCheckpoint = std::chrono::high_resolution_clock::now();
+}
+
 static auto buildRegexCollection( const std::vector<std::string>& regexStrings, std::string_view collectionType ) -> std::vector<std::regex> {
 	std::vector<std::regex> collection{};
 
@@ -3,14 +3,35 @@
 //
 #pragma once
 
+#include <cstddef>
 #include <string>
 #include <string_view>
 #include <vector>
 
+// How to split the index, a manifest listing the shards is written in place of the index
+enum class ShardMode
+{
+	None,
+	Depot,
+	Directory,
+};
+
+struct CreateOptions {
+	ShardMode shardBy{ ShardMode::None };
+	// continue from the last checkpoint
+	bool resume{ false };
+	// read files in the order they are laid out on disk instead of the directory walk's
+	bool physicalOrder{ false };
+	// files read at once from each device, picked per device if zero
+	unsigned ioThreads{ 0 };
+	// bytes read from a loose file at once, the default if zero
+	std::size_t readSize{ 0 };
+};
+
 auto createFromRoot( std::string_view root_, std::string_view indexLocation, bool skipArchives,
 					 const std::vector<std::string>& fileExcludes, const std::vector<std::string>& fileIncludes,
-					 const std::vector<std::string>& archiveExcludes, const std::vector<std::string>& archiveIncludes) -> int;
+					 const std::vector<std::string>& archiveExcludes, const std::vector<std::string>& archiveIncludes, const CreateOptions& options ) -> int;
 
 auto createFromSteamDepotConfigs( const std::string& configPath, const std::vector<std::string>& depotIDs, std::string_view indexLocation,
 								  bool skipArchives, const std::vector<std::string>& fileExcludes, const std::vector<std::string>& fileIncludes,
-								  const std::vector<std::string>& archiveExcludes, const std::vector<std::string>& archiveIncludes ) -> int;
+								  const std::vector<std::string>& archiveExcludes, const std::vector<std::string>& archiveIncludes, const CreateOptions& options ) -> int;
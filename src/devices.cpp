@@ -0,0 +1,187 @@
+#include "devices.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <thread>
+
+#include <fmt/format.h>
+
+#ifndef _WIN32
+	#include <sys/stat.h>
+#endif
+#if defined( __linux__ )
+	#include <sys/sysmacros.h>
+#endif
+
+#include "log.hpp"
+#include "trace.hpp"
+
+// reads in flight on a solid state drive, more than this rarely helps and hashing needs a core each
+static constexpr unsigned SOLID_STATE_THREADS{ 8 };
+// network shares and virtual filesystems, which don't tell what's behind them
+static constexpr unsigned UNKNOWN_DEVICE_THREADS{ 2 };
+
+static auto getDevice( const std::filesystem::path& directory ) -> std::uint64_t;
+
+auto getDeviceConcurrency( std::uint64_t device ) -> unsigned {
+	const auto solidState{ std::clamp( std::thread::hardware_concurrency(), 1u, SOLID_STATE_THREADS ) };
+#if defined( __linux__ )
+	// partitions don't have a queue of their own, their disk one level up does
+	const auto block{ fmt::format( "/sys/dev/block/{}:{}", major( device ), minor( device ) ) };
+	for ( const auto* queue : { "/queue/rotational", "/../queue/rotational" } ) {
+		std::ifstream reader{ block + queue };
+		char rotational{ 0 };
+		if ( reader >> rotational )
+			return rotational == '1' ? 1 : solidState;
+	}
+#else
+	(void) device;
+	(void) solidState;
+#endif
+	return UNKNOWN_DEVICE_THREADS;
+}
+
+DeviceQueues::DeviceQueues( unsigned threadsPerDevice ) : threadsPerDevice{ threadsPerDevice } { }
+
+DeviceQueues::~DeviceQueues() {
+	// what wasn't started is dropped, whoever queued it waits for it before going away
+	for ( auto& [ device, queue ] : this->queues ) {
+		std::scoped_lock lock{ queue.mutex };
+		queue.stopping = true;
+		queue.changed.notify_all();
+	}
+	for ( auto& [ device, queue ] : this->queues )
+		for ( auto& thread : queue.workers )
+			thread.join();
+}
+
+auto DeviceQueues::push( const std::filesystem::path& path, std::function<void( std::size_t worker )> task ) -> void {
+	auto& queue{ this->getQueue( path.string() ) };
+	queue.batches[ queue.handed % DEVICE_BATCHES ].tasks.push_back( std::move( task ) );
+}
+
+auto DeviceQueues::push( std::string_view path, std::size_t item ) -> void {
+	auto& queue{ this->getQueue( path ) };
+	queue.batches[ queue.handed % DEVICE_BATCHES ].items.push_back( item );
+}
+
+auto DeviceQueues::workerCount() const -> std::size_t {
+	return this->workers;
+}
+
+auto DeviceQueues::start( const std::function<void( std::size_t item, std::size_t worker )>& task ) -> void {
+	for ( auto& [ device, queue ] : this->queues ) {
+		std::scoped_lock lock{ queue.mutex };
+		queue.awaited = queue.handed;
+		auto& batch{ queue.batches[ queue.handed % DEVICE_BATCHES ] };
+		if ( batch.tasks.empty() && batch.items.empty() )
+			continue;
+		batch.task = &task;
+		queue.handed += 1;
+		queue.changed.notify_all();
+	}
+	// the slot queued next is the one of the batch before, on every device, busy or not
+	for ( auto& [ device, queue ] : this->queues ) {
+		std::unique_lock lock{ queue.mutex };
+		queue.changed.wait( lock, [ &queue ] { return queue.done >= queue.awaited; } );
+	}
+}
+
+auto DeviceQueues::wait() -> void {
+	for ( auto& [ device, queue ] : this->queues ) {
+		std::unique_lock lock{ queue.mutex };
+		queue.changed.wait( lock, [ &queue ] { return queue.done == queue.handed; } );
+	}
+}
+
+auto DeviceQueues::run() -> void {
+	this->run( []( std::size_t, std::size_t ) { } );
+}
+
+auto DeviceQueues::run( const std::function<void( std::size_t item, std::size_t worker )>& task ) -> void {
+	this->start( task );
+	this->wait();
+}
+
+auto DeviceQueues::getQueue( std::string_view path ) -> Queue& {
+#ifndef _WIN32
+	const auto separator{ path.find_last_of( '/' ) };
+#else
+	const auto separator{ path.find_last_of( "/\\" ) };
+#endif
+	// the root directory is its own parent
+	const auto directory{ separator == std::string_view::npos ? std::string_view{} : path.substr( 0, separator == 0 ? 1 : separator ) };
+	auto known{ this->directories.find( directory ) };
+	if ( known == this->directories.end() )
+		known = this->directories.emplace( directory, getDevice( directory ) ).first;
+
+	auto [ found, created ]{ this->queues.try_emplace( known->second ) };
+	auto& queue{ found->second };
+	if ( created ) {
+		queue.threads = this->threadsPerDevice != 0 ? this->threadsPerDevice : getDeviceConcurrency( known->second );
+		queue.firstWorker = this->workers;
+		this->workers += queue.threads;
+		Log_Verbose( "Reading device {} with {} threads", known->second, queue.threads );
+		for ( std::size_t i = 0; i < queue.threads; i++ )
+			queue.workers.emplace_back( &DeviceQueues::work, std::ref( queue ), queue.firstWorker + i );
+	}
+	return queue;
+}
+
+auto DeviceQueues::work( Queue& queue, std::size_t worker ) -> void {
+	if ( g_bTracing )
+		setTraceTrack( worker );
+
+	const auto remaining{ []( const Batch& batch ) {
+		return batch.taken < batch.tasks.size() + batch.items.size();
+	} };
+	std::unique_lock lock{ queue.mutex };
+	while ( true ) {
+		// the oldest batch with something left to take
+		Batch* batch{ nullptr };
+		queue.changed.wait( lock, [ & ] {
+			for ( auto n = queue.done; n < queue.handed && batch == nullptr; n++ )
+				if ( remaining( queue.batches[ n % DEVICE_BATCHES ] ) )
+					batch = &queue.batches[ n % DEVICE_BATCHES ];
+			return queue.stopping || batch != nullptr;
+		} );
+		if ( queue.stopping )
+			return;
+
+		const auto next{ batch->taken++ };
+		batch->running += 1;
+		lock.unlock();
+		if ( next < batch->tasks.size() )
+			batch->tasks[ next ]( worker );
+		else
+			( *batch->task )( batch->items[ next - batch->tasks.size() ], worker );
+		lock.lock();
+		batch->running -= 1;
+
+		// batches are done in the order they were handed, cleared, not freed, the next one is likely as big
+		const auto done{ queue.done };
+		for ( ; queue.done < queue.handed; queue.done++ ) {
+			auto& oldest{ queue.batches[ queue.done % DEVICE_BATCHES ] };
+			if ( oldest.running != 0 || remaining( oldest ) )
+				break;
+			oldest.tasks.clear();
+			oldest.items.clear();
+			oldest.task = nullptr;
+			oldest.taken = 0;
+		}
+		if ( queue.done != done )
+			queue.changed.notify_all();
+	}
+}
+
+static auto getDevice( const std::filesystem::path& directory ) -> std::uint64_t {
+#ifndef _WIN32
+	struct stat info{};
+	if ( ::stat( directory.c_str(), &info ) == 0 )
+		return static_cast<std::uint64_t>( info.st_dev );
+#else
+	(void) directory;
+#endif
+	// everything we can't tell apart shares a queue
+	return 0;
+}
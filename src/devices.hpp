@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <array>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// How many files are read at once from a device when not told otherwise: a single reader keeps a rotational drive
+// from seeking back and forth, solid state ones only get busy with several, anything else is a guess
+auto getDeviceConcurrency( std::uint64_t device ) -> unsigned;
+
+// Batches a device may be working on at once, the one being queued aside
+constexpr std::size_t DEVICE_BATCHES{ 2 };
+
+// Runs work on an independent set of threads per device, so that installs spanning several disks keep all of them
+// busy without oversubscribing any
+class DeviceQueues {
+public:
+	// `threadsPerDevice` of zero picks it per device with `getDeviceConcurrency`, the threads of a device are started
+	// the first time a task is queued on it and kept until destroyed
+	explicit DeviceQueues( unsigned threadsPerDevice = 0 );
+	~DeviceQueues();
+	DeviceQueues( const DeviceQueues& ) = delete;
+	auto operator=( const DeviceQueues& ) -> DeviceQueues& = delete;
+
+	// Queues a task on the device holding `path`, tasks of a device are started in the order they were pushed, and
+	// get the number of the worker running them so that each worker can keep its own state
+	auto push( const std::filesystem::path& path, std::function<void( std::size_t worker )> task ) -> void;
+	// Same, for the many tasks which only differ by a number, all given to the function passed to `run`, queuing
+	// them doesn't allocate once the queues have grown to the size of a batch
+	auto push( std::string_view path, std::size_t item ) -> void;
+	// Workers are numbered from zero up to this, it grows as tasks for new devices are pushed
+	[[nodiscard]] auto workerCount() const -> std::size_t;
+	// Hands the tasks queued since the last batch to the workers of their devices, the queued items with `task`, and
+	// returns once the batch before it is done so that its slot can be queued again. A device done with its share of
+	// that batch goes on with this one instead of waiting for the others, `task` must outlive both
+	auto start( const std::function<void( std::size_t item, std::size_t worker )>& task ) -> void;
+	// Returns once every batch handed to the workers is done
+	auto wait() -> void;
+	// Runs all of the queued tasks and returns once they are done, the queued items with `task`
+	auto run() -> void;
+	auto run( const std::function<void( std::size_t item, std::size_t worker )>& task ) -> void;
+private:
+	struct Batch {
+		std::vector<std::function<void( std::size_t )>> tasks;
+		std::vector<std::size_t> items;
+		const std::function<void( std::size_t item, std::size_t worker )>* task{ nullptr };
+		// tasks and items taken by a worker, and how many of those are still running
+		std::size_t taken{ 0 };
+		std::size_t running{ 0 };
+	};
+	struct Queue {
+		unsigned threads{ 1 };
+		std::size_t firstWorker{ 0 };
+		// batches handed to the workers and done so far, the `n`th one is queued in slot `n % DEVICE_BATCHES`
+		std::array<Batch, DEVICE_BATCHES> batches;
+		std::size_t handed{ 0 };
+		std::size_t done{ 0 };
+		// the batches `start` waits for
+		std::size_t awaited{ 0 };
+		bool stopping{ false };
+		std::mutex mutex;
+		// signaled when a batch is handed, when one is done, and when stopping
+		std::condition_variable changed;
+		std::vector<std::thread> workers;
+	};
+	// so that directories can be looked up without building a string
+	struct DirectoryHash {
+		using is_transparent = void;
+		auto operator()( std::string_view directory ) const -> std::size_t {
+			return std::hash<std::string_view>{}( directory );
+		}
+	};
+
+	auto getQueue( std::string_view path ) -> Queue&;
+	static auto work( Queue& queue, std::size_t worker ) -> void;
+
+	unsigned threadsPerDevice;
+	std::size_t workers{ 0 };
+	std::map<std::uint64_t, Queue> queues;
+	// files share the device of their directory, only a mount point or a symlink can change it
+	std::unordered_map<std::string, std::uint64_t, DirectoryHash, std::equal_to<>> directories;
+};
@@ -0,0 +1,152 @@
+#include "diff.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <compare>
+#include <filesystem>
+#include <tuple>
+#include <vector>
+
+#include "index.hpp"
+#include "log.hpp"
+
+// Rows of an index in archive then path order, compact indexes already are, plain ones are sorted in memory
+class SortedRows {
+public:
+	explicit SortedRows( const std::filesystem::path& path );
+
+	// False if the index was cut short, see `IndexReader`
+	[[nodiscard]] auto good() const -> bool;
+	// False once all rows were read and they don't add up to the trailer
+	[[nodiscard]] auto isIntact() const -> bool;
+	auto next( IndexRowView& row ) -> bool;
+private:
+	IndexReader reader;
+	std::vector<IndexRow> rows;
+	std::size_t position{ 0 };
+};
+
+static auto openIndex( const std::filesystem::path& path ) -> bool;
+static auto getEntryName( const IndexRowView& row ) -> std::string;
+
+auto diffIndexes( std::string_view oldIndex, std::string_view newIndex ) -> int {
+	const std::filesystem::path oldPath{ oldIndex };
+	const std::filesystem::path newPath{ newIndex };
+	if ( !openIndex( oldPath ) || !openIndex( newPath ) ) {
+		return 1;
+	}
+
+	auto start{ std::chrono::high_resolution_clock::now() };
+	Log_Info( "Comparing index file `{}` to `{}`", oldPath.string(), newPath.string() );
+
+	SortedRows before{ oldPath };
+	SortedRows after{ newPath };
+	if ( !before.good() || !after.good() ) {
+		return 1;
+	}
+	unsigned added{ 0 };
+	unsigned removed{ 0 };
+	unsigned modified{ 0 };
+	unsigned unchanged{ 0 };
+
+	// both sides are sorted, so a single merge pass finds every difference
+	IndexRowView a{};
+	IndexRowView b{};
+	bool hasA{ before.next( a ) };
+	bool hasB{ after.next( b ) };
+	while ( hasA || hasB ) {
+		const auto order{ !hasB ? std::strong_ordering::less : !hasA ? std::strong_ordering::greater : std::tie( a.archive, a.path ) <=> std::tie( b.archive, b.path ) };
+
+		if ( order < 0 ) {
+			Log_Report( getEntryName( a ), "Entry was removed.", "nul", std::string{ a.sha1 } );
+			removed += 1;
+			hasA = before.next( a );
+			continue;
+		}
+		if ( order > 0 ) {
+			Log_Report( getEntryName( b ), "Entry was added.", std::string{ b.sha1 }, "nul" );
+			added += 1;
+			hasB = after.next( b );
+			continue;
+		}
+
+		if ( a.size != b.size || a.sha1 != b.sha1 || a.crc32 != b.crc32 ) {
+			Log_Report( getEntryName( b ), "Entry was modified.", std::string{ b.sha1 }, std::string{ a.sha1 } );
+			modified += 1;
+		} else if ( a.depots != b.depots ) {
+			Log_Report( getEntryName( b ), "Entry moved to different depots.", std::string{ b.depots }, std::string{ a.depots } );
+			modified += 1;
+		} else {
+			unchanged += 1;
+		}
+		hasA = before.next( a );
+		hasB = after.next( b );
+	}
+
+	auto end{ std::chrono::high_resolution_clock::now() };
+	Log_Info( "Compared {} entries in {}: {} added, {} removed, {} modified.", added + removed + modified + unchanged, std::chrono::duration_cast<std::chrono::milliseconds>( end - start ), added, removed, modified );
+
+	if ( !before.isIntact() || !after.isIntact() ) {
+		Log_Error( "The entries compared may not be the ones the indexes were created with, create them again." );
+		return 1;
+	}
+	return 0;
+}
+
+SortedRows::SortedRows( const std::filesystem::path& path ) : reader{ path } {
+	if ( !this->reader.good() || this->reader.isCompact() )
+		return;
+
+	// an index from an older version, or one that was never finished
+	Log_Warn( "Index file `{}` is not sorted, loading it in memory.", path.string() );
+	for ( IndexRow row{}; this->reader.next( row ); )
+		this->rows.push_back( std::move( row ) );
+	std::sort( this->rows.begin(), this->rows.end(), []( const IndexRow& a, const IndexRow& b ) {
+		return std::tie( a.archive, a.path ) < std::tie( b.archive, b.path );
+	} );
+}
+
+auto SortedRows::good() const -> bool {
+	return this->reader.good();
+}
+
+auto SortedRows::isIntact() const -> bool {
+	return this->reader.isIntact();
+}
+
+auto SortedRows::next( IndexRowView& row ) -> bool {
+	if ( this->reader.isCompact() )
+		return this->reader.next( row );
+
+	if ( this->position >= this->rows.size() )
+		return false;
+
+	const auto& current{ this->rows[ this->position++ ] };
+	row.archive = current.archive;
+	row.path = current.path;
+	row.size = current.size;
+	row.sha1 = current.sha1;
+	row.crc32 = current.crc32;
+	row.depots = current.depots;
+	return true;
+}
+
+static auto openIndex( const std::filesystem::path& path ) -> bool {
+	if (! std::filesystem::exists( path ) ) {
+		Log_Error( "Index file `{}` does not exist.", path.string() );
+		return false;
+	}
+
+	std::vector<IndexShard> shards;
+	if ( readIndexManifest( path, shards ) ) {
+		Log_Error( "Index file `{}` is sharded, compare its shards one by one instead.", path.string() );
+		return false;
+	}
+	return true;
+}
+
+static auto getEntryName( const IndexRowView& row ) -> std::string {
+	if ( row.archive == "." )
+		return std::string{ row.path };
+	return fmt::format( "{}/{}", row.archive, row.path );
+}
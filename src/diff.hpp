@@ -0,0 +1,6 @@
+#pragma once
+
+#include <string_view>
+
+// Lists the entries added, removed and modified between two index files, without touching the files they describe
+auto diffIndexes( std::string_view oldIndex, std::string_view newIndex ) -> int;
@@ -0,0 +1,45 @@
+#include "digest.hpp"
+
+static auto parseNibble( char c, unsigned char& value ) -> bool;
+
+auto parseHex( std::string_view hex, std::span<unsigned char> bytes ) -> bool {
+	if ( hex.size() != bytes.size() * 2 )
+		return false;
+
+	for ( std::size_t i = 0; i < bytes.size(); i++ ) {
+		unsigned char high;
+		unsigned char low;
+		if ( !parseNibble( hex[ i * 2 ], high ) || !parseNibble( hex[ i * 2 + 1 ], low ) )
+			return false;
+		bytes[ i ] = static_cast<unsigned char>( high << 4 | low );
+	}
+	return true;
+}
+
+auto toHex( std::span<const unsigned char> bytes ) -> std::string {
+	std::string hex;
+	hex.reserve( bytes.size() * 2 );
+	appendHex( hex, bytes );
+	return hex;
+}
+
+auto appendHex( std::string& hex, std::span<const unsigned char> bytes ) -> void {
+	static constexpr std::string_view DIGITS{ "0123456789ABCDEF" };
+
+	for ( const auto byte : bytes ) {
+		hex += DIGITS[ byte >> 4 ];
+		hex += DIGITS[ byte & 0xF ];
+	}
+}
+
+static auto parseNibble( char c, unsigned char& value ) -> bool {
+	if ( c >= '0' && c <= '9' )
+		value = static_cast<unsigned char>( c - '0' );
+	else if ( c >= 'A' && c <= 'F' )
+		value = static_cast<unsigned char>( c - 'A' + 10 );
+	else if ( c >= 'a' && c <= 'f' )
+		value = static_cast<unsigned char>( c - 'a' + 10 );
+	else
+		return false;
+	return true;
+}
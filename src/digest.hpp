@@ -0,0 +1,14 @@
+#pragma once
+
+#include <span>
+#include <string>
+#include <string_view>
+
+// Digests are compared raw, hex is only for the index and reports
+
+// Returns false if `hex` isn't exactly as long as `bytes` needs, or has anything but hex digits
+auto parseHex( std::string_view hex, std::span<unsigned char> bytes ) -> bool;
+// Upper case, same as the CryptoPP encoder the index is written with
+auto toHex( std::span<const unsigned char> bytes ) -> std::string;
+// Same, at the end of `hex`
+auto appendHex( std::string& hex, std::span<const unsigned char> bytes ) -> void;
@@ -0,0 +1,457 @@
+#include "index.hpp"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <iterator>
+#include <string_view>
+#include <tuple>
+
+#include <fmt/format.h>
+
+#include "checkpoint.hpp"
+#include "digest.hpp"
+#include "log.hpp"
+
+// first value of the first row of a manifest, no VPK can be called like this
+static constexpr std::string_view MANIFEST_MAGIC{ "#manifest" };
+
+// first value of the first row of a compact index, and of one written before it had a trailer
+static constexpr std::string_view COMPACT_MAGIC{ "#rsv3" };
+static constexpr std::string_view UNSEALED_COMPACT_MAGIC{ "#rsv2" };
+// first value of the last row of a compact index
+static constexpr std::string_view TRAILER_MAGIC{ "#end" };
+// the trailer is found by reading this much from the end, it's way shorter
+static constexpr std::size_t TRAILER_MAX_SIZE{ 128 };
+// rows are written out once this much is buffered
+static constexpr std::size_t WRITE_BUFFER_SIZE{ 1024 * 1024 };
+
+// first value of the first row of a lookup table
+static constexpr std::string_view LOOKUP_MAGIC{ "#lookup" };
+// rows between two samples of a lookup table, all of which may be read to find a single one
+static constexpr std::size_t LOOKUP_INTERVAL{ 256 };
+
+static auto readTrailer( std::ifstream& stream, std::uint64_t& rows, std::string& crc32 ) -> bool;
+static auto finishCrc32( CryptoPP::CRC32& crc32 ) -> std::string;
+static auto readLookup( const std::filesystem::path& indexPath, std::vector<IndexLookup::Sample>& samples ) -> bool;
+static auto writeLookup( const std::filesystem::path& indexPath, const std::vector<IndexLookup::Sample>& samples ) -> bool;
+static auto getIndexStamp( const std::filesystem::path& indexPath ) -> std::string;
+static auto splitValues( std::string_view line, std::string_view* values, std::size_t max ) -> std::size_t;
+template <typename T>
+static auto parseNumber( std::string_view string, T& value ) -> bool;
+
+IndexReader::IndexReader( const std::filesystem::path& path ) : file{ path }, stream{ path, std::ios::in | std::ios::binary } {
+	if ( std::getline( this->stream, this->line, '\xFD' ) && ( this->line == fmt::format( "{}\xFF", COMPACT_MAGIC ) || this->line == fmt::format( "{}\xFF", UNSEALED_COMPACT_MAGIC ) ) ) {
+		this->compact = true;
+		if ( this->line.starts_with( COMPACT_MAGIC ) ) {
+			const auto header{ this->stream.tellg() };
+			if (! readTrailer( this->stream, this->expectedRows, this->expectedCrc32 ) ) {
+				Log_Error( "Index file `{}` is incomplete, it was cut short while being written.", path.string() );
+				this->stream.setstate( std::ios::failbit );
+				return;
+			}
+			this->stream.seekg( header );
+			this->checking = true;
+			this->crc32.Update( reinterpret_cast<const CryptoPP::byte*>( this->line.data() ), this->line.size() );
+			this->crc32.Update( reinterpret_cast<const CryptoPP::byte*>( "\xFD" ), 1 );
+		}
+
+		// the archive table follows the header
+		std::getline( this->stream, this->line, '\xFD' );
+		if ( this->checking ) {
+			this->crc32.Update( reinterpret_cast<const CryptoPP::byte*>( this->line.data() ), this->line.size() );
+			this->crc32.Update( reinterpret_cast<const CryptoPP::byte*>( "\xFD" ), 1 );
+		}
+		std::string_view rest{ this->line };
+		for ( std::size_t end; ( end = rest.find( '\xFF' ) ) != std::string_view::npos; rest.remove_prefix( end + 1 ) )
+			this->archives.emplace_back( rest.substr( 0, end ) );
+		return;
+	}
+
+	// plain index, start over
+	this->stream.clear();
+	this->stream.seekg( 0 );
+}
+
+auto IndexReader::good() const -> bool {
+	return this->stream.good();
+}
+
+auto IndexReader::isIntact() const -> bool {
+	return this->intact;
+}
+
+auto IndexReader::isCompact() const -> bool {
+	return this->compact;
+}
+
+auto IndexReader::next( IndexRowView& row ) -> bool {
+	while ( std::getline( this->stream, this->line, '\xFD' ) ) {
+		// no terminator, this is a row that was cut short
+		if ( this->stream.eof() )
+			return false;
+
+		if ( this->compact && this->line.starts_with( TRAILER_MAGIC ) ) {
+			// all rows were read, they can be checked against it
+			if ( this->checking && ( this->rows != this->expectedRows || finishCrc32( this->crc32 ) != this->expectedCrc32 ) ) {
+				Log_Error( "Index file `{}` is corrupt, its rows don't match its checksum.", this->file.string() );
+				this->intact = false;
+			}
+			this->checking = false;
+			return false;
+		}
+		if ( this->checking ) {
+			this->rows += 1;
+			this->crc32.Update( reinterpret_cast<const CryptoPP::byte*>( this->line.data() ), this->line.size() );
+			this->crc32.Update( reinterpret_cast<const CryptoPP::byte*>( "\xFD" ), 1 );
+		}
+
+		std::string_view values[ 7 ];
+		const auto count{ splitValues( this->line, values, this->compact ? 7 : 6 ) };
+
+		if ( this->compact ) {
+			std::size_t id{ 0 };
+			std::size_t prefix{ 0 };
+			if ( count < 6 || !parseNumber( values[ 0 ], id ) || !parseNumber( values[ 1 ], prefix ) || !parseNumber( values[ 3 ], row.size ) || id >= this->archives.size() || prefix > this->path.size() ) {
+				Log_Error( "Skipping malformed index row `{}`", this->line );
+				continue;
+			}
+
+			// only the part that differs from the previous path is stored
+			this->path.resize( prefix );
+			this->path.append( values[ 2 ] );
+
+			row.archive = this->archives[ id ];
+			row.path = this->path;
+			row.sha1 = values[ 4 ];
+			row.crc32 = values[ 5 ];
+			row.depots = values[ 6 ];
+			return true;
+		}
+
+		if ( count < 5 || !parseNumber( values[ 2 ], row.size ) ) {
+			Log_Error( "Skipping malformed index row `{}`", this->line );
+			continue;
+		}
+
+		row.archive = values[ 0 ];
+		row.path = values[ 1 ];
+		row.sha1 = values[ 3 ];
+		row.crc32 = values[ 4 ];
+		row.depots = values[ 5 ];
+		return true;
+	}
+
+	return false;
+}
+
+auto IndexReader::next( IndexRow& row ) -> bool {
+	IndexRowView view{};
+	if (! this->next( view ) )
+		return false;
+
+	row.archive = view.archive;
+	row.path = view.path;
+	row.size = view.size;
+	row.sha1 = view.sha1;
+	row.crc32 = view.crc32;
+	row.depots = view.depots;
+	return true;
+}
+
+auto IndexReader::tell() -> std::uint64_t {
+	const auto pos{ this->stream.tellg() };
+	return pos < 0 ? 0 : static_cast<std::uint64_t>( pos );
+}
+
+auto IndexReader::lastPath() const -> const std::string& {
+	return this->path;
+}
+
+auto IndexReader::seek( std::uint64_t offset, std::string_view lastPath ) -> void {
+	// the rows skipped can't be added up anymore
+	this->checking = false;
+	this->stream.clear();
+	this->stream.seekg( static_cast<std::streamoff>( offset ) );
+	this->path = lastPath;
+}
+
+auto IndexReader::getArchives() const -> const std::vector<std::string>& {
+	return this->archives;
+}
+
+auto IndexWriter::open( const std::filesystem::path& path, bool append ) -> bool {
+	this->path = path;
+	this->buffer.reserve( WRITE_BUFFER_SIZE + 4096 );
+	this->stream.open( path, std::ios::out | std::ios::binary | ( append ? std::ios::app : std::ios::trunc ) );
+	return this->stream.good();
+}
+
+auto IndexWriter::write( std::string_view archive, std::string_view path, std::uint64_t size, std::string_view sha1, std::string_view crc32, std::string_view depots ) -> void {
+	fmt::format_to( std::back_inserter( this->buffer ), "{}\xFF{}\xFF{}\xFF{}\xFF{}\xFF", archive, path, size, sha1, crc32 );
+	if (! depots.empty() )
+		fmt::format_to( std::back_inserter( this->buffer ), "{}\xFF", depots );
+	this->buffer += '\xFD';
+
+	if ( this->buffer.size() >= WRITE_BUFFER_SIZE ) {
+		this->stream.write( this->buffer.data(), static_cast<std::streamsize>( this->buffer.size() ) );
+		this->buffer.clear();
+	}
+}
+
+auto IndexWriter::flush() -> bool {
+	// once closed, everything was already written
+	if ( this->stream.is_open() ) {
+		this->stream.write( this->buffer.data(), static_cast<std::streamsize>( this->buffer.size() ) );
+		this->buffer.clear();
+		this->stream.flush();
+	}
+	return this->stream.good() && syncFile( this->path );
+}
+
+auto IndexWriter::close() -> bool {
+	const bool flushed{ this->flush() };
+	this->stream.close();
+	return flushed && this->stream.good();
+}
+
+IndexLookup::IndexLookup( const std::filesystem::path& indexPath ) : reader{ indexPath } {
+	if (! this->reader.isCompact() || readLookup( indexPath, this->samples ) )
+		return;
+
+	Log_Info( "Building the lookup table of index file `{}`", indexPath.string() );
+	std::string previous;
+	IndexRowView row{};
+	for ( std::size_t count{ 0 }; ; count += 1 ) {
+		const bool sampled{ count % LOOKUP_INTERVAL == 0 };
+		std::uint64_t offset{ 0 };
+		if ( sampled ) {
+			offset = this->reader.tell();
+			previous = this->reader.lastPath();
+		}
+		if (! this->reader.next( row ) )
+			break;
+		if ( sampled )
+			this->samples.push_back( { std::string{ row.archive }, std::string{ row.path }, offset, previous } );
+	}
+	writeLookup( indexPath, this->samples );
+}
+
+auto IndexLookup::good() const -> bool {
+	return this->reader.isCompact();
+}
+
+auto IndexLookup::getArchives() const -> const std::vector<std::string>& {
+	return this->reader.getArchives();
+}
+
+auto IndexLookup::find( std::string_view archive, std::string_view prefix, const std::function<void( const IndexRowView& )>& found ) -> void {
+	if ( this->samples.empty() )
+		return;
+
+	// the last sample before the first row that could match
+	auto sample{ std::lower_bound( this->samples.begin(), this->samples.end(), 0, [ archive, prefix ]( const Sample& sample, int ) {
+		return sample.archive != archive ? std::string_view{ sample.archive } < archive : std::string_view{ sample.path } < prefix;
+	} ) };
+	if ( sample != this->samples.begin() )
+		sample -= 1;
+
+	this->reader.seek( sample->offset, sample->previous );
+	for ( IndexRowView row{}; this->reader.next( row ); ) {
+		if ( row.archive < archive || ( row.archive == archive && row.path < prefix ) )
+			continue;
+		// past the rows sharing the prefix
+		if ( row.archive != archive || !row.path.starts_with( prefix ) )
+			break;
+		found( row );
+	}
+}
+
+auto writeCompactIndex( const std::filesystem::path& path, std::vector<IndexRow>& rows ) -> bool {
+	std::sort( rows.begin(), rows.end(), []( const IndexRow& a, const IndexRow& b ) {
+		return std::tie( a.archive, a.path ) < std::tie( b.archive, b.path );
+	} );
+
+	// rows are sorted, so every archive shows up in a single run
+	std::vector<std::string_view> archives;
+	for ( const auto& row : rows ) {
+		if ( archives.empty() || archives.back() != row.archive )
+			archives.emplace_back( row.archive );
+	}
+
+	const auto tmpPath{ std::filesystem::path{ path }.concat( ".tmp" ) };
+	std::ofstream writer{ tmpPath, std::ios::out | std::ios::trunc | std::ios::binary };
+	if (! writer.good() ) {
+		Log_Error( "Failed to open index file for writing: `{}`", tmpPath.string() );
+		return false;
+	}
+
+	CryptoPP::CRC32 crc32{};
+	std::string buffer{ fmt::format( "{}\xFF\xFD", COMPACT_MAGIC ) };
+	for ( const auto& archive : archives )
+		fmt::format_to( std::back_inserter( buffer ), "{}\xFF", archive );
+	buffer += '\xFD';
+
+	// the lookup table is filled as rows are written, the index is never read back to build it
+	std::vector<IndexLookup::Sample> samples;
+	std::uint64_t written{ 0 };
+
+	std::size_t archiveId{ 0 };
+	std::string_view previous;
+	for ( std::size_t i = 0; i < rows.size(); i++ ) {
+		const auto& row{ rows[ i ] };
+		while ( archives[ archiveId ] != row.archive )
+			archiveId += 1;
+		if ( i % LOOKUP_INTERVAL == 0 )
+			samples.push_back( { row.archive, row.path, written + buffer.size(), std::string{ previous } } );
+
+		const auto prefix{ static_cast<std::size_t>( std::mismatch( previous.begin(), previous.end(), row.path.begin(), row.path.end() ).first - previous.begin() ) };
+		fmt::format_to( std::back_inserter( buffer ), "{}\xFF{}\xFF{}\xFF{}\xFF{}\xFF{}\xFF", archiveId, prefix, std::string_view{ row.path }.substr( prefix ), row.size, row.sha1, row.crc32 );
+		if (! row.depots.empty() )
+			fmt::format_to( std::back_inserter( buffer ), "{}\xFF", row.depots );
+		buffer += '\xFD';
+		previous = row.path;
+
+		if ( buffer.size() >= WRITE_BUFFER_SIZE ) {
+			crc32.Update( reinterpret_cast<const CryptoPP::byte*>( buffer.data() ), buffer.size() );
+			writer.write( buffer.data(), static_cast<std::streamsize>( buffer.size() ) );
+			written += buffer.size();
+			buffer.clear();
+		}
+	}
+	crc32.Update( reinterpret_cast<const CryptoPP::byte*>( buffer.data() ), buffer.size() );
+	fmt::format_to( std::back_inserter( buffer ), "{}\xFF{}\xFF{}\xFF\xFD", TRAILER_MAGIC, rows.size(), finishCrc32( crc32 ) );
+	writer.write( buffer.data(), static_cast<std::streamsize>( buffer.size() ) );
+	writer.close();
+	// the index must be whole on disk before it replaces the previous one
+	if ( !writer.good() || !syncFile( tmpPath ) ) {
+		Log_Error( "Failed to write index file `{}`", tmpPath.string() );
+		return false;
+	}
+
+	std::error_code err;
+	std::filesystem::rename( tmpPath, path, err );
+	if ( err ) {
+		Log_Error( "Failed to write index file `{}`: {}", path.string(), err.message() );
+		return false;
+	}
+	syncFile( path.parent_path().empty() ? std::filesystem::path{ "." } : path.parent_path() );
+	// not fatal, it's built again the first time it's needed
+	writeLookup( path, samples );
+	return true;
+}
+
+auto compactIndex( const std::filesystem::path& source, const std::filesystem::path& path ) -> bool {
+	std::vector<IndexRow> rows;
+	{
+		IndexReader reader{ source };
+		for ( IndexRow row{}; reader.next( row ); )
+			rows.push_back( std::move( row ) );
+	}
+	return writeCompactIndex( path, rows );
+}
+
+auto readIndexManifest( const std::filesystem::path& path, std::vector<IndexShard>& shards ) -> bool {
+	std::ifstream reader{ path, std::ios::in | std::ios::binary };
+	std::string line;
+	if (! std::getline( reader, line, '\xFD' ) || line.substr( 0, line.find( '\xFF' ) ) != MANIFEST_MAGIC )
+		return false;
+
+	shards.clear();
+	while ( std::getline( reader, line, '\xFD' ) && !reader.eof() ) {
+		const auto split{ line.find( '\xFF' ) };
+		if ( split == std::string::npos || line.back() != '\xFF' ) {
+			Log_Error( "Skipping malformed manifest row `{}`", line );
+			continue;
+		}
+		shards.push_back( { line.substr( 0, split ), line.substr( split + 1, line.size() - split - 2 ) } );
+	}
+	return true;
+}
+
+auto writeIndexManifest( const std::filesystem::path& path, const std::vector<IndexShard>& shards ) -> bool {
+	auto contents{ fmt::format( "{}\xFF\xFD", MANIFEST_MAGIC ) };
+	for ( const auto& shard : shards )
+		contents += fmt::format( "{}\xFF{}\xFF\xFD", shard.key, shard.file );
+
+	return writeAtomically( path, contents );
+}
+
+static auto readTrailer( std::ifstream& stream, std::uint64_t& rows, std::string& crc32 ) -> bool {
+	stream.seekg( 0, std::ios::end );
+	const auto size{ static_cast<std::uint64_t>( std::max<std::streamoff>( stream.tellg(), 0 ) ) };
+	const auto length{ std::min<std::uint64_t>( size, TRAILER_MAX_SIZE ) };
+	std::string tail( length, '\0' );
+	stream.seekg( static_cast<std::streamoff>( size - length ) );
+	if (! stream.read( tail.data(), static_cast<std::streamsize>( length ) ) )
+		return false;
+
+	// the trailer is the last row, right after the terminator of the one before it
+	const auto start{ tail.rfind( fmt::format( "\xFD{}\xFF", TRAILER_MAGIC ) ) };
+	if ( start == std::string::npos || !tail.ends_with( "\xFF\xFD" ) )
+		return false;
+	std::string_view values[ 3 ];
+	const std::string_view trailer{ std::string_view{ tail }.substr( start + 1 ) };
+	if ( splitValues( trailer, values, 3 ) != 3 || !parseNumber( values[ 1 ], rows ) )
+		return false;
+	crc32 = values[ 2 ];
+	return true;
+}
+
+static auto finishCrc32( CryptoPP::CRC32& crc32 ) -> std::string {
+	std::array<CryptoPP::byte, CryptoPP::CRC32::DIGESTSIZE> digest{};
+	crc32.Final( digest.data() );
+	return toHex( digest );
+}
+
+static auto readLookup( const std::filesystem::path& indexPath, std::vector<IndexLookup::Sample>& samples ) -> bool {
+	std::ifstream reader{ std::filesystem::path{ indexPath }.concat( ".lookup" ), std::ios::in | std::ios::binary };
+	std::string line;
+	// the table is only good for the very index it was made from
+	if (! std::getline( reader, line, '\xFD' ) || line != fmt::format( "{}\xFF{}\xFF", LOOKUP_MAGIC, getIndexStamp( indexPath ) ) )
+		return false;
+
+	samples.clear();
+	while ( std::getline( reader, line, '\xFD' ) && !reader.eof() ) {
+		std::string_view values[ 4 ];
+		IndexLookup::Sample sample{};
+		if ( splitValues( line, values, 4 ) != 4 || !parseNumber( values[ 2 ], sample.offset ) ) {
+			samples.clear();
+			return false;
+		}
+		sample.archive = values[ 0 ];
+		sample.path = values[ 1 ];
+		sample.previous = values[ 3 ];
+		samples.push_back( std::move( sample ) );
+	}
+	return true;
+}
+
+static auto writeLookup( const std::filesystem::path& indexPath, const std::vector<IndexLookup::Sample>& samples ) -> bool {
+	auto contents{ fmt::format( "{}\xFF{}\xFF\xFD", LOOKUP_MAGIC, getIndexStamp( indexPath ) ) };
+	for ( const auto& sample : samples )
+		fmt::format_to( std::back_inserter( contents ), "{}\xFF{}\xFF{}\xFF{}\xFF\xFD", sample.archive, sample.path, sample.offset, sample.previous );
+
+	return writeAtomically( std::filesystem::path{ indexPath }.concat( ".lookup" ), contents );
+}
+
+static auto getIndexStamp( const std::filesystem::path& indexPath ) -> std::string {
+	std::error_code err;
+	const auto size{ std::filesystem::file_size( indexPath, err ) };
+	const auto time{ std::filesystem::last_write_time( indexPath, err ).time_since_epoch().count() };
+	return fmt::format( "{}\xFF{}", size, time );
+}
+
+static auto splitValues( std::string_view line, std::string_view* values, std::size_t max ) -> std::size_t {
+	std::size_t count{ 0 };
+	for ( std::size_t end; count < max && ( end = line.find( '\xFF' ) ) != std::string_view::npos; count += 1 ) {
+		values[ count ] = line.substr( 0, end );
+		line.remove_prefix( end + 1 );
+	}
+	return count;
+}
+
+template <typename T>
+static auto parseNumber( std::string_view string, T& value ) -> bool {
+	return std::from_chars( string.data(), string.data() + string.size(), value ).ec == std::errc{};
+}
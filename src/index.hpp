@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <cryptopp/crc.h>
+
+// the index file is encoded as `Rows-of-String-Values`:
+// every value is terminated by `\xFF` and every row by `\xFD`
+//
+// finished indexes use the compact layout, rows are sorted by archive then path:
+//   `#rsv3`                                          header
+//   `.`, `pak01_dir.vpk`, ...                        archive table, the position in it is the archive's ID
+//   ID, shared prefix length, path suffix, size, sha1, crc32[, depots]
+//   `#end`, row count, crc32 of everything before   trailer, an index without it was cut short
+// `#rsv2` indexes are the same without the trailer, and are still read
+// while indexes being created are plain rows of:
+//   archive, path, size, sha1, crc32[, depots]
+// the directory and numbered files of the VPKs whose entries are indexed also get a row of their own, as loose files,
+// so that their entries can be skipped when the whole file still matches
+struct IndexRow {
+	// relative path of the containing VPK, `.` for loose files
+	std::string archive;
+	std::string path;
+	std::uint64_t size{ 0 };
+	std::string sha1;
+	std::string crc32;
+	// comma separated IDs of the Steam depots shipping this file, optional
+	std::string depots;
+};
+
+// Same as IndexRow, but pointing into the reader's buffers, only valid until the next row is read
+struct IndexRowView {
+	std::string_view archive;
+	std::string_view path;
+	std::uint64_t size{ 0 };
+	std::string_view sha1;
+	std::string_view crc32;
+	std::string_view depots;
+};
+
+class IndexReader {
+public:
+	// A compact index missing its trailer is rejected right away, it reads as bad and empty
+	explicit IndexReader( const std::filesystem::path& path );
+
+	[[nodiscard]] auto good() const -> bool;
+	// False once all rows were read from the start and they don't add up to the trailer's count and checksum
+	[[nodiscard]] auto isIntact() const -> bool;
+	// Compact indexes have their rows sorted by archive then path
+	[[nodiscard]] auto isCompact() const -> bool;
+	// Reads the next complete row, returns false when there are no more (a trailing unterminated row is ignored)
+	auto next( IndexRowView& row ) -> bool;
+	auto next( IndexRow& row ) -> bool;
+	// Offset of the next row to be read
+	[[nodiscard]] auto tell() -> std::uint64_t;
+	// Paths are stored relative to the previous one, which must be given back when seeking
+	[[nodiscard]] auto lastPath() const -> const std::string&;
+	auto seek( std::uint64_t offset, std::string_view lastPath = {} ) -> void;
+	// The archive table of a compact index, the loose files' `.` included
+	[[nodiscard]] auto getArchives() const -> const std::vector<std::string>&;
+private:
+	std::filesystem::path file;
+	std::ifstream stream;
+	std::string line;
+	bool compact{ false };
+	std::vector<std::string> archives;
+	std::string path;
+	// what the trailer says, and what was read so far, as long as nothing was skipped with `seek`
+	bool checking{ false };
+	bool intact{ true };
+	std::uint64_t expectedRows{ 0 };
+	std::string expectedCrc32;
+	std::uint64_t rows{ 0 };
+	CryptoPP::CRC32 crc32;
+};
+
+// Appends plain rows to an index being created, they're formatted into a buffer that is only written out once large
+class IndexWriter {
+public:
+	// Starts the file over, unless `append`
+	auto open( const std::filesystem::path& path, bool append ) -> bool;
+	auto write( std::string_view archive, std::string_view path, std::uint64_t size, std::string_view sha1, std::string_view crc32, std::string_view depots ) -> void;
+	// Writes out the buffered rows and waits for them to reach the disk, so that a checkpoint can vouch for them
+	auto flush() -> bool;
+	auto close() -> bool;
+private:
+	std::filesystem::path path;
+	std::ofstream stream;
+	std::string buffer;
+};
+
+// Every `LOOKUP_INTERVAL`th row of a compact index, saved next to it as `<index>.lookup`, so that the rows of a few
+// paths can be found with a binary search and a short read instead of going through all of them
+class IndexLookup {
+public:
+	struct Sample {
+		std::string archive;
+		std::string path;
+		// where the row starts, and the path of the one before it, which it is front-coded against
+		std::uint64_t offset{ 0 };
+		std::string previous;
+	};
+
+	// Loads the table of a compact index, building and saving it first if it's missing or the index changed since
+	explicit IndexLookup( const std::filesystem::path& indexPath );
+
+	// False for plain indexes, which aren't sorted
+	[[nodiscard]] auto good() const -> bool;
+	[[nodiscard]] auto getArchives() const -> const std::vector<std::string>&;
+	// Calls `found` with every row of `archive` whose path starts with `prefix`, in order
+	auto find( std::string_view archive, std::string_view prefix, const std::function<void( const IndexRowView& )>& found ) -> void;
+private:
+	IndexReader reader;
+	std::vector<Sample> samples;
+};
+
+// Sorts, front-codes and interns the archives of the given rows into a compact index, and saves its lookup table
+auto writeCompactIndex( const std::filesystem::path& path, std::vector<IndexRow>& rows ) -> bool;
+// Rewrites a plain index, such as the one built during creation, to `path` in the compact layout
+auto compactIndex( const std::filesystem::path& source, const std::filesystem::path& path ) -> bool;
+
+// A sharded index is a manifest listing one index file per depot or top level directory
+struct IndexShard {
+	std::string key;
+	// relative to the directory of the manifest
+	std::string file;
+};
+
+// Returns false if `path` is not a manifest, but a regular index
+auto readIndexManifest( const std::filesystem::path& path, std::vector<IndexShard>& shards ) -> bool;
+auto writeIndexManifest( const std::filesystem::path& path, const std::vector<IndexShard>& shards ) -> bool;
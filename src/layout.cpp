@@ -0,0 +1,82 @@
+#include "layout.hpp"
+
+#include <array>
+#include <cctype>
+
+#include <fmt/format.h>
+#include <vpkpp/format/VPK.h>
+
+#if defined( __linux__ )
+	#include <fcntl.h>
+	#include <linux/fiemap.h>
+	#include <linux/fs.h>
+	#include <sys/ioctl.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#elif !defined( _WIN32 )
+	#include <sys/stat.h>
+#endif
+
+auto getPhysicalLocation( const std::filesystem::path& path ) -> PhysicalLocation {
+	PhysicalLocation location{};
+#if defined( __linux__ )
+	const int fd{ ::open( path.c_str(), O_RDONLY | O_CLOEXEC ) };
+	if ( fd < 0 )
+		return location;
+
+	struct stat info{};
+	if ( ::fstat( fd, &info ) == 0 ) {
+		location.device = static_cast<std::uint64_t>( info.st_dev );
+		location.inode = static_cast<std::uint64_t>( info.st_ino );
+	}
+
+	// room for a single extent, only where the file starts matters
+	alignas( fiemap ) std::array<unsigned char, sizeof( fiemap ) + sizeof( fiemap_extent )> request{};
+	auto* map{ reinterpret_cast<fiemap*>( request.data() ) };
+	map->fm_start = 0;
+	map->fm_length = FIEMAP_MAX_OFFSET;
+	map->fm_extent_count = 1;
+	if ( ::ioctl( fd, FS_IOC_FIEMAP, map ) == 0 && map->fm_mapped_extents > 0 )
+		location.extent = map->fm_extents[ 0 ].fe_physical;
+
+	::close( fd );
+#elif !defined( _WIN32 )
+	struct stat info{};
+	if ( ::stat( path.c_str(), &info ) == 0 ) {
+		location.device = static_cast<std::uint64_t>( info.st_dev );
+		location.inode = static_cast<std::uint64_t>( info.st_ino );
+	}
+#else
+	// no cheap way to ask NTFS, files are read in index order
+	(void) path;
+#endif
+	return location;
+}
+
+auto getArchiveChunkPath( const std::filesystem::path& vpkPath, std::uint32_t archiveIndex ) -> std::filesystem::path {
+	// small entries and preloaded data live in the directory VPK itself
+	if ( archiveIndex == vpkpp::VPK::VPK_DIR_INDEX )
+		return vpkPath;
+
+	// `pak01_dir.vpk` -> `pak01_000.vpk`
+	auto stem{ vpkPath.stem().string() };
+	if ( stem.ends_with( "_dir" ) )
+		stem.resize( stem.size() - 4 );
+	return std::filesystem::path{ vpkPath }.replace_filename( fmt::format( "{}_{:03}.vpk", stem, archiveIndex ) );
+}
+
+auto parseArchiveChunkPath( std::string_view chunkPath, std::string& vpkPath, std::uint32_t& archiveIndex ) -> bool {
+	// `_` then three digits then `.vpk`
+	if ( chunkPath.size() < 8 || !chunkPath.ends_with( ".vpk" ) || chunkPath[ chunkPath.size() - 8 ] != '_' )
+		return false;
+
+	archiveIndex = 0;
+	for ( const char c : chunkPath.substr( chunkPath.size() - 7, 3 ) ) {
+		if (! std::isdigit( static_cast<unsigned char>( c ) ) )
+			return false;
+		archiveIndex = archiveIndex * 10 + static_cast<std::uint32_t>( c - '0' );
+	}
+
+	vpkPath = fmt::format( "{}dir.vpk", chunkPath.substr( 0, chunkPath.size() - 7 ) );
+	return true;
+}
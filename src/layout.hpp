@@ -0,0 +1,30 @@
+#pragma once
+
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+// how many files are looked ahead at a time, to be reordered when reading in physical order and spread over the devices' queues
+constexpr std::size_t PHYSICAL_ORDER_BATCH{ 4096 };
+
+// Where the data of a file starts, reading files sorted by it avoids seeking back and forth on rotational and network drives
+struct PhysicalLocation {
+	std::uint64_t device{ 0 };
+	// first extent of the file, when the filesystem is willing to tell
+	std::uint64_t extent{ 0 };
+	// files are usually laid out close to their inode, the best guess we have without extents
+	std::uint64_t inode{ 0 };
+
+	auto operator<=>( const PhysicalLocation& ) const = default;
+};
+
+// Everything is zero when unknown, which keeps the original order
+auto getPhysicalLocation( const std::filesystem::path& path ) -> PhysicalLocation;
+
+// Path of the file holding the data of the entries stored in the given archive of a VPK
+auto getArchiveChunkPath( const std::filesystem::path& vpkPath, std::uint32_t archiveIndex ) -> std::filesystem::path;
+// The other way around, `pak01_003.vpk` -> `pak01_dir.vpk` and 3, returns false if `chunkPath` is not a numbered VPK
+auto parseArchiveChunkPath( std::string_view chunkPath, std::string& vpkPath, std::uint32_t& archiveIndex ) -> bool;
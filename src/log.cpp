@@ -36,3 +36,13 @@ auto Log_Report( std::string_view file, std::string_view message, std::string_vi
 		std::fprintf( stderr, "In file `%s`: %s\n", file.data(), message.data() );
 	}
 }
+
+auto Log_Status( std::string_view status, std::string_view message ) -> void {
+	if ( g_bUIReportMode ) {
+		std::printf( R"("status","%s","%s",,)" "\n", status.data(), message.data() );
+	} else {
+		std::printf( "Status: %s: %s\n", status.data(), message.data() );
+	}
+	// whoever waits on it shouldn't have to wait for the buffer to fill
+	std::fflush( stdout );
+}
@@ -20,9 +20,15 @@ auto Log_Message( LogSeverity severity, std::string_view message ) -> void;
 // Report
 auto Log_Report( std::string_view file, std::string_view message, std::string_view got, std::string_view expected ) -> void;
 
+// Milestone of a run that something waiting on it may act on, `status` is a fixed keyword
+auto Log_Status( std::string_view status, std::string_view message ) -> void;
+
 // Logging helpers
 template <typename... Ts>
 inline auto Log_Verbose( const fmt::format_string<Ts...> fmt, Ts&&... args ) -> void {
+	// skip formatting what won't be printed, this is called for every single file
+	if (! g_bLogVerbose )
+		return;
 	Log_Message( LogSeverity::Verbose, fmt::format( fmt, std::forward<Ts>( args )... ) );
 }
 
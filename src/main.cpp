@@ -2,14 +2,20 @@
 // Created by ENDERZOMBI102 on 14/10/2023.
 //
 #include <array>
+#include <cstdio>
 #include <filesystem>
 #include <memory>
+#include <optional>
 #include <vector>
 
 #include <argumentum/argparse.h>
 
+#include "calibrate.hpp"
 #include "create.hpp"
+#include "diff.hpp"
 #include "log.hpp"
+#include "throttle.hpp"
+#include "trace.hpp"
 #include "verify.hpp"
 
 // the index file is encoded as `Rows-of-String-Values`
@@ -47,6 +53,27 @@ auto main( int argc, char* argv[] ) -> int {
 	std::vector<std::string> steamDepotIDs;
 	std::string indexLocation;
 	bool overwrite{ false };
+	bool resume{ false };
+	bool noTrustCache{ false };
+	std::string shardBy;
+	std::vector<std::string> shards;
+	bool physicalOrder{ false };
+	std::vector<std::string> diff;
+	bool watchMode{ false };
+	unsigned memoryLimit{ 0 };
+	std::string level;
+	unsigned ioThreads{ 0 };
+	std::string trace;
+	std::vector<std::string> paths;
+	std::vector<std::string> roots;
+	std::string repairFrom;
+	std::vector<std::string> critical;
+	unsigned maxBandwidth{ 0 };
+	bool background{ false };
+	bool latencyBackoff{ false };
+	bool calibrateMode{ false };
+	std::string part;
+	bool mergeResultsMode{ false };
 	const auto programFile{ std::filesystem::path( argv[ 0 ] ).filename() };
 
 	argumentum::argument_parser parser{};
@@ -97,6 +124,78 @@ auto main( int argc, char* argv[] ) -> int {
 	params.add_parameter( overwrite, "--overwrite" )
 		.help( "Do not ask for confirmation for overwriting an existing index." )
 		.metavar( "overwrite" );
+	params.add_parameter( resume, "--resume" )
+		.help( "Continue an interrupted index creation or verification from its last checkpoint." )
+		.metavar( "resume" );
+	params.add_parameter( noTrustCache, "--no-trust-cache" )
+		.help( "Rehash every file, even the ones that haven't changed since they were last verified." )
+		.metavar( "no-trust-cache" );
+	params.add_parameter( shardBy, "--shard-by" )
+		.help( "Split the new index in one file per `depot` or top level `directory`, listed by a manifest at the index location." )
+		.metavar( "shard-by" )
+		.maxargs( 1 );
+	params.add_parameter( shards, "--shards" )
+		.help( "The shards of a sharded index to verify. If not present, all of them are verified." )
+		.metavar( "shards" );
+	params.add_parameter( physicalOrder, "--physical-order" )
+		.help( "Read files in the order they are laid out on disk, which is faster on rotational and network drives." )
+		.metavar( "physical-order" );
+	params.add_parameter( diff, "--diff" )
+		.help( "Lists the entries added, removed and modified between two index files, given relative to the working directory." )
+		.metavar( "old-index new-index" )
+		.nargs( 2 );
+	params.add_parameter( watchMode, "--watch" )
+		.help( "Keep running and track the files changed on disk, verifying them when receiving SIGUSR1." )
+		.metavar( "watch" );
+	params.add_parameter( memoryLimit, "--memory-limit" )
+		.help( "Megabytes of memory to use at most for open VPKs and read buffers when verifying, unlimited if not present." )
+		.metavar( "memory-limit" )
+		.maxargs( 1 );
+	params.add_parameter( ioThreads, "--io-threads" )
+		.help( "How many files to read at once from each device. If not present, it's picked per device: one for rotational drives, more for solid state ones." )
+		.metavar( "io-threads" )
+		.maxargs( 1 );
+	params.add_parameter( trace, "--trace" )
+		.help( "Record how long reading, hashing and the rest of the work take, to a file in Chrome's trace event format." )
+		.metavar( "trace" )
+		.maxargs( 1 );
+	params.add_parameter( level, "--level" )
+		.help( "How thoroughly to verify: `exists`, `size`, `directory` (VPK entries against their directory's crc32, without reading them), `crc` or `full`. Defaults to `full`." )
+		.metavar( "level" )
+		.maxargs( 1 );
+	params.add_parameter( paths, "--paths" )
+		.help( "Verify only the loose files and VPK entries matching these globs, where `*` matches any characters and `?` a single one. An entry matches by its own path, or by the path of its VPK followed by `/` and its own." )
+		.metavar( "paths" );
+	params.add_parameter( roots, "--roots" )
+		.help( "Verify several installs against the index of `--root` at once, reading the files they share through hard links only once." )
+		.metavar( "roots" );
+	params.add_parameter( repairFrom, "--repair-from" )
+		.help( "Restore the files found missing or corrupt from this copy of the install, then verify them again." )
+		.metavar( "reference-root" )
+		.maxargs( 1 );
+	params.add_parameter( critical, "--critical" )
+		.help( "Verify the files matching these globs before any other, then tell with a `critical-passed` or `critical-failed` status and verify the rest. Globs starting with `@` name a file listing more of them, one per line. Exits with 2 if any of them is bad." )
+		.metavar( "critical" );
+	params.add_parameter( maxBandwidth, "--max-bandwidth" )
+		.help( "Megabytes per second to read at most from all disks together, unlimited if not present." )
+		.metavar( "max-bandwidth" )
+		.maxargs( 1 );
+	params.add_parameter( background, "--background" )
+		.help( "Run with idle I/O priority and the lowest CPU priority, so that other programs on the machine go first." )
+		.metavar( "background" );
+	params.add_parameter( latencyBackoff, "--latency-backoff" )
+		.help( "Pause between reads while they take much longer than usual, which means something else is using the disk." )
+		.metavar( "latency-backoff" );
+	params.add_parameter( calibrateMode, "--calibrate" )
+		.help( "Measure how many threads and how large reads make verifying the install the fastest, and save them next to the index, where later runs pick them up." )
+		.metavar( "calibrate" );
+	params.add_parameter( part, "--part" )
+		.help( "Verify only this part of the install, as `i/N`, so that N processes or machines can verify it together. Every part is picked the same way from the same index, and its results are saved next to it." )
+		.metavar( "i/N" )
+		.maxargs( 1 );
+	params.add_parameter( mergeResultsMode, "--merge-results" )
+		.help( "Combine the results saved by every `--part` of a verification into a single report, and exit with the worst of their statuses." )
+		.metavar( "merge-results" );
 	params.add_parameter( g_bUIReportMode, "--ui-report" )
 		.help( "Use UI report mode logging." )
 		.metavar( "ui-report" );
@@ -122,8 +221,60 @@ auto main( int argc, char* argv[] ) -> int {
 		Log_Info( "`{}` started at {:02d}:{:02d}:{:02d}", programFile.string(), localPtr->tm_hour, localPtr->tm_min, localPtr->tm_sec );
 	}
 
+	// before any thread is started, they inherit the priority
+	if ( background && (! setBackgroundPriority() ) )
+		Log_Warn( "Failed to lower the priority of the process, it will run with the usual one." );
+	setReadBandwidth( static_cast<std::uint64_t>( maxBandwidth ) * 1024 * 1024 );
+	setLatencyBackoff( latencyBackoff );
+
+	// written on the way out, whichever action ran
+	std::optional<TraceFile> traceFile;
+	if (! trace.empty() )
+		traceFile.emplace( trace );
+
+	if (! diff.empty() ) {
+		if ( newIndex ) {
+			Log_Error( "`--diff` can't be used together with `--new-index`." );
+			return 1;
+		}
+		return diffIndexes( diff[ 0 ], diff[ 1 ] );
+	}
+
+	if ( calibrateMode ) {
+		if ( newIndex ) {
+			Log_Error( "`--calibrate` can't be used together with `--new-index`." );
+			return 1;
+		}
+		return calibrate( root, indexLocation );
+	}
+
+	if ( mergeResultsMode ) {
+		if ( newIndex ) {
+			Log_Error( "`--merge-results` can't be used together with `--new-index`." );
+			return 1;
+		}
+		return mergeResults( root, indexLocation );
+	}
+
+	// `i/N`, counting from 1
+	unsigned partIndex{ 0 };
+	unsigned partCount{ 0 };
+	if ( !part.empty() && !newIndex && !watchMode ) {
+		char end{ 0 };
+		if ( std::sscanf( part.c_str(), "%u/%u%c", &partIndex, &partCount, &end ) != 2 || partIndex == 0 || partIndex > partCount ) {
+			Log_Error( "Invalid part `{}`, expected `i/N` with i between 1 and N.", part );
+			return 1;
+		}
+	}
+
+	// measured by `--calibrate`, what's given on the command line comes first
+	TuningProfile profile{};
+	if ( readTuningProfile( std::filesystem::path{ root } / indexLocation, profile ) )
+		Log_Info( "Using the tuning profile of `{}`", ( std::filesystem::path{ root } / indexLocation ).string() );
+
 	if ( newIndex ) {
-		if ( const auto indexPath{ std::filesystem::path{ root } / indexLocation }; std::filesystem::exists( indexPath ) ) {
+		// when resuming, the existing index holds the rows that were already completed
+		if ( const auto indexPath{ std::filesystem::path{ root } / indexLocation }; !resume && std::filesystem::exists( indexPath ) ) {
 			if (! overwrite ) {
 				Log_Error( "Index file `{}` already exists, do you want to overwrite it? (y/N)", indexPath.string() );
 				std::string input;
@@ -135,8 +286,7 @@ auto main( int argc, char* argv[] ) -> int {
 			} else {
 				Log_Warn( "Index file `{}` already exists, it will be overwritten.", indexPath.string() );
 			}
-			// clear contents
-			std::ofstream writer{ indexPath, std::ios::out | std::ios::trunc };
+			// the new index replaces it once complete, it's still there if creating it fails
 		}
 
 		// stuff we ignore during the building of the index, the "standard" useless stuff is hardcoded
@@ -144,7 +294,51 @@ auto main( int argc, char* argv[] ) -> int {
 		fileExcludes.emplace_back( ".*\\.vmf_autosave.*" );
 		fileExcludes.emplace_back( ".*\\.vmx" );
 		fileExcludes.emplace_back( ".*\\.log" );
-		fileExcludes.emplace_back( ".*verifier_index\\.rsv" );
+		fileExcludes.emplace_back( ".*verifier_index(\\.[^/]+)?\\.rsv(\\.partial|\\.tmp)?" );
+		fileExcludes.emplace_back( ".*\\.checkpoint(\\.tmp)?" );
+		fileExcludes.emplace_back( ".*\\.rsv\\.trust(\\.tmp)?" );
+		fileExcludes.emplace_back( ".*\\.rsv\\.lookup(\\.tmp)?" );
+		fileExcludes.emplace_back( ".*\\.rsv\\.profile(\\.tmp)?" );
+		fileExcludes.emplace_back( ".*\\.rsv\\.part-[0-9]+-of-[0-9]+\\.(trust|results)(\\.tmp)?" );
+
+		if ( noTrustCache )
+			Log_Warn( "The current action doesn't support `--no-trust-cache`, it will be ignored." );
+		if (! shards.empty() )
+			Log_Warn( "The current action doesn't support `--shards`, it will be ignored." );
+		if ( watchMode )
+			Log_Warn( "The current action doesn't support `--watch`, it will be ignored." );
+		if ( memoryLimit != 0 )
+			Log_Warn( "The current action doesn't support `--memory-limit`, it will be ignored." );
+		if (! level.empty() )
+			Log_Warn( "The current action doesn't support `--level`, it will be ignored." );
+		if (! paths.empty() )
+			Log_Warn( "The current action doesn't support `--paths`, it will be ignored." );
+		if (! roots.empty() )
+			Log_Warn( "The current action doesn't support `--roots`, it will be ignored." );
+		if (! repairFrom.empty() )
+			Log_Warn( "The current action doesn't support `--repair-from`, it will be ignored." );
+		if (! critical.empty() )
+			Log_Warn( "The current action doesn't support `--critical`, it will be ignored." );
+		if (! part.empty() )
+			Log_Warn( "The current action doesn't support `--part`, it will be ignored." );
+
+		CreateOptions options{};
+		options.resume = resume;
+		options.physicalOrder = physicalOrder || profile.physicalOrder;
+		options.ioThreads = ioThreads != 0 ? ioThreads : profile.ioThreads;
+		options.readSize = profile.readSize;
+		if ( shardBy == "depot" ) {
+			if ( steamDepotConfig.empty() ) {
+				Log_Error( "`--shard-by depot` requires `--steam-depot-config`." );
+				return 1;
+			}
+			options.shardBy = ShardMode::Depot;
+		} else if ( shardBy == "directory" ) {
+			options.shardBy = ShardMode::Directory;
+		} else if (! shardBy.empty() ) {
+			Log_Error( "Unknown shard mode `{}`, expected `depot` or `directory`.", shardBy );
+			return 1;
+		}
 
 		// if we're reading the contents of archives, numbered VPKs should not be considered
 		if (! skipArchives ) {
@@ -167,10 +361,10 @@ auto main( int argc, char* argv[] ) -> int {
 				return 1;
 			}
 
-			return createFromSteamDepotConfigs( steamDepotConfig, steamDepotIDs, indexLocation, skipArchives, fileExcludes, fileIncludes, archiveExcludes, archiveIncludes );
+			return createFromSteamDepotConfigs( steamDepotConfig, steamDepotIDs, indexLocation, skipArchives, fileExcludes, fileIncludes, archiveExcludes, archiveIncludes, options );
 		}
 
-		return createFromRoot( root, indexLocation, skipArchives, fileExcludes, fileIncludes, archiveExcludes, archiveIncludes );
+		return createFromRoot( root, indexLocation, skipArchives, fileExcludes, fileIncludes, archiveExcludes, archiveIncludes, options );
 	}
 
 	if ( skipArchives )
@@ -189,6 +383,79 @@ auto main( int argc, char* argv[] ) -> int {
 		Log_Warn( "The current action doesn't support `--steam-depot-ids`, it will be ignored." );
 	if ( overwrite )
 		Log_Warn( "The current action doesn't support `--overwrite`, it will be ignored." );
+	if (! shardBy.empty() )
+		Log_Warn( "The current action doesn't support `--shard-by`, it will be ignored." );
 
-	return verify( root, indexLocation );
+	VerifyOptions options{};
+	options.resume = resume;
+	options.useTrustCache = !noTrustCache;
+	options.shards = shards;
+	options.physicalOrder = physicalOrder || profile.physicalOrder;
+	options.memoryLimit = static_cast<std::uint64_t>( memoryLimit ) * 1024 * 1024;
+	options.ioThreads = ioThreads != 0 ? ioThreads : profile.ioThreads;
+	options.readSize = profile.readSize;
+	options.paths = paths;
+	options.roots = roots;
+	options.repairFrom = repairFrom;
+	// every part would verify the critical files again, and report them as many times
+	if ( partCount == 0 )
+		options.critical = critical;
+	options.part = partIndex;
+	options.parts = partCount;
+	if ( level == "exists" ) {
+		options.level = VerifyLevel::Exists;
+	} else if ( level == "size" ) {
+		options.level = VerifyLevel::Size;
+	} else if ( level == "directory" ) {
+		options.level = VerifyLevel::Directory;
+	} else if ( level == "crc" ) {
+		options.level = VerifyLevel::Crc;
+	} else if ( level.empty() || level == "full" ) {
+		options.level = VerifyLevel::Full;
+	} else {
+		Log_Error( "Unknown verification level `{}`, expected `exists`, `size`, `directory`, `crc` or `full`.", level );
+		return 1;
+	}
+	if ( watchMode ) {
+		if ( resume )
+			Log_Warn( "The current action doesn't support `--resume`, it will be ignored." );
+		if (! shards.empty() )
+			Log_Warn( "The current action doesn't support `--shards`, it will be ignored." );
+		if ( ioThreads != 0 )
+			Log_Warn( "The current action doesn't support `--io-threads`, it will be ignored." );
+		if (! paths.empty() )
+			Log_Warn( "The current action doesn't support `--paths`, it will be ignored." );
+		if (! roots.empty() )
+			Log_Warn( "The current action doesn't support `--roots`, it will be ignored." );
+		if (! repairFrom.empty() )
+			Log_Warn( "The current action doesn't support `--repair-from`, it will be ignored." );
+		if (! critical.empty() )
+			Log_Warn( "The current action doesn't support `--critical`, it will be ignored." );
+		if (! part.empty() )
+			Log_Warn( "The current action doesn't support `--part`, it will be ignored." );
+		return watch( root, indexLocation, options );
+	}
+	if ( !paths.empty() && resume )
+		Log_Warn( "`--resume` doesn't apply to `--paths`, it will be ignored." );
+	if ( !paths.empty() && !critical.empty() && roots.empty() )
+		Log_Warn( "`--critical` doesn't apply to `--paths`, it will be ignored." );
+	if ( !paths.empty() && !part.empty() && roots.empty() )
+		Log_Warn( "`--part` doesn't apply to `--paths`, it will be ignored." );
+	if ( !critical.empty() && !part.empty() && paths.empty() && roots.empty() )
+		Log_Warn( "`--critical` doesn't apply to `--part`, it will be ignored." );
+	if (! roots.empty() ) {
+		if ( resume )
+			Log_Warn( "`--resume` doesn't apply to `--roots`, it will be ignored." );
+		if (! paths.empty() )
+			Log_Warn( "`--paths` doesn't apply to `--roots`, it will be ignored." );
+		if ( physicalOrder )
+			Log_Warn( "`--physical-order` doesn't apply to `--roots`, it will be ignored." );
+		if (! repairFrom.empty() )
+			Log_Warn( "`--repair-from` doesn't apply to `--roots`, it will be ignored." );
+		if (! critical.empty() )
+			Log_Warn( "`--critical` doesn't apply to `--roots`, it will be ignored." );
+		if (! part.empty() )
+			Log_Warn( "`--part` doesn't apply to `--roots`, it will be ignored." );
+	}
+	return verify( root, indexLocation, options );
 }
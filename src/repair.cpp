@@ -0,0 +1,143 @@
+#include "repair.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+#if defined( __linux__ )
+	#include <linux/fs.h>
+	#include <sys/ioctl.h>
+#endif
+
+#include "log.hpp"
+
+// how much is copied at once when the kernel can't do it for us
+static constexpr std::size_t COPY_BUFFER_SIZE{ 1024 * 1024 };
+
+#ifndef _WIN32
+static auto copyContents( int input, int output, std::uint64_t size ) -> bool;
+#endif
+
+auto restoreFile( const std::filesystem::path& source, const std::filesystem::path& target ) -> bool {
+	const auto tmpPath{ std::filesystem::path{ target }.concat( ".repair.tmp" ) };
+	std::error_code err;
+	// a missing file may be missing its directory too
+	std::filesystem::create_directories( target.parent_path(), err );
+
+#ifndef _WIN32
+	const int input{ ::open( source.c_str(), O_RDONLY | O_CLOEXEC ) };
+	struct stat info{};
+	if ( input < 0 || ::fstat( input, &info ) != 0 ) {
+		Log_Error( "Failed to open `{}`: {}", source.string(), std::strerror( errno ) );
+		if ( input >= 0 )
+			::close( input );
+		return false;
+	}
+	const int output{ ::open( tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, info.st_mode & 07777 ) };
+	if ( output < 0 ) {
+		Log_Error( "Failed to open `{}` for writing: {}", tmpPath.string(), std::strerror( errno ) );
+		::close( input );
+		return false;
+	}
+
+	// the data has to be on disk before the rename makes it the file
+	const bool copied{ copyContents( input, output, static_cast<std::uint64_t>( info.st_size ) ) && ::fsync( output ) == 0 };
+	const int error{ errno };
+	::close( input );
+	if ( ::close( output ) != 0 || !copied ) {
+		Log_Error( "Failed to copy `{}` to `{}`: {}", source.string(), tmpPath.string(), std::strerror( error ) );
+		::unlink( tmpPath.c_str() );
+		return false;
+	}
+#else
+	if (! std::filesystem::copy_file( source, tmpPath, std::filesystem::copy_options::overwrite_existing, err ) ) {
+		Log_Error( "Failed to copy `{}` to `{}`: {}", source.string(), tmpPath.string(), err.message() );
+		std::filesystem::remove( tmpPath, err );
+		return false;
+	}
+#endif
+
+	std::filesystem::rename( tmpPath, target, err );
+	if ( err ) {
+		Log_Error( "Failed to replace `{}`: {}", target.string(), err.message() );
+		std::filesystem::remove( tmpPath, err );
+		return false;
+	}
+	return true;
+}
+
+auto hasSameContents( const std::filesystem::path& a, const std::filesystem::path& b ) -> bool {
+	std::error_code err;
+	const auto size{ std::filesystem::file_size( a, err ) };
+	if ( err || std::filesystem::file_size( b, err ) != size || err )
+		return false;
+
+	std::ifstream readerA{ a, std::ios::in | std::ios::binary };
+	std::ifstream readerB{ b, std::ios::in | std::ios::binary };
+	std::vector<char> bufferA( COPY_BUFFER_SIZE );
+	std::vector<char> bufferB( COPY_BUFFER_SIZE );
+	while ( readerA && readerB ) {
+		readerA.read( bufferA.data(), static_cast<std::streamsize>( bufferA.size() ) );
+		readerB.read( bufferB.data(), static_cast<std::streamsize>( bufferB.size() ) );
+		if ( readerA.gcount() != readerB.gcount() || !std::equal( bufferA.begin(), bufferA.begin() + readerA.gcount(), bufferB.begin() ) )
+			return false;
+	}
+	return readerA.eof() && readerB.eof();
+}
+
+#ifndef _WIN32
+static auto copyContents( int input, int output, std::uint64_t size ) -> bool {
+	std::uint64_t copied{ 0 };
+#if defined( __linux__ )
+	// btrfs, XFS and the like share the extents of the reference, nothing is read nor written
+	if ( ::ioctl( output, FICLONE, input ) == 0 ) {
+		Log_Verbose( "Cloned {} bytes", size );
+		return true;
+	}
+
+	// copied by the kernel, or by the server on network filesystems, without going through our memory
+	while ( copied < size ) {
+		const auto count{ ::copy_file_range( input, nullptr, output, nullptr, size - copied, 0 ) };
+		if ( count < 0 && errno == EINTR )
+			continue;
+		if ( count <= 0 )
+			break;
+		copied += static_cast<std::uint64_t>( count );
+	}
+	if ( copied == size ) {
+		Log_Verbose( "Copied {} bytes in kernel", size );
+		return true;
+	}
+#endif
+
+	// not supported between these filesystems, whatever is left is copied by hand from where it stopped
+	std::vector<char> buffer( COPY_BUFFER_SIZE );
+	while ( true ) {
+		const auto count{ ::read( input, buffer.data(), buffer.size() ) };
+		if ( count < 0 && errno == EINTR )
+			continue;
+		if ( count < 0 )
+			return false;
+		if ( count == 0 )
+			break;
+		for ( ssize_t written{ 0 }; written < count; ) {
+			const auto result{ ::write( output, buffer.data() + written, static_cast<std::size_t>( count - written ) ) };
+			if ( result < 0 && errno == EINTR )
+				continue;
+			if ( result < 0 )
+				return false;
+			written += result;
+		}
+		copied += static_cast<std::uint64_t>( count );
+	}
+	Log_Verbose( "Copied {} bytes", copied );
+	return true;
+}
+#endif
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <filesystem>
+
+// Replaces `target` with a copy of `source`: a clone sharing its extents where the filesystem can make one, a copy made
+// by the kernel otherwise, and a buffered one as a last resort. The copy is written next to `target` and renamed over
+// it once complete, so that it is never left half-written
+auto restoreFile( const std::filesystem::path& source, const std::filesystem::path& target ) -> bool;
+
+// Whether both files exist and hold the same bytes
+auto hasSameContents( const std::filesystem::path& a, const std::filesystem::path& b ) -> bool;
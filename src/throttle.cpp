@@ -0,0 +1,138 @@
+#include "throttle.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+#if defined( _WIN32 )
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <sys/resource.h>
+	#if defined( __linux__ )
+		#include <sys/syscall.h>
+		#include <unistd.h>
+	#endif
+#endif
+
+#include "log.hpp"
+
+bool g_bThrottling = false;
+
+// the bucket holds a quarter of a second worth of reads at most, so that a pause doesn't turn into a burst
+static constexpr double BUCKET_SECONDS{ 0.25 };
+// reads measured to learn how long they usually take, before backing off can start
+static constexpr unsigned BASELINE_READS{ 32 };
+// how many times slower than usual reads have to get for backing off, and how close they have to be back to stop
+static constexpr double SLOW_LATENCY{ 2.0 };
+static constexpr double NORMAL_LATENCY{ 1.25 };
+// reads are followed by a pause of up to this many times what they took
+static constexpr double MAX_PAUSE{ 8.0 };
+// small reads are compared as if they were this big, their fixed cost would look like a slow disk otherwise
+static constexpr double MIN_READ_SIZE{ 64 * 1024 };
+
+static std::mutex s_ThrottleLock;
+static double s_BytesPerSecond{ 0 };
+static double s_Tokens{ 0 };
+static std::chrono::steady_clock::time_point s_LastRefill;
+static bool s_bBackoff{ false };
+static unsigned s_Reads{ 0 };
+// seconds per byte read
+static double s_UsualLatency{ 0 };
+static double s_RecentLatency{ 0 };
+// how many times what a read took to pause after it
+static double s_Pause{ 0 };
+
+auto setReadBandwidth( std::uint64_t bytesPerSecond ) -> void {
+	const std::scoped_lock guard{ s_ThrottleLock };
+	s_BytesPerSecond = static_cast<double>( bytesPerSecond );
+	s_Tokens = s_BytesPerSecond * BUCKET_SECONDS;
+	s_LastRefill = std::chrono::steady_clock::now();
+	g_bThrottling = s_BytesPerSecond != 0 || s_bBackoff;
+}
+
+auto setLatencyBackoff( bool enabled ) -> void {
+	const std::scoped_lock guard{ s_ThrottleLock };
+	s_bBackoff = enabled;
+	g_bThrottling = s_BytesPerSecond != 0 || s_bBackoff;
+}
+
+auto setBackgroundPriority() -> bool {
+#if defined( _WIN32 )
+	// lowers both the I/O and the CPU priority of the process
+	return SetPriorityClass( GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN ) != 0;
+#else
+	// the lowest nice value, on Linux it's per thread and inherited by the threads started afterwards
+	bool lowered{ ::setpriority( PRIO_PROCESS, 0, 19 ) == 0 };
+	#if defined( __linux__ )
+	// `ioprio_set` has no glibc wrapper, the idle class only gets the disk when nobody else wants it
+	constexpr int IOPRIO_WHO_PROCESS{ 1 };
+	constexpr int IOPRIO_CLASS_IDLE{ 3 };
+	constexpr int IOPRIO_CLASS_SHIFT{ 13 };
+	lowered = ::syscall( SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT ) == 0 && lowered;
+	#endif
+	return lowered;
+#endif
+}
+
+auto ThrottledRead::begin( std::size_t bytes ) -> void {
+	std::chrono::duration<double> wait{ 0 };
+	{
+		const std::scoped_lock guard{ s_ThrottleLock };
+		if ( s_BytesPerSecond != 0 ) {
+			const auto now{ std::chrono::steady_clock::now() };
+			s_Tokens = std::min( s_BytesPerSecond * BUCKET_SECONDS, s_Tokens + s_BytesPerSecond * std::chrono::duration<double>( now - s_LastRefill ).count() );
+			s_LastRefill = now;
+			// a read bigger than what's left goes into debt, which the reads queued after it wait for too
+			s_Tokens -= static_cast<double>( bytes );
+			if ( s_Tokens < 0 )
+				wait = std::chrono::duration<double>( -s_Tokens / s_BytesPerSecond );
+		}
+	}
+	if ( wait.count() > 0 )
+		std::this_thread::sleep_for( wait );
+
+	this->started = true;
+	this->bytes = bytes;
+	this->start = std::chrono::steady_clock::now();
+}
+
+auto ThrottledRead::end() -> void {
+	if (! s_bBackoff )
+		return;
+
+	const auto took{ std::chrono::duration<double>( std::chrono::steady_clock::now() - this->start ).count() };
+	const auto latency{ took / std::max( static_cast<double>( this->bytes ), MIN_READ_SIZE ) };
+	double pause{ 0 };
+	bool started{ false };
+	bool stopped{ false };
+	{
+		const std::scoped_lock guard{ s_ThrottleLock };
+		s_Reads += 1;
+		if ( s_Reads <= BASELINE_READS ) {
+			s_UsualLatency += ( latency - s_UsualLatency ) / s_Reads;
+			s_RecentLatency = s_UsualLatency;
+			return;
+		}
+
+		s_RecentLatency += ( latency - s_RecentLatency ) / 8;
+		if ( s_RecentLatency > s_UsualLatency * SLOW_LATENCY ) {
+			started = s_Pause == 0;
+			s_Pause = std::clamp( s_Pause * 2, 1.0, MAX_PAUSE );
+		} else if ( s_RecentLatency < s_UsualLatency * NORMAL_LATENCY ) {
+			// what's usual follows slow changes, such as going from cached files to ones on disk
+			s_UsualLatency += ( latency - s_UsualLatency ) / 256;
+			stopped = s_Pause != 0 && s_Pause < 1.0 / 16;
+			s_Pause = s_Pause < 1.0 / 16 ? 0 : s_Pause / 2;
+		}
+		pause = took * s_Pause;
+	}
+
+	if ( started )
+		Log_Verbose( "Reads got slower, backing off" );
+	if ( stopped )
+		Log_Verbose( "Reads are back to their usual speed" );
+	if ( pause > 0 )
+		std::this_thread::sleep_for( std::chrono::duration<double>( pause ) );
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+extern bool g_bThrottling;
+
+// Limits the reads of all threads together to `bytesPerSecond`, zero leaves them unlimited
+auto setReadBandwidth( std::uint64_t bytesPerSecond ) -> void;
+// Pauses after every read while reads take much longer than they used to, which means something else wants the disk
+auto setLatencyBackoff( bool enabled ) -> void;
+// Lowers the I/O priority of the process to idle and its CPU priority to the lowest, must be called before starting
+// any thread, as they inherit it
+auto setBackgroundPriority() -> bool;
+
+// Put around a read of `bytes`: waits for the bandwidth it needs first, and measures how long it took once done,
+// costs a single branch when not throttling
+class ThrottledRead {
+public:
+	explicit ThrottledRead( std::size_t bytes ) {
+		if ( g_bThrottling )
+			this->begin( bytes );
+	}
+	~ThrottledRead() {
+		if ( this->started )
+			this->end();
+	}
+	ThrottledRead( const ThrottledRead& ) = delete;
+	auto operator=( const ThrottledRead& ) -> ThrottledRead& = delete;
+private:
+	auto begin( std::size_t bytes ) -> void;
+	auto end() -> void;
+
+	bool started{ false };
+	std::size_t bytes{ 0 };
+	std::chrono::steady_clock::time_point start;
+};
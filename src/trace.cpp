@@ -0,0 +1,128 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "log.hpp"
+
+bool g_bTracing = false;
+
+struct TraceEvent {
+	const char* name;
+	std::string file;
+	std::size_t track;
+	// nanoseconds since tracing started
+	std::int64_t start;
+	std::int64_t duration;
+};
+
+// Spans are kept by the thread recording them, and handed over when it exits or the trace is written
+struct ThreadTrace {
+	~ThreadTrace();
+	auto flush() -> void;
+
+	std::size_t track{ 0 };
+	std::vector<TraceEvent> events;
+};
+
+static std::mutex s_TraceLock;
+static std::vector<TraceEvent> s_TraceEvents;
+static std::chrono::steady_clock::time_point s_TraceStart;
+static thread_local ThreadTrace t_Trace;
+
+static auto now() -> std::int64_t;
+static auto escapeJson( std::string_view text ) -> std::string;
+
+TraceFile::TraceFile( const std::filesystem::path& path ) : path{ path } {
+	s_TraceStart = std::chrono::steady_clock::now();
+	g_bTracing = true;
+}
+
+TraceFile::~TraceFile() {
+	g_bTracing = false;
+	t_Trace.flush();
+
+	std::ofstream writer{ this->path, std::ios::out | std::ios::trunc | std::ios::binary };
+	if (! writer.good() ) {
+		Log_Error( "Failed to open trace file for writing: `{}`", this->path.string() );
+		return;
+	}
+
+	const std::scoped_lock guard{ s_TraceLock };
+	std::set<std::size_t> tracks;
+	writer << "{\"traceEvents\":[\n";
+	for ( const auto& event : s_TraceEvents ) {
+		tracks.insert( event.track );
+		writer << fmt::format( R"({{"name":"{}","cat":"verifier","ph":"X","pid":1,"tid":{},"ts":{:.3f},"dur":{:.3f})", event.name, event.track, event.start / 1000.0, event.duration / 1000.0 );
+		if (! event.file.empty() )
+			writer << fmt::format( R"(,"args":{{"file":"{}"}})", escapeJson( event.file ) );
+		writer << "},\n";
+	}
+	for ( const auto track : tracks ) {
+		const auto name{ track == 0 ? std::string{ "main" } : fmt::format( "worker {}", track - 1 ) };
+		writer << fmt::format( R"({{"name":"thread_name","ph":"M","pid":1,"tid":{},"args":{{"name":"{}"}}}},)" "\n", track, name );
+	}
+	writer << R"({"name":"process_name","ph":"M","pid":1,"tid":0,"args":{"name":"verifier"}}]})" "\n";
+
+	if (! writer.good() ) {
+		Log_Error( "Failed to write trace file `{}`", this->path.string() );
+		return;
+	}
+	Log_Info( "Wrote {} spans to `{}`", s_TraceEvents.size(), this->path.string() );
+	s_TraceEvents.clear();
+}
+
+auto setTraceTrack( std::size_t worker ) -> void {
+	t_Trace.track = worker + 1;
+}
+
+auto TraceSpan::begin( const char* name, std::string_view file ) -> void {
+	this->name = name;
+	this->file.assign( file );
+	this->start = now();
+}
+
+auto TraceSpan::end() -> void {
+	const auto end{ now() };
+	t_Trace.events.push_back( { this->name, std::move( this->file ), t_Trace.track, this->start, end - this->start } );
+}
+
+ThreadTrace::~ThreadTrace() {
+	this->flush();
+}
+
+auto ThreadTrace::flush() -> void {
+	if ( this->events.empty() )
+		return;
+
+	const std::scoped_lock guard{ s_TraceLock };
+	std::move( this->events.begin(), this->events.end(), std::back_inserter( s_TraceEvents ) );
+	this->events.clear();
+}
+
+static auto now() -> std::int64_t {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - s_TraceStart ).count();
+}
+
+static auto escapeJson( std::string_view text ) -> std::string {
+	std::string escaped;
+	escaped.reserve( text.size() );
+	for ( const char c : text ) {
+		if ( c == '"' || c == '\\' ) {
+			escaped += '\\';
+			escaped += c;
+		} else if ( static_cast<unsigned char>( c ) < 0x20 ) {
+			escaped += fmt::format( "\\u{:04x}", static_cast<unsigned>( c ) );
+		} else {
+			escaped += c;
+		}
+	}
+	return escaped;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+extern bool g_bTracing;
+
+// Records spans while alive, and writes them to `path` in Chrome's trace event format once destroyed,
+// which can be opened with `chrome://tracing` or Perfetto
+class TraceFile {
+public:
+	explicit TraceFile( const std::filesystem::path& path );
+	~TraceFile();
+	TraceFile( const TraceFile& ) = delete;
+	auto operator=( const TraceFile& ) -> TraceFile& = delete;
+private:
+	std::filesystem::path path;
+};
+
+// Spans recorded by the calling thread go on the track of this worker, the main thread's is zero
+auto setTraceTrack( std::size_t worker ) -> void;
+
+// Records the time spent in a scope, costs a single branch when not tracing
+class TraceSpan {
+public:
+	// `name` must outlive the trace, a string literal
+	explicit TraceSpan( const char* name ) {
+		if ( g_bTracing )
+			this->begin( name, {} );
+	}
+	TraceSpan( const char* name, std::string_view file ) {
+		if ( g_bTracing )
+			this->begin( name, file );
+	}
+	~TraceSpan() {
+		if ( this->name )
+			this->end();
+	}
+	TraceSpan( const TraceSpan& ) = delete;
+	auto operator=( const TraceSpan& ) -> TraceSpan& = delete;
+private:
+	auto begin( const char* name, std::string_view file ) -> void;
+	auto end() -> void;
+
+	const char* name{ nullptr };
+	std::string file;
+	std::int64_t start{ 0 };
+};
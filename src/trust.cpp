@@ -0,0 +1,226 @@
+#include "trust.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+
+#include <fmt/format.h>
+
+#ifndef _WIN32
+	#include <sys/stat.h>
+#endif
+
+#include "checkpoint.hpp"
+#include "digest.hpp"
+#include "log.hpp"
+
+static constexpr std::chrono::nanoseconds RACY_WINDOW{ std::chrono::seconds{ 2 } };
+
+#ifndef _WIN32
+static auto toFileIdentity( const struct stat& info, FileIdentity& identity ) -> bool;
+#endif
+// Parses a whole field as a number, returns false if it isn't one
+template <typename T>
+static auto parseNumber( std::string_view field, T& value ) -> bool;
+
+auto getFileIdentity( const std::filesystem::path& path, FileIdentity& identity ) -> bool {
+#ifndef _WIN32
+	struct stat info{};
+	return ::stat( path.c_str(), &info ) == 0 && toFileIdentity( info, identity );
+#else
+	// there is no inode/change time we can get cheaply here, size and write time will have to do
+	std::error_code err;
+	const auto status{ std::filesystem::status( path, err ) };
+	if ( err || !std::filesystem::is_regular_file( status ) )
+		return false;
+
+	identity.device = 0;
+	identity.inode = 0;
+	identity.size = std::filesystem::file_size( path, err );
+	identity.mtime = std::filesystem::last_write_time( path, err ).time_since_epoch().count();
+	identity.ctime = 0;
+	identity.links = 0;
+	return !err;
+#endif
+}
+
+#ifndef _WIN32
+auto getFileIdentity( int file, FileIdentity& identity ) -> bool {
+	struct stat info{};
+	return ::fstat( file, &info ) == 0 && toFileIdentity( info, identity );
+}
+#endif
+
+TrustCache::TrustCache() {
+#ifndef _WIN32
+	const auto now{ std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::system_clock::now().time_since_epoch() ) };
+	this->racyThreshold = ( now - RACY_WINDOW ).count();
+#else
+	const auto now{ std::filesystem::file_time_type::clock::now() };
+	this->racyThreshold = ( now - std::chrono::duration_cast<std::filesystem::file_time_type::duration>( RACY_WINDOW ) ).time_since_epoch().count();
+#endif
+}
+
+auto TrustCache::load( const std::filesystem::path& path ) -> void {
+	const std::scoped_lock guard{ this->lock };
+	std::ifstream reader{ path, std::ios::in | std::ios::binary | std::ios::ate };
+	if (! reader.good() )
+		return;
+
+	this->contents.resize( static_cast<std::size_t>( reader.tellg() ) );
+	reader.seekg( 0 );
+	if (! reader.read( this->contents.data(), static_cast<std::streamsize>( this->contents.size() ) ) ) {
+		this->contents.clear();
+		return;
+	}
+
+	// a row is only complete with its terminator, anything after the last one was cut off
+	const std::string_view view{ this->contents };
+	this->loaded.clear();
+	this->loaded.reserve( static_cast<std::size_t>( std::count( view.begin(), view.end(), '\xFD' ) ) );
+	for ( std::size_t start{ 0 }, end; ( end = view.find( '\xFD', start ) ) != std::string_view::npos; start = end + 1 ) {
+		auto row{ view.substr( start, end - start ) };
+		std::array<std::string_view, 8> values;
+		std::size_t count{ 0 };
+		for ( std::size_t separator; count < values.size() && ( separator = row.find( '\xFF' ) ) != std::string_view::npos; row.remove_prefix( separator + 1 ) )
+			values[ count++ ] = row.substr( 0, separator );
+		if ( count < values.size() )
+			continue;
+
+		// a bad row only costs a rehash
+		Entry entry{};
+		auto& id{ entry.identity };
+		if (! ( parseNumber( values[ 1 ], id.device ) && parseNumber( values[ 2 ], id.inode ) && parseNumber( values[ 3 ], id.size )
+			&& parseNumber( values[ 4 ], id.mtime ) && parseNumber( values[ 5 ], id.ctime ) && parseHex( values[ 6 ], entry.sha1 ) && parseHex( values[ 7 ], entry.crc32 ) ) )
+			continue;
+		this->loaded.emplace_back( values[ 0 ], entry );
+	}
+
+	// the last row of a file wins, same as if they replaced each other
+	std::stable_sort( this->loaded.begin(), this->loaded.end(), []( const auto& a, const auto& b ) { return a.first < b.first; } );
+	std::size_t trusted{ 0 };
+	for ( std::size_t i = 0; i < this->loaded.size(); i++ ) {
+		if ( i + 1 < this->loaded.size() && this->loaded[ i ].first == this->loaded[ i + 1 ].first )
+			this->loaded[ i ].second.trusted = false;
+		else
+			trusted += 1;
+	}
+	Log_Info( "Loaded {} trusted files from `{}`", trusted, path.string() );
+}
+
+auto TrustCache::save( const std::filesystem::path& path ) const -> bool {
+	std::string contents;
+	const std::scoped_lock guard{ this->lock };
+	contents.reserve( this->contents.size() + this->added.size() * 256 );
+	const auto write{ [ &contents ]( std::string_view file, const Entry& entry ) {
+		const auto& id{ entry.identity };
+		fmt::format_to( std::back_inserter( contents ), "{}\xFF{}\xFF{}\xFF{}\xFF{}\xFF{}\xFF", file, id.device, id.inode, id.size, id.mtime, id.ctime );
+		appendHex( contents, entry.sha1 );
+		contents += '\xFF';
+		appendHex( contents, entry.crc32 );
+		contents += "\xFF\xFD";
+	} };
+	for ( const auto& [ file, entry ] : this->loaded )
+		if ( entry.trusted )
+			write( file, entry );
+	for ( const auto& [ file, entry ] : this->added )
+		write( file, entry );
+	return writeAtomically( path, contents );
+}
+
+auto TrustCache::isTrusted( const std::string& path, const FileIdentity& identity, std::string_view sha1, std::string_view crc32 ) const -> bool {
+	Entry expected{};
+	if (! setEntry( expected, identity, sha1, crc32 ) )
+		return false;
+
+	const std::scoped_lock guard{ this->lock };
+	const Entry* entry{ this->findLoaded( path ) };
+	if ( entry == nullptr || !entry->trusted ) {
+		const auto it{ this->added.find( path ) };
+		entry = it != this->added.end() ? &it->second : nullptr;
+	}
+	return entry != nullptr && entry->identity == identity && entry->sha1 == expected.sha1 && entry->crc32 == expected.crc32;
+}
+
+auto TrustCache::trust( const std::string& path, const FileIdentity& identity, std::string_view sha1, std::string_view crc32 ) -> void {
+	Entry trusted{};
+	if ( identity.mtime >= this->racyThreshold || identity.ctime >= this->racyThreshold || !setEntry( trusted, identity, sha1, crc32 ) ) {
+		this->forget( path );
+		return;
+	}
+
+	const std::scoped_lock guard{ this->lock };
+	// already there when a trusted file is verified again, which must not cost any allocation
+	if ( auto* entry{ const_cast<Entry*>( this->findLoaded( path ) ) } ) {
+		*entry = trusted;
+		return;
+	}
+	this->added.insert_or_assign( path, trusted );
+}
+
+auto TrustCache::forget( const std::string& path ) -> void {
+	const std::scoped_lock guard{ this->lock };
+	if ( auto* entry{ const_cast<Entry*>( this->findLoaded( path ) ) } )
+		entry->trusted = false;
+	this->added.erase( path );
+}
+
+auto TrustCache::isLinkVerified( const FileIdentity& identity, std::string_view sha1, std::string_view crc32 ) const -> bool {
+	// without an inode there's no telling links apart from copies
+	if ( identity.links < 2 || identity.inode == 0 )
+		return false;
+	Entry expected{};
+	if (! setEntry( expected, identity, sha1, crc32 ) )
+		return false;
+	const std::scoped_lock guard{ this->lock };
+	const auto it{ this->links.find( { identity.device, identity.inode } ) };
+	return it != this->links.end() && it->second.identity == identity && it->second.sha1 == expected.sha1 && it->second.crc32 == expected.crc32;
+}
+
+auto TrustCache::addVerifiedLink( const FileIdentity& identity, std::string_view sha1, std::string_view crc32 ) -> void {
+	if ( identity.links < 2 || identity.inode == 0 )
+		return;
+	Entry verified{};
+	if (! setEntry( verified, identity, sha1, crc32 ) )
+		return;
+	const std::scoped_lock guard{ this->lock };
+	this->links.insert_or_assign( { identity.device, identity.inode }, verified );
+}
+
+auto TrustCache::findLoaded( std::string_view path ) const -> const Entry* {
+	// past the last row of `path`, the one that counts
+	const auto it{ std::upper_bound( this->loaded.begin(), this->loaded.end(), path, []( std::string_view file, const auto& entry ) { return file < entry.first; } ) };
+	if ( it == this->loaded.begin() || std::prev( it )->first != path )
+		return nullptr;
+	return &std::prev( it )->second;
+}
+
+auto TrustCache::setEntry( Entry& entry, const FileIdentity& identity, std::string_view sha1, std::string_view crc32 ) -> bool {
+	entry.identity = identity;
+	entry.trusted = true;
+	return parseHex( sha1, entry.sha1 ) && parseHex( crc32, entry.crc32 );
+}
+
+#ifndef _WIN32
+static auto toFileIdentity( const struct stat& info, FileIdentity& identity ) -> bool {
+	if (! S_ISREG( info.st_mode ) )
+		return false;
+
+	identity.device = static_cast<std::uint64_t>( info.st_dev );
+	identity.inode = static_cast<std::uint64_t>( info.st_ino );
+	identity.size = static_cast<std::uint64_t>( info.st_size );
+	identity.mtime = static_cast<std::int64_t>( info.st_mtim.tv_sec ) * 1'000'000'000 + info.st_mtim.tv_nsec;
+	identity.ctime = static_cast<std::int64_t>( info.st_ctim.tv_sec ) * 1'000'000'000 + info.st_ctim.tv_nsec;
+	identity.links = static_cast<std::uint64_t>( info.st_nlink );
+	return true;
+}
+#endif
+
+template <typename T>
+static auto parseNumber( std::string_view field, T& value ) -> bool {
+	const auto end{ field.data() + field.size() };
+	const auto [ ptr, err ]{ std::from_chars( field.data(), end, value ) };
+	return err == std::errc{} && ptr == end;
+}
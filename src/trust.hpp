@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// What we consider a file's identity, if none of these changed neither did the contents
+struct FileIdentity {
+	std::uint64_t device{ 0 };
+	std::uint64_t inode{ 0 };
+	std::uint64_t size{ 0 };
+	std::int64_t mtime{ 0 };
+	std::int64_t ctime{ 0 };
+	// hard links to it, not part of its identity, adding or removing one changes its ctime anyway
+	std::uint64_t links{ 0 };
+
+	auto operator==( const FileIdentity& other ) const -> bool {
+		return this->device == other.device && this->inode == other.inode && this->size == other.size && this->mtime == other.mtime && this->ctime == other.ctime;
+	}
+};
+
+// A single stat call, returns false if the file doesn't exist or can't be queried
+auto getFileIdentity( const std::filesystem::path& path, FileIdentity& identity ) -> bool;
+#ifndef _WIN32
+// Same, for a file that is already open
+auto getFileIdentity( int file, FileIdentity& identity ) -> bool;
+#endif
+
+// Files that were verified by an earlier run and have not been touched since, safe to share between threads
+class TrustCache {
+public:
+	TrustCache();
+
+	auto load( const std::filesystem::path& path ) -> void;
+	auto save( const std::filesystem::path& path ) const -> bool;
+
+	[[nodiscard]] auto isTrusted( const std::string& path, const FileIdentity& identity, std::string_view sha1, std::string_view crc32 ) const -> bool;
+	auto trust( const std::string& path, const FileIdentity& identity, std::string_view sha1, std::string_view crc32 ) -> void;
+	auto forget( const std::string& path ) -> void;
+	// Files with several hard links verified by this run, so that reaching them again through another link doesn't
+	// read them again, never saved
+	[[nodiscard]] auto isLinkVerified( const FileIdentity& identity, std::string_view sha1, std::string_view crc32 ) const -> bool;
+	auto addVerifiedLink( const FileIdentity& identity, std::string_view sha1, std::string_view crc32 ) -> void;
+private:
+	struct Entry {
+		FileIdentity identity;
+		// raw, the hex digests of the index are parsed on the stack to be compared
+		std::array<unsigned char, 20> sha1;
+		std::array<unsigned char, 4> crc32;
+		// files loaded from an earlier run stay where they are when forgotten, and aren't saved
+		bool trusted{ true };
+	};
+
+	// the loaded entry for `path`, or null
+	auto findLoaded( std::string_view path ) const -> const Entry*;
+	// sets an entry if the digests are valid hex, returns false if they aren't
+	static auto setEntry( Entry& entry, const FileIdentity& identity, std::string_view sha1, std::string_view crc32 ) -> bool;
+
+	mutable std::mutex lock;
+	// the file as it was loaded, and its entries sorted by path pointing into it, so that loading allocates once for
+	// the whole file and trusting a file again none at all
+	std::string contents;
+	std::vector<std::pair<std::string_view, Entry>> loaded;
+	// files trusted by this run which weren't before
+	std::unordered_map<std::string, Entry> added;
+	std::map<std::pair<std::uint64_t, std::uint64_t>, Entry> links;
+	// files modified this close to the start of the run could change again within the timestamp granularity
+	std::int64_t racyThreshold;
+};
@@ -3,23 +3,210 @@
 //
 #include "verify.hpp"
 
+#include <algorithm>
 #include <array>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <set>
+#include <span>
+#include <tuple>
+#include <unordered_set>
 
 #include <cryptopp/crc.h>
-#include <cryptopp/filters.h>
-#include <cryptopp/hex.h>
 #include <cryptopp/sha.h>
 #include <vpkpp/format/VPK.h>
 
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <unistd.h>
+#else
+	#include <fcntl.h>
+	#include <io.h>
+#endif
+
+#include "archive.hpp"
+#include "checkpoint.hpp"
+#include "devices.hpp"
+#include "digest.hpp"
+#include "index.hpp"
+#include "layout.hpp"
 #include "log.hpp"
+#include "repair.hpp"
+#include "throttle.hpp"
+#include "trace.hpp"
+#include "trust.hpp"
+#include "watch.hpp"
+
+// how much of a loose file is read at once
+static constexpr std::size_t READ_BUFFER_SIZE{ 256 * 1024 };
+// what `openFile` returns instead of a file
+static constexpr int FILE_MISSING{ -1 };
+static constexpr int FILE_UNREADABLE{ -2 };
+
+// Reused from one entry to the next, so that verifying a loose file allocates nothing
+struct VerifyBuffers {
+	VerifyBuffers( const std::filesystem::path& root, const VerifyOptions& options );
+
+	std::string root;
+	std::string path;
+	std::vector<unsigned char> read;
+};
+
+// What a thread verifying entries keeps to itself, merged once the batch it worked on is done
+struct VerifyWorker {
+	VerifyWorker( const std::filesystem::path& root, const VerifyOptions& options );
+
+	VerifyOptions options;
+	VerifyBuffers buffers;
+	VerifyCheckpoint progress;
+	// the same, for each of the batches of rows `verifyIndex` has in flight
+	std::array<VerifyCheckpoint, DEVICE_BATCHES> batches;
+};
+
+// What the whole-file digests of the VPKs said, entries stored in files which still match don't need to be read
+struct ChunkDigests {
+	struct Archive {
+		bool directoryMatches{ false };
+		// numbered files which were checked and still match, those without a digest never are
+		std::unordered_set<std::uint32_t> matched;
+	};
+	// by the relative path of their directory file, only the VPKs which have digests
+	std::unordered_map<std::string, Archive> archives;
+	// paths of the loose rows holding the digests, they aren't entries of their own
+	std::unordered_set<std::string> chunks;
+};
+
+// Which rows of the index a run skips
+struct RowFilter {
+	// Returns true if `row` isn't this run's to verify, `key` is scratch space
+	auto excludes( const IndexRow& row, std::string& key ) const -> bool;
+
+	// `archive/path` of the rows already verified with the critical files
+	std::unordered_set<std::string> verified;
+	// when verifying a single part, the VPKs by the path of their directory file and the loose files which are in it
+	bool partitioned{ false };
+	std::unordered_set<std::string> units;
+};
+
+// One of the installs verified against a shared index
+struct FleetRoot {
+	std::filesystem::path path;
+	std::string name;
+	VerifyCheckpoint progress;
+};
 
-static auto verifyArchivedFile( const std::string& archivePath, const std::string& archiveRel, const std::string& entryPath, std::uint64_t expectedSize, std::string_view expectedSha1, std::string_view expectedCrc32, unsigned int& entries, unsigned int& errors ) -> void;
+// What a thread verifying rows for all of the roots at once keeps to itself
+struct FleetWorker {
+	FleetWorker( const VerifyOptions& options, std::size_t roots );
 
-static auto splitString( const std::string& string, const std::string& delim ) -> std::vector<std::string>;
+	VerifyOptions options;
+	// its root is switched to the one being verified
+	VerifyBuffers buffers;
+	// one per root, merged once the batch it worked on is done
+	std::vector<VerifyCheckpoint> progress;
+};
 
-auto verify( std::string_view root_, std::string_view indexLocation ) -> int {
+// The VPK files of every root, which are few and looked up for every entry
+struct FleetFiles {
+	// Returns false if it doesn't exist
+	auto getIdentity( const std::string& path, FileIdentity& identity ) -> bool;
+	// The first path seen of a directory VPK, so that the hard linked copies of the other roots are only parsed once,
+	// as are the copies which still match the index like the first one that did
+	auto getCanonical( const FileIdentity& identity, const std::string& path, const std::string& vpkRel, TrustCache& trustCache, FleetWorker& worker ) -> std::string;
+
+	std::mutex lock;
+	std::unordered_map<std::string, std::optional<FileIdentity>> identities;
+	std::map<std::pair<std::uint64_t, std::uint64_t>, std::string> directories;
+	// the rows with the whole-file digests of the directory VPKs, and the first copy found to match them, both by
+	// the relative path of the VPK
+	std::unordered_map<std::string, IndexRow> directoryRows;
+	std::unordered_map<std::string, std::string> matchingDirectories;
+};
+
+// Tells the copies of a row in different roots apart, they are the same file if it's the same for both
+struct FleetKey {
+	std::uint64_t device{ 0 };
+	std::uint64_t inode{ 0 };
+	// of the file holding the data of an entry
+	std::uint64_t chunkDevice{ 0 };
+	std::uint64_t chunkInode{ 0 };
+
+	auto operator==( const FleetKey& ) const -> bool = default;
+};
+
+// opening a file costs about as much as reading this much of it, so that many small files weigh more than their size
+static constexpr std::uint64_t PART_FILE_COST{ 16 * 1024 };
+
+// set while verifying a row on behalf of several roots, its reports are logged by whoever knows which roots they concern
+static thread_local bool t_bCollectReports{ false };
+
+static auto verifyIndex( const std::filesystem::path& root, const std::filesystem::path& indexPath, const VerifyOptions& options, VerifyCheckpoint& progress, const RowFilter& filter ) -> int;
+// Returns false if one of the indexes doesn't match its trailer, as do the others reading every row of an index
+static auto partitionRows( const std::vector<std::filesystem::path>& indexPaths, const VerifyOptions& options, RowFilter& filter ) -> bool;
+static auto getPartSuffix( const VerifyOptions& options ) -> std::string;
+// Parts verified at the same time each save their own, or they'd overwrite each other's
+static auto getTrustCachePath( const std::filesystem::path& indexPath, const VerifyOptions& options ) -> std::filesystem::path;
+static auto savePartResults( const std::filesystem::path& indexPath, const VerifyOptions& options, const VerifyCheckpoint& total, int result ) -> int;
+// Verifies every row of the indexes for all of `options.roots`, reading the index once
+static auto verifyFleet( const std::vector<std::filesystem::path>& indexPaths, const VerifyOptions& options ) -> int;
+static auto verifyFleetRow( const std::vector<FleetRoot>& roots, const IndexRow& row, FleetFiles& files, TrustCache& trustCache, ArchiveCache& loadedVPKs, FleetWorker& worker ) -> void;
+// Returns false if the copy of `root` can't be told apart from the others, because it's missing
+static auto getFleetKey( const FleetRoot& root, const IndexRow& row, FleetFiles& files, TrustCache& trustCache, ArchiveCache& loadedVPKs, FleetWorker& worker, FleetKey& key ) -> bool;
+// The indexed VPKs, from the archive table of compact indexes
+static auto findArchives( const std::filesystem::path& indexPath ) -> std::unordered_set<std::string>;
+// The rows with the whole-file digests of the directory VPKs, by the relative path of the VPK
+static auto findDirectoryRows( const std::filesystem::path& indexPath, const std::unordered_set<std::string>& archives, std::unordered_map<std::string, IndexRow>& rows ) -> bool;
+// Verifies only the rows matching `options.paths`, which are looked up instead of reading every row
+static auto verifyPaths( const std::filesystem::path& root, const std::vector<std::filesystem::path>& indexPaths, const VerifyOptions& options ) -> int;
+static auto verifyCritical( const std::filesystem::path& root, const std::vector<std::filesystem::path>& indexPaths, const VerifyOptions& options, VerifyCheckpoint& progress, std::unordered_set<std::string>& verified ) -> bool;
+static auto readCriticalGlobs( const std::vector<std::string>& critical, std::vector<std::string>& globs ) -> bool;
+static auto findPathRows( const std::filesystem::path& indexPath, const std::vector<std::string>& globs, std::vector<IndexRow>& rows ) -> bool;
+// Restores the files holding what was reported from `options.repairFrom`, then verifies what was reported again
+static auto repairReported( const std::filesystem::path& root, const std::vector<std::filesystem::path>& indexPaths, const std::vector<ReportRow>& reports, const VerifyOptions& options ) -> int;
+// Finds the rows of the given archive and path pairs
+static auto findRows( const std::filesystem::path& indexPath, const std::set<std::pair<std::string, std::string>>& keys, std::vector<IndexRow>& rows ) -> bool;
+// Whether `text` is matched by `glob` as a whole, `*` matches any characters and `?` a single one
+static auto matchGlob( std::string_view glob, std::string_view text ) -> bool;
+static auto verifyChanged( const std::filesystem::path& root, const std::vector<IndexRow>& rows, const std::unordered_map<std::string, std::vector<std::size_t>>& rowsByFile, const std::unordered_set<std::string>& changed, const VerifyOptions& options, TrustCache& trustCache, ArchiveCache& loadedVPKs, VerifyBuffers& buffers ) -> void;
+static auto verifyEntry( const std::filesystem::path& root, const IndexRow& row, const VerifyOptions& options, TrustCache& trustCache, ArchiveCache& loadedVPKs, VerifyBuffers& buffers, VerifyCheckpoint& progress ) -> void;
+static auto verifyLooseFile( const IndexRow& row, const VerifyOptions& options, TrustCache& trustCache, VerifyBuffers& buffers, VerifyCheckpoint& progress ) -> void;
+static auto loadIndexRows( const std::filesystem::path& indexPath, std::vector<IndexRow>& rows ) -> bool;
+static auto sortByPhysicalLocation( const std::filesystem::path& root, ArchiveCache& loadedVPKs, const std::vector<IndexRow>& rows, std::vector<std::size_t>& order ) -> void;
+static auto verifyArchivedFile( ArchiveCache& loadedVPKs, const std::string& archivePath, const std::string& archiveRel, const std::string& entryPath, std::uint64_t expectedSize, std::string_view expectedSha1, std::string_view expectedCrc32, const VerifyOptions& options, VerifyCheckpoint& progress ) -> void;
+// Reads an entry's contents and hashes them, the sha1 only at the full level, returns false if it couldn't be read
+static auto hashArchivedFile( const vpkpp::PackFile& vpk, const std::string& archivePath, const std::string& entryPath, const vpkpp::Entry& entry, bool linked, const VerifyOptions& options, PayloadDigests& digests ) -> bool;
+// Finds the rows holding whole-file digests of VPK files, and hashes those files silently so that their entries can be
+// skipped, unless the level is too low to read anything
+static auto checkChunks( const std::filesystem::path& root, const std::filesystem::path& indexPath, TrustCache& trustCache, DeviceQueues& queues, std::vector<std::unique_ptr<VerifyWorker>>& workers, const VerifyOptions& options, const RowFilter& filter, ChunkDigests& digests ) -> bool;
+static auto checkChunk( const IndexRow& row, const VerifyOptions& options, TrustCache& trustCache, VerifyBuffers& buffers ) -> bool;
+// Whether a loose `path` is the directory or a numbered file of one of the indexed `archives`, and which one
+static auto findChunkOwner( const std::unordered_set<std::string>& archives, const std::string& path, std::string& vpkRel, std::uint32_t& archiveIndex ) -> bool;
+static auto isCoveredByChunks( const ChunkDigests& digests, const std::filesystem::path& root, const IndexRow& row, ArchiveCache& loadedVPKs ) -> bool;
+
+// Compares a digest to the hex one from the index, reporting them if they differ
+static auto checkDigest( VerifyCheckpoint& progress, std::string_view file, std::string_view message, std::span<const unsigned char> got, std::string_view expected ) -> bool;
+static auto matchesDigest( std::span<const unsigned char> got, std::string_view expected ) -> bool;
+static auto addWorkers( const std::filesystem::path& root, const VerifyOptions& options, const DeviceQueues& queues, std::vector<std::unique_ptr<VerifyWorker>>& workers ) -> void;
+// Opens a file and tells its identity, returns FILE_MISSING or FILE_UNREADABLE if it can't
+static auto openFile( const std::string& path, FileIdentity& identity ) -> int;
+// Hashes what's left of an open file, the sha1 only if `full`, returns false if reading it failed
+static auto hashFile( int file, bool full, VerifyBuffers& buffers, std::span<unsigned char, CryptoPP::SHA1::DIGESTSIZE> sha1, std::span<unsigned char, CryptoPP::CRC32::DIGESTSIZE> crc32 ) -> bool;
+static auto readFile( int file, unsigned char* buffer, std::size_t size ) -> std::ptrdiff_t;
+static auto closeFile( int file ) -> void;
+static auto report( VerifyCheckpoint& progress, std::string_view file, std::string_view message, std::string_view got, std::string_view expected ) -> void;
+
+auto verify( std::string_view root_, std::string_view indexLocation, const VerifyOptions& options ) -> int {
 	const std::filesystem::path root{ root_ };
 	const std::filesystem::path indexPath{ root / indexLocation };
 
@@ -28,196 +215,1605 @@ auto verify( std::string_view root_, std::string_view indexLocation ) -> int {
 		return 1;
 	}
 
+	std::vector<IndexShard> shards;
+	if (! readIndexManifest( indexPath, shards ) ) {
+		if (! options.shards.empty() )
+			Log_Warn( "Index file `{}` is not sharded, `--shards` will be ignored.", indexPath.string() );
+		if (! options.roots.empty() )
+			return verifyFleet( { indexPath }, options );
+		if (! options.paths.empty() )
+			return verifyPaths( root, { indexPath }, options );
+
+		RowFilter filter{};
+		if ( options.parts != 0 && !partitionRows( { indexPath }, options, filter ) )
+			return 1;
+		VerifyCheckpoint critical{};
+		const auto criticalPassed{ options.critical.empty() || verifyCritical( root, { indexPath }, options, critical, filter.verified ) };
+
+		VerifyCheckpoint progress{};
+		auto result{ verifyIndex( root, indexPath, options, progress, filter ) };
+		progress.entries += critical.entries;
+		progress.errors += critical.errors;
+		std::move( critical.reports.begin(), critical.reports.end(), std::back_inserter( progress.reports ) );
+		if ( result == 0 && !options.repairFrom.empty() && !progress.reports.empty() ) {
+			// repaired or not, the launcher is told that the critical files were bad
+			const auto repaired{ repairReported( root, { indexPath }, progress.reports, options ) };
+			result = criticalPassed ? repaired : CRITICAL_FILES_FAILED;
+		} else if ( result == 0 && !criticalPassed ) {
+			result = CRITICAL_FILES_FAILED;
+		}
+		return savePartResults( indexPath, options, progress, result );
+	}
+
+	// only the requested shards
+	if (! options.shards.empty() ) {
+		for ( const auto& key : options.shards ) {
+			if ( std::none_of( shards.begin(), shards.end(), [ &key ]( const auto& shard ) { return shard.key == key; } ) )
+				Log_Warn( "Index file `{}` has no shard `{}`.", indexPath.string(), key );
+		}
+		std::erase_if( shards, [ &options ]( const auto& shard ) {
+			return std::find( options.shards.begin(), options.shards.end(), shard.key ) == options.shards.end();
+		} );
+	}
+	Log_Info( "Using sharded index file at `{}` ({} shards selected)", indexPath.string(), shards.size() );
+	std::vector<std::filesystem::path> indexPaths;
+	for ( const auto& shard : shards )
+		indexPaths.push_back( indexPath.parent_path() / shard.file );
+	if ( !options.roots.empty() || !options.paths.empty() )
+		return options.roots.empty() ? verifyPaths( root, indexPaths, options ) : verifyFleet( indexPaths, options );
+
+	// a part spans all of the shards, and the critical files of every shard come before all of the others
+	RowFilter filter{};
+	if ( options.parts != 0 && !partitionRows( indexPaths, options, filter ) )
+		return 1;
+	VerifyCheckpoint critical{};
+	const auto criticalPassed{ options.critical.empty() || verifyCritical( root, indexPaths, options, critical, filter.verified ) };
+
+	// shards are independent indexes, each gets its own checkpoint and trust cache, and they're verified one after the
+	// other as each already keeps every device busy
+	auto start{ std::chrono::high_resolution_clock::now() };
+	std::vector<VerifyCheckpoint> results( shards.size() );
+	int result{ 0 };
+	for ( std::size_t i = 0; i < shards.size(); i++ ) {
+		if ( wasInterrupted() )
+			break;
+		if ( verifyIndex( root, indexPaths[ i ], options, results[ i ], filter ) != 0 )
+			result = 1;
+	}
+
+	VerifyCheckpoint total{};
+	for ( auto& shard : results ) {
+		total.entries += shard.entries;
+		total.errors += shard.errors;
+		std::move( shard.reports.begin(), shard.reports.end(), std::back_inserter( total.reports ) );
+	}
+
+	auto end{ std::chrono::high_resolution_clock::now() };
+	Log_Info( "Verified {} files in {} shards in {} with {} errors!", total.entries, shards.size(), std::chrono::duration_cast<std::chrono::seconds>( end - start ), total.errors );
+
+	total.entries += critical.entries;
+	total.errors += critical.errors;
+	std::move( critical.reports.begin(), critical.reports.end(), std::back_inserter( total.reports ) );
+
+	if ( result == 0 && !options.repairFrom.empty() && !total.reports.empty() ) {
+		const auto repaired{ repairReported( root, indexPaths, total.reports, options ) };
+		result = criticalPassed ? repaired : CRITICAL_FILES_FAILED;
+	} else if ( result == 0 && !criticalPassed ) {
+		result = CRITICAL_FILES_FAILED;
+	}
+	return savePartResults( indexPath, options, total, result );
+}
+
+VerifyBuffers::VerifyBuffers( const std::filesystem::path& root, const VerifyOptions& options ) : root{ root.string() } {
+	// a quarter of the memory limit at most, same as VPK entries read in pieces
+	auto size{ options.readSize != 0 ? options.readSize : READ_BUFFER_SIZE };
+	if ( options.memoryLimit != 0 )
+		size = std::clamp<std::size_t>( static_cast<std::size_t>( options.memoryLimit / 4 ), 4096, size );
+	this->read.resize( size );
+}
+
+VerifyWorker::VerifyWorker( const std::filesystem::path& root, const VerifyOptions& options ) : options{ options }, buffers{ root, options } { }
+
+FleetWorker::FleetWorker( const VerifyOptions& options, std::size_t roots ) : options{ options }, buffers{ {}, options }, progress( roots ) { }
+
+auto FleetFiles::getIdentity( const std::string& path, FileIdentity& identity ) -> bool {
+	const std::scoped_lock guard{ this->lock };
+	auto known{ this->identities.find( path ) };
+	if ( known == this->identities.end() ) {
+		FileIdentity found{};
+		known = this->identities.emplace( path, getFileIdentity( path, found ) ? std::optional{ found } : std::nullopt ).first;
+	}
+	if (! known->second )
+		return false;
+	identity = *known->second;
+	return true;
+}
+
+auto FleetFiles::getCanonical( const FileIdentity& identity, const std::string& path, const std::string& vpkRel, TrustCache& trustCache, FleetWorker& worker ) -> std::string {
+	const std::pair key{ identity.device, identity.inode };
+	const IndexRow* row{ nullptr };
+	{
+		const std::scoped_lock guard{ this->lock };
+		if ( const auto known{ this->directories.find( key ) }; known != this->directories.end() )
+			return known->second;
+		if ( const auto found{ this->directoryRows.find( vpkRel ) }; found != this->directoryRows.end() )
+			row = &found->second;
+	}
+
+	// a copy is only as good as its digest, both sha1 and crc32 whatever the level, the same size isn't enough
+	bool matches{ false };
+	if ( row ) {
+		auto options{ worker.options };
+		options.level = VerifyLevel::Full;
+		matches = checkChunk( *row, options, trustCache, worker.buffers );
+	}
+
+	const std::scoped_lock guard{ this->lock };
+	const auto& canonical{ matches ? this->matchingDirectories.try_emplace( vpkRel, path ).first->second : path };
+	return this->directories.try_emplace( key, canonical ).first->second;
+}
+
+auto RowFilter::excludes( const IndexRow& row, std::string& key ) const -> bool {
+	if ( this->partitioned && !this->units.contains( row.archive == "." ? row.path : row.archive ) )
+		return true;
+	// already verified with the critical files
+	return !this->verified.empty() && this->verified.contains( key.assign( row.archive ).append( 1, '/' ).append( row.path ) );
+}
+
+auto mergeResults( std::string_view root_, std::string_view indexLocation ) -> int {
+	const std::filesystem::path root{ root_ };
+	const std::filesystem::path indexPath{ root / indexLocation };
+
+	// `<index>.part-<i>-of-<n>.results`
+	const auto prefix{ indexPath.filename().string() + ".part-" };
+	std::map<unsigned, std::map<unsigned, std::filesystem::path>> found;
+	std::error_code err;
+	for ( const auto& entry : std::filesystem::directory_iterator{ indexPath.parent_path(), err } ) {
+		const auto name{ entry.path().filename().string() };
+		unsigned part{ 0 };
+		unsigned parts{ 0 };
+		char end{ 0 };
+		if ( name.starts_with( prefix ) && name.ends_with( ".results" ) && std::sscanf( name.c_str() + prefix.size(), "%u-of-%u.result%c", &part, &parts, &end ) == 3 && end == 's' )
+			found[ parts ][ part ] = entry.path();
+	}
+	if ( found.empty() ) {
+		Log_Error( "No results of a verification in parts found next to `{}`.", indexPath.string() );
+		return 1;
+	}
+	if ( found.size() > 1 ) {
+		Log_Error( "Results of verifications split in {} and {} parts were found, remove the stale ones.", found.begin()->first, found.rbegin()->first );
+		return 1;
+	}
+
+	const auto& [ parts, files ]{ *found.begin() };
+	const auto indexSize{ std::filesystem::file_size( indexPath, err ) };
+	const auto indexTime{ std::filesystem::last_write_time( indexPath, err ).time_since_epoch().count() };
+	int result{ 0 };
+	unsigned entries{ 0 };
+	unsigned errors{ 0 };
+	for ( unsigned part = 1; part <= parts; part++ ) {
+		const auto file{ files.find( part ) };
+		VerifyCheckpoint results{};
+		int status{ 0 };
+		if ( file == files.end() || !readVerifyResults( file->second, results, status ) ) {
+			Log_Error( "The results of part {} of {} are missing, it didn't finish.", part, parts );
+			result = std::max( result, 1 );
+			continue;
+		}
+		if ( results.indexSize != indexSize || results.indexTime != indexTime ) {
+			Log_Error( "Part {} of {} was verified against another version of the index.", part, parts );
+			result = std::max( result, 1 );
+			continue;
+		}
+		for ( const auto& report : results.reports )
+			Log_Report( report.file, report.message, report.got, report.expected );
+		entries += results.entries;
+		errors += results.errors;
+		result = std::max( result, status );
+	}
+
+	Log_Info( "Merged {} parts: verified {} files with {} errors!", parts, entries, errors );
+	return result;
+}
+
+auto watch( std::string_view root_, std::string_view indexLocation, const VerifyOptions& options ) -> int {
+	const std::filesystem::path root{ root_ };
+	const std::filesystem::path indexPath{ root / indexLocation };
+
+	if (! std::filesystem::exists( indexPath ) ) {
+		Log_Error( "Index file `{}` does not exist.", indexPath.string() );
+		return 1;
+	}
+
+	// the index is loaded once, rows are looked up by the file on disk holding their data
+	std::vector<IndexRow> rows;
+	std::vector<IndexShard> shards;
+	if ( readIndexManifest( indexPath, shards ) ) {
+		for ( const auto& shard : shards ) {
+			if (! loadIndexRows( indexPath.parent_path() / shard.file, rows ) )
+				return 1;
+		}
+		// depot shards list the files shipped by several depots more than once
+		std::sort( rows.begin(), rows.end(), []( const IndexRow& a, const IndexRow& b ) {
+			return std::tie( a.archive, a.path ) < std::tie( b.archive, b.path );
+		} );
+		rows.erase( std::unique( rows.begin(), rows.end(), []( const IndexRow& a, const IndexRow& b ) {
+			return a.archive == b.archive && a.path == b.path;
+		} ), rows.end() );
+	} else if (! loadIndexRows( indexPath, rows ) ) {
+		return 1;
+	}
+
+	// the whole-file digests of VPK files are only a shortcut, it's their entries that get verified when they change
+	std::unordered_set<std::string> archives;
+	for ( const auto& row : rows ) {
+		if ( row.archive != "." )
+			archives.insert( row.archive );
+	}
+
+	std::unordered_map<std::string, std::vector<std::size_t>> rowsByFile;
+	std::string vpkRel;
+	std::uint32_t archiveIndex{ 0 };
+	for ( std::size_t i = 0; i < rows.size(); i++ ) {
+		if ( rows[ i ].archive == "." && findChunkOwner( archives, rows[ i ].path, vpkRel, archiveIndex ) )
+			continue;
+		rowsByFile[ rows[ i ].archive == "." ? rows[ i ].path : rows[ i ].archive ].push_back( i );
+	}
+
+	FileWatcher watcher{ root };
+	if (! watcher.good() ) {
+		return 1;
+	}
+
+	TrustCache trustCache{};
+	const auto trustCachePath{ getTrustCachePath( indexPath, options ) };
+	if ( options.useTrustCache ) {
+		trustCache.load( trustCachePath );
+	}
+	ArchiveCache loadedVPKs{ options.memoryLimit / 2 };
+	VerifyBuffers buffers{ root, options };
+
+	installInterruptHandler();
+	installVerifyRequestHandler();
+	Log_Info( "Watching `{}` for changes to {} entries, send SIGUSR1 to verify the changed ones.", root.string(), rows.size() );
+
+	std::unordered_set<std::string> changed;
+	std::unordered_set<std::string> removed;
+	while (! wasInterrupted() ) {
+		if (! watcher.poll( std::chrono::milliseconds{ 500 }, changed, removed ) ) {
+			Log_Warn( "Lost track of some changes, everything will be verified." );
+			for ( const auto& [ file, indices ] : rowsByFile )
+				changed.insert( file );
+		}
+		// a directory moved away only tells about itself, not the files it took along
+		for ( const auto& directory : removed ) {
+			const auto prefix{ directory + '/' };
+			for ( const auto& [ file, indices ] : rowsByFile )
+				if ( file.starts_with( prefix ) )
+					changed.insert( file );
+		}
+		removed.clear();
+		if (! takeVerifyRequest() ) {
+			continue;
+		}
+
+		verifyChanged( root, rows, rowsByFile, changed, options, trustCache, loadedVPKs, buffers );
+		changed.clear();
+		if ( options.useTrustCache )
+			trustCache.save( trustCachePath );
+	}
+
+	if ( options.useTrustCache )
+		trustCache.save( trustCachePath );
+	Log_Info( "Stopped watching `{}`.", root.string() );
+	return 0;
+}
+
+static auto verifyIndex( const std::filesystem::path& root, const std::filesystem::path& indexPath, const VerifyOptions& options, VerifyCheckpoint& progress, const RowFilter& filter ) -> int {
 	Log_Info( "Using index file at `{}`", indexPath.string() );
+	TraceSpan span{ "verify index", indexPath.string() };
 
 	// open index file, if the file didn't exist, we wouldn't be here
-	std::ifstream indexStream{ indexPath, std::ios::in };
-	if (! indexStream.good() ) {
+	IndexReader reader{ indexPath };
+	if (! reader.good() ) {
 		Log_Error( "Failed to open index file for reading: N/D" );
 		return 1;
 	}
 
 	// working variables for the checking step
-	unsigned entries{ 0 };
-	unsigned errors{ 0 };
+	progress.indexSize = std::filesystem::file_size( indexPath );
+	progress.indexTime = std::filesystem::last_write_time( indexPath ).time_since_epoch().count();
+	// parts verified by several processes at once can't share them
+	const auto checkpointPath{ getCheckpointPath( indexPath, "verify" + getPartSuffix( options ) ) };
 	auto start{ std::chrono::high_resolution_clock::now() };
 
+	if ( options.resume ) {
+		VerifyCheckpoint saved{};
+		if (! readVerifyCheckpoint( checkpointPath, saved ) ) {
+			Log_Warn( "No usable checkpoint found at `{}`, starting from the beginning.", checkpointPath.string() );
+		} else if ( saved.indexSize != progress.indexSize || saved.indexTime != progress.indexTime ) {
+			Log_Warn( "Index file changed since the checkpoint was saved, starting from the beginning." );
+		} else {
+			progress = std::move( saved );
+			reader.seek( progress.indexOffset, progress.indexLastPath );
+			// replay what was found before the interruption, so that the report is complete
+			for ( const auto& previous : progress.reports )
+				Log_Report( previous.file, previous.message, previous.got, previous.expected );
+			Log_Info( "Resuming verification after {} entries ({} errors so far)", progress.entries, progress.errors );
+		}
+	}
+	TrustCache trustCache{};
+	const auto trustCachePath{ getTrustCachePath( indexPath, options ) };
+	if ( options.useTrustCache ) {
+		trustCache.load( trustCachePath );
+	}
+	ArchiveCache loadedVPKs{ options.memoryLimit / 2 };
+	DeviceQueues queues{ options.ioThreads };
+	std::vector<std::unique_ptr<VerifyWorker>> workers;
+
+	installInterruptHandler();
+
+	// VPK files which still match as a whole are read sequentially once, instead of entry by entry
+	ChunkDigests digests{};
+	if (! checkChunks( root, indexPath, trustCache, queues, workers, options, filter, digests ) ) {
+		Log_Error( "Nothing was verified, create the index again." );
+		return 1;
+	}
+	auto lastCheckpoint{ std::chrono::high_resolution_clock::now() };
+
+	// rows are read in batches which are verified out of order, so checkpoints always point at the start of one, the
+	// next batch is read and handed to the devices while they're done with the last one
+	std::vector<IndexRow> batch( PHYSICAL_ORDER_BATCH * DEVICE_BATCHES );
+	std::vector<std::size_t> batchOrder;
+	// where the batch in each slot starts in the index, and whether it's still to be collected
+	std::array<std::uint64_t, DEVICE_BATCHES> batchOffsets{};
+	std::array<std::string, DEVICE_BATCHES> batchLastPaths;
+	std::array<bool, DEVICE_BATCHES> inFlight{};
+	std::string key;
+	std::string location;
+	const auto rootPath{ root.string() };
+	// a row only costs its number in the queues, none of this is built again per row
+	const std::function<void( std::size_t, std::size_t )> verifyRow{ [ & ]( std::size_t i, std::size_t worker ) {
+		if ( wasInterrupted() )
+			return;
+		auto& state{ *workers[ worker ] };
+		auto& done{ state.batches[ i / PHYSICAL_ORDER_BATCH ] };
+		if ( isCoveredByChunks( digests, root, batch[ i ], loadedVPKs ) ) {
+			Log_Verbose( "Processed entry `{}/{}` with its VPK file", batch[ i ].archive, batch[ i ].path );
+			done.entries += 1;
+			return;
+		}
+		verifyEntry( root, batch[ i ], state.options, trustCache, loadedVPKs, state.buffers, done );
+	} };
+	const auto collect{ [ & ]( std::size_t slot ) {
+		for ( auto& worker : workers ) {
+			auto& done{ worker->batches[ slot ] };
+			progress.entries += done.entries;
+			progress.errors += done.errors;
+			std::move( done.reports.begin(), done.reports.end(), std::back_inserter( progress.reports ) );
+			done.entries = 0;
+			done.errors = 0;
+			done.reports.clear();
+		}
+		inFlight[ slot ] = false;
+	} };
+	// a checkpoint points at the oldest batch not collected yet, or past the last one
+	const auto saveCheckpoint{ [ & ]( std::size_t slot ) {
+		const auto oldest{ inFlight[ ( slot + 1 ) % DEVICE_BATCHES ] ? ( slot + 1 ) % DEVICE_BATCHES : slot };
+		if ( inFlight[ oldest ] ) {
+			progress.indexOffset = batchOffsets[ oldest ];
+			progress.indexLastPath = batchLastPaths[ oldest ];
+		} else {
+			progress.indexOffset = reader.tell();
+			progress.indexLastPath = reader.lastPath();
+		}
+		writeVerifyCheckpoint( checkpointPath, progress );
+	} };
+
 	// read and verify
-	std::stringbuf line{};
-	std::FILE* file{ nullptr };
-	while (! indexStream.eof() ) {
-		line.pubseekpos( 0 );
+	std::size_t slot{ 0 };
+	for ( ;; slot = ( slot + 1 ) % DEVICE_BATCHES ) {
+		if ( std::chrono::high_resolution_clock::now() - lastCheckpoint >= CHECKPOINT_INTERVAL ) {
+			saveCheckpoint( slot );
+			lastCheckpoint = std::chrono::high_resolution_clock::now();
+		}
+
 		// read row data
-		indexStream.get( line, '\xFD' );
-		indexStream.get(); // value end separator
-		if ( line.in_avail() == 0 )
+		const auto first{ slot * PHYSICAL_ORDER_BATCH };
+		batchOffsets[ slot ] = reader.tell();
+		batchLastPaths[ slot ] = reader.lastPath();
+		std::size_t count{ 0 };
+		{
+			TraceSpan readSpan{ "read index" };
+			while ( count < PHYSICAL_ORDER_BATCH && reader.next( batch[ first + count ] ) )
+				count += 1;
+		}
+		if ( count == 0 )
 			break;
 
-		const auto split{ splitString( line.str(), "\xFF" ) };
-		// deserialize row
-		const auto& archive{ split[ 0 ] };
-		const auto& pathRel{ split[ 1 ] };
-		const auto expectedSize{ std::stoull( split[ 2 ] ) };
-		const auto& expectedSha1{ split[ 3 ] };
-		const auto& expectedCrc32{ split[ 4 ] };
+		batchOrder.resize( count );
+		std::iota( batchOrder.begin(), batchOrder.end(), first );
+		if ( options.physicalOrder ) {
+			TraceSpan sortSpan{ "sort by physical location" };
+			sortByPhysicalLocation( root, loadedVPKs, batch, batchOrder );
+		}
+
+		// every device reads its own rows, in the order they were sorted in
+		for ( const auto i : batchOrder ) {
+			const auto& row{ batch[ i ] };
+			if ( row.archive == "." && digests.chunks.contains( row.path ) )
+				continue;
+			if ( filter.excludes( row, key ) )
+				continue;
+			location.assign( rootPath ).append( 1, '/' ).append( row.archive == "." ? row.path : row.archive );
+			queues.push( location, i );
+		}
+		// workers of a new device can't be added while the others are looking them up
+		if ( workers.size() < queues.workerCount() ) {
+			queues.wait();
+			addWorkers( root, options, queues, workers );
+		}
+		inFlight[ slot ] = true;
+		{
+			TraceSpan batchSpan{ "verify batch" };
+			queues.start( verifyRow );
+		}
+
+		// the batch before is done, unless it was cut short
+		if ( wasInterrupted() )
+			break;
+		const auto previous{ ( slot + 1 ) % DEVICE_BATCHES };
+		if ( inFlight[ previous ] )
+			collect( previous );
+	}
+	queues.wait();
+
+	if ( wasInterrupted() ) {
+		// whatever was verified in the batches in flight is done again when resuming
+		saveCheckpoint( slot );
+		if ( options.useTrustCache )
+			trustCache.save( trustCachePath );
+		Log_Warn( "Interrupted after {} entries, run again with `--resume` to continue.", progress.entries );
+		return 1;
+	}
+	for ( std::size_t i = 0; i < DEVICE_BATCHES; i++ )
+		if ( inFlight[ i ] )
+			collect( i );
+
+	// nothing verified against a damaged index is trusted, nor resumed from
+	removeCheckpoint( checkpointPath );
+	if (! reader.isIntact() ) {
+		Log_Error( "The rows verified may not be the ones the index was created with, create it again." );
+		return 1;
+	}
+	if ( options.useTrustCache )
+		trustCache.save( trustCachePath );
+
+	auto end{ std::chrono::high_resolution_clock::now() };
+	Log_Info( "Verified {} files in {} with {} errors!", progress.entries, std::chrono::duration_cast<std::chrono::seconds>( end - start ), progress.errors );
+
+	return 0;
+}
+
+static auto verifyFleet( const std::vector<std::filesystem::path>& indexPaths, const VerifyOptions& options ) -> int {
+	auto start{ std::chrono::high_resolution_clock::now() };
+
+	std::vector<FleetRoot> roots;
+	for ( const auto& path : options.roots ) {
+		if (! std::filesystem::is_directory( path ) ) {
+			Log_Error( "Root `{}` is not a directory.", path );
+			return 1;
+		}
+		roots.push_back( { path, std::filesystem::path{ path }.string(), {} } );
+	}
+	Log_Info( "Verifying {} roots against a shared index", roots.size() );
+
+	// trust caches belong to a single root, here the files shared by several roots are what's only read once
+	auto uncached{ options };
+	uncached.useTrustCache = false;
+	TrustCache trustCache{};
+	ArchiveCache loadedVPKs{ options.memoryLimit / 2 };
+	FleetFiles files{};
+	DeviceQueues queues{ options.ioThreads };
+	std::vector<std::unique_ptr<FleetWorker>> workers;
+
+	installInterruptHandler();
+
+	std::vector<IndexRow> batch( PHYSICAL_ORDER_BATCH );
+	std::string vpkRel;
+	std::uint32_t archiveIndex{ 0 };
+	for ( const auto& indexPath : indexPaths ) {
+		Log_Info( "Using index file at `{}`", indexPath.string() );
+		TraceSpan span{ "verify index", indexPath.string() };
+		IndexReader reader{ indexPath };
+		if (! reader.good() ) {
+			Log_Error( "Failed to open index file for reading: `{}`", indexPath.string() );
+			return 1;
+		}
+		// the whole-file digests of VPK files aren't files of their own, their entries are verified instead
+		const auto archives{ findArchives( indexPath ) };
+		if (! findDirectoryRows( indexPath, archives, files.directoryRows ) )
+			return 1;
+
+		while (! wasInterrupted() ) {
+			std::size_t count{ 0 };
+			{
+				TraceSpan readSpan{ "read index" };
+				while ( count < batch.size() && reader.next( batch[ count ] ) )
+					count += 1;
+			}
+			if ( count == 0 )
+				break;
+
+			// every row is verified for all of the roots by the same task, so that their copies of it are recognized
+			for ( std::size_t i = 0; i < count; i++ ) {
+				const auto& row{ batch[ i ] };
+				if ( row.archive == "." && findChunkOwner( archives, row.path, vpkRel, archiveIndex ) )
+					continue;
+				queues.push( roots[ 0 ].path / ( row.archive == "." ? row.path : row.archive ), [ &, i ]( std::size_t worker ) {
+					if (! wasInterrupted() )
+						verifyFleetRow( roots, batch[ i ], files, trustCache, loadedVPKs, *workers[ worker ] );
+				} );
+			}
+			while ( workers.size() < queues.workerCount() ) {
+				auto workerOptions{ uncached };
+				workerOptions.memoryLimit /= queues.workerCount();
+				workers.push_back( std::make_unique<FleetWorker>( workerOptions, roots.size() ) );
+			}
+			{
+				TraceSpan batchSpan{ "verify batch" };
+				queues.run();
+			}
+
+			for ( auto& worker : workers ) {
+				for ( std::size_t r = 0; r < roots.size(); r++ ) {
+					roots[ r ].progress.entries += worker->progress[ r ].entries;
+					roots[ r ].progress.errors += worker->progress[ r ].errors;
+					worker->progress[ r ] = {};
+				}
+			}
+		}
+		if (! reader.isIntact() ) {
+			Log_Error( "The rows verified may not be the ones the index was created with, create it again." );
+			return 1;
+		}
+	}
+	if ( wasInterrupted() ) {
+		Log_Warn( "Interrupted, verifying several roots can't be resumed." );
+		return 1;
+	}
+
+	unsigned entries{ 0 };
+	unsigned errors{ 0 };
+	for ( const auto& root : roots ) {
+		Log_Info( "Verified {} files in `{}` with {} errors", root.progress.entries, root.name, root.progress.errors );
+		entries += root.progress.entries;
+		errors += root.progress.errors;
+	}
+
+	auto end{ std::chrono::high_resolution_clock::now() };
+	Log_Info( "Verified {} files in {} roots in {} with {} errors!", entries, roots.size(), std::chrono::duration_cast<std::chrono::seconds>( end - start ), errors );
+	return 0;
+}
+
+static auto verifyFleetRow( const std::vector<FleetRoot>& roots, const IndexRow& row, FleetFiles& files, TrustCache& trustCache, ArchiveCache& loadedVPKs, FleetWorker& worker ) -> void {
+	// what was found for each distinct copy, the first root holding it is the one it was verified in
+	std::vector<std::pair<FleetKey, VerifyCheckpoint>> copies;
+	copies.reserve( roots.size() );
+	t_bCollectReports = true;
+	for ( std::size_t r = 0; r < roots.size(); r++ ) {
+		FleetKey key{};
+		const bool known{ getFleetKey( roots[ r ], row, files, trustCache, loadedVPKs, worker, key ) };
+		auto copy{ std::find_if( copies.begin(), copies.end(), [ &key ]( const auto& copy ) { return copy.first == key; } ) };
+		VerifyCheckpoint verified{};
+		if ( !known || copy == copies.end() ) {
+			worker.buffers.root = roots[ r ].name;
+			verifyEntry( roots[ r ].path, row, worker.options, trustCache, loadedVPKs, worker.buffers, verified );
+			if ( known )
+				copy = copies.insert( copies.end(), { key, std::move( verified ) } );
+		} else {
+			Log_Verbose( "Processed entry `{}` as a copy of an already verified one", row.path );
+		}
+
+		const auto& result{ known ? copy->second : verified };
+		auto& progress{ worker.progress[ r ] };
+		progress.entries += result.entries;
+		progress.errors += result.errors;
+		for ( const auto& found : result.reports )
+			Log_Report( fmt::format( "{}/{}", roots[ r ].name, found.file ), found.message, found.got, found.expected );
+	}
+	t_bCollectReports = false;
+}
+
+static auto getFleetKey( const FleetRoot& root, const IndexRow& row, FleetFiles& files, TrustCache& trustCache, ArchiveCache& loadedVPKs, FleetWorker& worker, FleetKey& key ) -> bool {
+	if ( row.archive == "." ) {
+		FileIdentity identity{};
+		if (! getFileIdentity( root.path / row.path, identity ) )
+			return false;
+		key = { identity.device, identity.inode, 0, 0 };
+		return true;
+	}
+
+	const auto vpkPath{ ( root.path / row.archive ).string() };
+	FileIdentity directory{};
+	if (! files.getIdentity( vpkPath, directory ) )
+		return false;
+	key = { directory.device, directory.inode, 0, 0 };
+
+	// the entry is found in the tree of whichever root had this directory first, and read from the file it says
+	worker.buffers.root = root.name;
+	const auto canonical{ files.getCanonical( directory, vpkPath, row.archive, trustCache, worker ) };
+	loadedVPKs.link( vpkPath, canonical );
+	const auto vpk{ loadedVPKs.open( canonical ) };
+	const auto entry{ vpk ? vpk->findEntry( row.path ) : std::nullopt };
+	if ( !entry || entry->archiveIndex == vpkpp::VPK::VPK_DIR_INDEX ) {
+		key.chunkDevice = directory.device;
+		key.chunkInode = directory.inode;
+		return true;
+	}
+	FileIdentity chunk{};
+	if (! files.getIdentity( getArchiveChunkPath( vpkPath, entry->archiveIndex ).string(), chunk ) )
+		return false;
+	key.chunkDevice = chunk.device;
+	key.chunkInode = chunk.inode;
+	return true;
+}
+
+static auto findArchives( const std::filesystem::path& indexPath ) -> std::unordered_set<std::string> {
+	std::unordered_set<std::string> archives;
+	IndexReader reader{ indexPath };
+	if ( reader.isCompact() ) {
+		archives.insert( reader.getArchives().begin(), reader.getArchives().end() );
+	} else {
+		std::string lastArchive;
+		for ( IndexRowView row{}; reader.next( row ); ) {
+			if ( row.archive != lastArchive ) {
+				lastArchive.assign( row.archive );
+				archives.insert( lastArchive );
+			}
+		}
+	}
+	archives.erase( "." );
+	return archives;
+}
+
+static auto findDirectoryRows( const std::filesystem::path& indexPath, const std::unordered_set<std::string>& archives, std::unordered_map<std::string, IndexRow>& rows ) -> bool {
+	IndexReader reader{ indexPath };
+	for ( IndexRowView row{}; reader.next( row ); )
+		if ( row.archive == "." && archives.contains( std::string{ row.path } ) )
+			rows.insert_or_assign( std::string{ row.path }, IndexRow{ ".", std::string{ row.path }, row.size, std::string{ row.sha1 }, std::string{ row.crc32 }, {} } );
+	return reader.isIntact();
+}
+
+static auto verifyPaths( const std::filesystem::path& root, const std::vector<std::filesystem::path>& indexPaths, const VerifyOptions& options ) -> int {
+	TraceSpan span{ "verify paths" };
+	auto start{ std::chrono::high_resolution_clock::now() };
+
+	std::vector<IndexRow> rows;
+	for ( const auto& indexPath : indexPaths ) {
+		if (! std::filesystem::exists( indexPath ) ) {
+			Log_Error( "Index file `{}` does not exist.", indexPath.string() );
+			return 1;
+		}
+		if (! findPathRows( indexPath, options.paths, rows ) )
+			return 1;
+	}
+	// a row may match several globs, and depot shards list the files shipped by several depots more than once
+	std::sort( rows.begin(), rows.end(), []( const IndexRow& a, const IndexRow& b ) {
+		return std::tie( a.archive, a.path ) < std::tie( b.archive, b.path );
+	} );
+	rows.erase( std::unique( rows.begin(), rows.end(), []( const IndexRow& a, const IndexRow& b ) {
+		return a.archive == b.archive && a.path == b.path;
+	} ), rows.end() );
+
+	if ( rows.empty() ) {
+		Log_Warn( "No indexed file matches the given paths." );
+		return 0;
+	}
+	Log_Info( "Verifying {} files matching the given paths", rows.size() );
+
+	// files asked for by name are read again, even if the trust cache would vouch for them
+	auto uncached{ options };
+	uncached.useTrustCache = false;
+	TrustCache trustCache{};
+	ArchiveCache loadedVPKs{ options.memoryLimit / 2 };
+	VerifyBuffers buffers{ root, options };
+	VerifyCheckpoint progress{};
+	for ( const auto& row : rows )
+		verifyEntry( root, row, uncached, trustCache, loadedVPKs, buffers, progress );
+
+	auto end{ std::chrono::high_resolution_clock::now() };
+	Log_Info( "Verified {} files in {} with {} errors!", progress.entries, std::chrono::duration_cast<std::chrono::milliseconds>( end - start ), progress.errors );
+	if ( options.repairFrom.empty() || progress.reports.empty() )
+		return 0;
+	return repairReported( root, indexPaths, progress.reports, options );
+}
+
+static auto verifyCritical( const std::filesystem::path& root, const std::vector<std::filesystem::path>& indexPaths, const VerifyOptions& options, VerifyCheckpoint& progress, std::unordered_set<std::string>& verified ) -> bool {
+	TraceSpan span{ "verify critical" };
+	auto start{ std::chrono::high_resolution_clock::now() };
+
+	std::vector<std::string> globs;
+	if (! readCriticalGlobs( options.critical, globs ) ) {
+		Log_Status( "critical-failed", "The list of critical files couldn't be read." );
+		return false;
+	}
+
+	// same as the rest, in parallel and trusting unchanged files, just sooner
+	ArchiveCache loadedVPKs{ options.memoryLimit / 2 };
+	DeviceQueues queues{ options.ioThreads };
+	std::vector<std::unique_ptr<VerifyWorker>> workers;
+	for ( const auto& indexPath : indexPaths ) {
+		std::vector<IndexRow> rows;
+		if (! findPathRows( indexPath, globs, rows ) ) {
+			Log_Status( "critical-failed", "The index the critical files are listed in is damaged." );
+			return false;
+		}
+		TrustCache trustCache{};
+		const auto trustCachePath{ getTrustCachePath( indexPath, options ) };
+		if ( options.useTrustCache )
+			trustCache.load( trustCachePath );
+
+		for ( const auto& row : rows ) {
+			// depot shards list the files shipped by several depots more than once
+			if (! verified.insert( row.archive + '/' + row.path ).second )
+				continue;
+			queues.push( root / ( row.archive == "." ? row.path : row.archive ), [ & ]( std::size_t worker ) {
+				auto& state{ *workers[ worker ] };
+				verifyEntry( root, row, state.options, trustCache, loadedVPKs, state.buffers, state.progress );
+			} );
+		}
+		addWorkers( root, options, queues, workers );
+		queues.run();
+		if ( options.useTrustCache )
+			trustCache.save( trustCachePath );
+	}
+	for ( auto& worker : workers ) {
+		progress.entries += worker->progress.entries;
+		progress.errors += worker->progress.errors;
+		std::move( worker->progress.reports.begin(), worker->progress.reports.end(), std::back_inserter( progress.reports ) );
+	}
+
+	auto end{ std::chrono::high_resolution_clock::now() };
+	if ( progress.entries == 0 )
+		Log_Warn( "No indexed file matches the critical paths." );
+	const auto message{ fmt::format( "Verified {} critical files in {} with {} errors, verifying the rest.", progress.entries, std::chrono::duration_cast<std::chrono::milliseconds>( end - start ), progress.errors ) };
+	Log_Status( progress.errors == 0 ? "critical-passed" : "critical-failed", message );
+	return progress.errors == 0;
+}
+
+static auto partitionRows( const std::vector<std::filesystem::path>& indexPaths, const VerifyOptions& options, RowFilter& filter ) -> bool {
+	TraceSpan span{ "partition rows" };
+
+	// every VPK goes in a single part with all of its files, the rest are split file by file
+	std::unordered_map<std::string, std::uint64_t> weights;
+	std::unordered_set<std::string> archives;
+	for ( const auto& indexPath : indexPaths ) {
+		IndexReader reader{ indexPath };
+		std::string lastArchive;
+		for ( IndexRowView row{}; reader.next( row ); ) {
+			if ( row.archive == "." ) {
+				weights[ std::string{ row.path } ] += row.size + PART_FILE_COST;
+				continue;
+			}
+			if ( row.archive != lastArchive ) {
+				lastArchive.assign( row.archive );
+				archives.insert( lastArchive );
+			}
+			weights[ lastArchive ] += row.size + PART_FILE_COST;
+		}
+		if (! reader.isIntact() )
+			return false;
+	}
+	// the files of a VPK which have whole-file digests are checked with its entries
+	std::vector<std::pair<std::string, std::string>> owned;
+	std::string vpkRel;
+	std::uint32_t archiveIndex{ 0 };
+	for ( const auto& [ unit, weight ] : weights )
+		if ( !archives.contains( unit ) && findChunkOwner( archives, unit, vpkRel, archiveIndex ) )
+			owned.emplace_back( unit, vpkRel );
+	for ( const auto& [ path, owner ] : owned ) {
+		weights[ owner ] += weights[ path ];
+		weights.erase( path );
+	}
+
+	// heaviest first, each to the lightest part so far, ties broken by name and number so every process agrees
+	std::vector<std::pair<std::string, std::uint64_t>> units( weights.begin(), weights.end() );
+	std::sort( units.begin(), units.end(), []( const auto& a, const auto& b ) {
+		return a.second != b.second ? a.second > b.second : a.first < b.first;
+	} );
+	std::vector<std::uint64_t> loads( options.parts, 0 );
+	std::uint64_t total{ 0 };
+	for ( auto& [ unit, weight ] : units ) {
+		const auto part{ static_cast<unsigned>( std::min_element( loads.begin(), loads.end() ) - loads.begin() ) };
+		loads[ part ] += weight;
+		total += weight;
+		if ( part + 1 == options.part )
+			filter.units.insert( std::move( unit ) );
+	}
+	const auto count{ filter.units.size() };
+	for ( auto& [ path, owner ] : owned )
+		if ( filter.units.contains( owner ) )
+			filter.units.insert( std::move( path ) );
+	filter.partitioned = true;
+
+	Log_Info( "Verifying part {} of {}: {} of {} files and VPKs, {} of {} MB", options.part, options.parts, count, units.size(), loads[ options.part - 1 ] / 1024 / 1024, total / 1024 / 1024 );
+	return true;
+}
+
+static auto getPartSuffix( const VerifyOptions& options ) -> std::string {
+	return options.parts == 0 ? std::string{} : fmt::format( ".part-{}-of-{}", options.part, options.parts );
+}
+
+static auto getTrustCachePath( const std::filesystem::path& indexPath, const VerifyOptions& options ) -> std::filesystem::path {
+	return std::filesystem::path{ indexPath }.concat( getPartSuffix( options ) + ".trust" );
+}
 
-		// verify it
-		const bool insideArchive{ archive != "." };
-		std::filesystem::path path{ insideArchive ? root / archive : root / pathRel };
+static auto savePartResults( const std::filesystem::path& indexPath, const VerifyOptions& options, const VerifyCheckpoint& total, int result ) -> int {
+	if ( options.parts == 0 )
+		return result;
 
-		if (! std::filesystem::exists( path ) ) {
-			Log_Report( pathRel, "Entry doesn't exist on disk.", "nul", "nul" );
-			errors += 1;
+	auto results{ total };
+	std::error_code err;
+	results.indexSize = std::filesystem::file_size( indexPath, err );
+	results.indexTime = std::filesystem::last_write_time( indexPath, err ).time_since_epoch().count();
+	const auto path{ std::filesystem::path{ indexPath }.concat( getPartSuffix( options ) + ".results" ) };
+	if (! writeVerifyResults( path, results, result ) )
+		return 1;
+	Log_Info( "Saved the results of part {} of {} to `{}`, combine them with `--merge-results` once all parts are done", options.part, options.parts, path.string() );
+	return result;
+}
+
+static auto readCriticalGlobs( const std::vector<std::string>& critical, std::vector<std::string>& globs ) -> bool {
+	for ( const auto& glob : critical ) {
+		if (! glob.starts_with( '@' ) ) {
+			globs.push_back( glob );
 			continue;
 		}
+		std::ifstream reader{ glob.substr( 1 ) };
+		if (! reader.good() ) {
+			Log_Error( "Failed to open list of critical files `{}`", glob.substr( 1 ) );
+			return false;
+		}
+		for ( std::string line; std::getline( reader, line ); ) {
+			if ( line.ends_with( '\r' ) )
+				line.pop_back();
+			// blank lines and comments
+			if ( line.empty() || line.starts_with( '#' ) )
+				continue;
+			globs.push_back( std::move( line ) );
+		}
+	}
+	return true;
+}
 
-		if ( insideArchive ) {
-			verifyArchivedFile( path.string(), archive, pathRel, expectedSize, expectedSha1, expectedCrc32, entries, errors );
+static auto repairReported( const std::filesystem::path& root, const std::vector<std::filesystem::path>& indexPaths, const std::vector<ReportRow>& reports, const VerifyOptions& options ) -> int {
+	TraceSpan span{ "repair" };
+	auto start{ std::chrono::high_resolution_clock::now() };
+	const std::filesystem::path reference{ options.repairFrom };
+
+	// reports name loose files by their path, and entries by the path of their VPK followed by theirs
+	std::vector<IndexRow> rows;
+	for ( const auto& indexPath : indexPaths ) {
+		const auto archives{ findArchives( indexPath ) };
+		std::set<std::pair<std::string, std::string>> keys;
+		for ( const auto& found : reports ) {
+			std::pair<std::string, std::string> key{ ".", found.file };
+			for ( const auto& archive : archives ) {
+				if ( found.file.size() > archive.size() && found.file.starts_with( archive ) && found.file[ archive.size() ] == '/' )
+					key = { archive, found.file.substr( archive.size() + 1 ) };
+			}
+			keys.insert( std::move( key ) );
+		}
+		if (! findRows( indexPath, keys, rows ) )
+			return 1;
+	}
+
+	// loose files are restored as a whole, entries with the file holding their data, and the directory of their VPK if
+	// it's that one which changed, it's small enough to compare
+	ArchiveCache referenceVPKs{ options.memoryLimit / 2 };
+	std::set<std::string> files;
+	std::set<std::string> directories;
+	for ( const auto& row : rows ) {
+		if ( row.archive == "." ) {
+			files.insert( row.path );
 			continue;
 		}
+		if ( directories.insert( row.archive ).second && !hasSameContents( reference / row.archive, root / row.archive ) )
+			files.insert( row.archive );
+		const auto vpk{ referenceVPKs.open( ( reference / row.archive ).string() ) };
+		const auto entry{ vpk ? vpk->findEntry( row.path ) : std::nullopt };
+		if ( entry && entry->archiveIndex != vpkpp::VPK::VPK_DIR_INDEX )
+			files.insert( getArchiveChunkPath( row.archive, entry->archiveIndex ).string() );
+	}
 
-		// open the file, but first close the old one if it is open
-		if ( file )
-			std::fclose( file );
-#ifndef _WIN32
-		file = std::fopen( path.string().c_str(), "rb" );
-#else
-		file = nullptr;
-		fopen_s( &file, path.string().c_str(), "rb" );
-#endif
-		if (! file ) {
-			Log_Error( "Failed to open file: `{}`", path.string() );
+	int result{ 0 };
+	unsigned restored{ 0 };
+	for ( const auto& file : files ) {
+		if (! std::filesystem::exists( reference / file ) ) {
+			Log_Error( "Can't repair `{}`, the reference install doesn't have it either.", file );
+			result = 1;
 			continue;
 		}
+		TraceSpan restoreSpan{ "restore", file };
+		if (! restoreFile( reference / file, root / file ) ) {
+			result = 1;
+			continue;
+		}
+		Log_Info( "Restored `{}` from `{}`", file, reference.string() );
+		restored += 1;
+	}
 
-		std::fseek( file, 0, SEEK_END );
+	// what was restored is only as good as the reference, nothing is trusted
+	auto uncached{ options };
+	uncached.useTrustCache = false;
+	TrustCache trustCache{};
+	ArchiveCache loadedVPKs{ options.memoryLimit / 2 };
+	VerifyBuffers buffers{ root, options };
+	VerifyCheckpoint progress{};
+	for ( const auto& row : rows )
+		verifyEntry( root, row, uncached, trustCache, loadedVPKs, buffers, progress );
 
-		auto length{ std::ftell( file ) };
-		if ( length != expectedSize ) {
-			Log_Report( pathRel, "Sizes don't match.", std::to_string( length ), std::to_string( expectedSize ) );
-			Log_Verbose( "Processed entry `{}`", pathRel );
-			entries += 1;
-			errors += 1;
+	auto end{ std::chrono::high_resolution_clock::now() };
+	Log_Info( "Restored {} files and verified {} repaired entries in {} with {} errors!", restored, progress.entries, std::chrono::duration_cast<std::chrono::milliseconds>( end - start ), progress.errors );
+	return progress.errors == 0 ? result : 1;
+}
+
+static auto findRows( const std::filesystem::path& indexPath, const std::set<std::pair<std::string, std::string>>& keys, std::vector<IndexRow>& rows ) -> bool {
+	const auto addRow{ [ &rows ]( const IndexRowView& row ) {
+		rows.push_back( { std::string{ row.archive }, std::string{ row.path }, row.size, std::string{ row.sha1 }, std::string{ row.crc32 }, std::string{ row.depots } } );
+	} };
+
+	IndexLookup lookup{ indexPath };
+	if (! lookup.good() ) {
+		IndexReader reader{ indexPath };
+		std::pair<std::string, std::string> key;
+		for ( IndexRowView row{}; reader.next( row ); ) {
+			key.first.assign( row.archive );
+			key.second.assign( row.path );
+			if ( keys.contains( key ) )
+				addRow( row );
+		}
+		return reader.isIntact();
+	}
+
+	for ( const auto& [ archive, path ] : keys ) {
+		lookup.find( archive, path, [ &, &path = path ]( const IndexRowView& row ) {
+			if ( row.path == path )
+				addRow( row );
+		} );
+	}
+	return true;
+}
+
+static auto findPathRows( const std::filesystem::path& indexPath, const std::vector<std::string>& globs, std::vector<IndexRow>& rows ) -> bool {
+	TraceSpan span{ "find paths", indexPath.string() };
+	const auto found{ rows.size() };
+	const auto addRow{ [ &rows ]( const IndexRowView& row ) {
+		rows.push_back( { std::string{ row.archive }, std::string{ row.path }, row.size, std::string{ row.sha1 }, std::string{ row.crc32 }, std::string{ row.depots } } );
+	} };
+
+	IndexLookup lookup{ indexPath };
+	std::unordered_set<std::string> archives;
+	if (! lookup.good() ) {
+		// plain indexes aren't sorted, there's nothing to search
+		Log_Warn( "Index file `{}` isn't compact, reading all of its rows to find the given paths.", indexPath.string() );
+		IndexReader reader{ indexPath };
+		std::string qualified;
+		for ( IndexRowView row{}; reader.next( row ); ) {
+			if ( row.archive != "." )
+				archives.emplace( row.archive );
+			qualified.assign( row.archive ).append( 1, '/' ).append( row.path );
+			for ( const auto& glob : globs ) {
+				if ( matchGlob( glob, row.path ) || ( row.archive != "." && matchGlob( glob, qualified ) ) ) {
+					addRow( row );
+					break;
+				}
+			}
+		}
+		if (! reader.isIntact() )
+			return false;
+	} else {
+		for ( const auto& archive : lookup.getArchives() ) {
+			if ( archive != "." )
+				archives.insert( archive );
+		}
+
+		std::string qualified;
+		for ( const std::string_view glob : globs ) {
+			// only the rows starting with what comes before the first wildcard can match
+			const auto prefix{ glob.substr( 0, glob.find_first_of( "*?" ) ) };
+			for ( const auto& archive : lookup.getArchives() ) {
+				// loose files and entries by their own path
+				lookup.find( archive, prefix, [ & ]( const IndexRowView& row ) {
+					if ( matchGlob( glob, row.path ) )
+						addRow( row );
+				} );
+				if ( archive == "." )
+					continue;
+
+				// entries by the path of their VPK followed by theirs, the wildcard may be in either
+				qualified.assign( archive ).append( 1, '/' );
+				if ( prefix.starts_with( qualified ) || qualified.starts_with( prefix ) ) {
+					const auto entryPrefix{ prefix.size() > qualified.size() ? prefix.substr( qualified.size() ) : std::string_view{} };
+					lookup.find( archive, entryPrefix, [ & ]( const IndexRowView& row ) {
+						qualified.resize( archive.size() + 1 );
+						qualified.append( row.path );
+						if ( matchGlob( glob, qualified ) )
+							addRow( row );
+					} );
+				}
+			}
+		}
+	}
+
+	// the whole-file digests of VPK files aren't files of their own
+	std::string vpkRel;
+	std::uint32_t archiveIndex{ 0 };
+	rows.erase( std::remove_if( rows.begin() + static_cast<std::ptrdiff_t>( found ), rows.end(), [ & ]( const IndexRow& row ) {
+		return row.archive == "." && findChunkOwner( archives, row.path, vpkRel, archiveIndex );
+	} ), rows.end() );
+	return true;
+}
+
+static auto matchGlob( std::string_view glob, std::string_view text ) -> bool {
+	// where to pick up again when what follows the last `*` stops matching
+	auto star{ std::string_view::npos };
+	std::size_t retry{ 0 };
+	std::size_t g{ 0 };
+	std::size_t t{ 0 };
+	while ( t < text.size() ) {
+		if ( g < glob.size() && ( glob[ g ] == '?' || glob[ g ] == text[ t ] ) ) {
+			g += 1;
+			t += 1;
+		} else if ( g < glob.size() && glob[ g ] == '*' ) {
+			star = g;
+			g += 1;
+			retry = t;
+		} else if ( star != std::string_view::npos ) {
+			g = star + 1;
+			retry += 1;
+			t = retry;
+		} else {
+			return false;
+		}
+	}
+	while ( g < glob.size() && glob[ g ] == '*' )
+		g += 1;
+	return g == glob.size();
+}
+
+static auto verifyChanged( const std::filesystem::path& root, const std::vector<IndexRow>& rows, const std::unordered_map<std::string, std::vector<std::size_t>>& rowsByFile, const std::unordered_set<std::string>& changed, const VerifyOptions& options, TrustCache& trustCache, ArchiveCache& loadedVPKs, VerifyBuffers& buffers ) -> void {
+	auto start{ std::chrono::high_resolution_clock::now() };
+	VerifyCheckpoint progress{};
+
+	std::string vpkRel;
+	std::uint32_t archiveIndex{ 0 };
+	for ( const auto& file : changed ) {
+		if ( const auto it{ rowsByFile.find( file ) }; it != rowsByFile.end() ) {
+			// the tree of a changed VPK has to be read again
+			loadedVPKs.close( ( root / file ).string() );
+			for ( const auto i : it->second )
+				verifyEntry( root, rows[ i ], options, trustCache, loadedVPKs, buffers, progress );
 			continue;
 		}
-		std::fseek( file, 0, 0 );
 
-		// sha1/crc32
-		CryptoPP::SHA1 sha1er{};
-		CryptoPP::CRC32 crc32er{};
+		// only the entries stored in a changed numbered VPK
+		if (! parseArchiveChunkPath( file, vpkRel, archiveIndex ) )
+			continue;
+		const auto it{ rowsByFile.find( vpkRel ) };
+		if ( it == rowsByFile.end() )
+			continue;
 
-		unsigned char buffer[ 2048 ];
-		while ( auto count = std::fread( buffer, 1, sizeof( buffer ), file ) ) {
-			sha1er.Update( buffer, count );
-			crc32er.Update( buffer, count );
+		// aliases of its entries would take the digests read before it changed
+		const auto vpkPath{ ( root / vpkRel ).string() };
+		loadedVPKs.forgetPayloads( vpkPath, archiveIndex );
+		const auto vpk{ loadedVPKs.open( vpkPath ) };
+		for ( const auto i : it->second ) {
+			const auto entry{ vpk ? vpk->findEntry( rows[ i ].path ) : std::nullopt };
+			if ( !entry || entry->archiveIndex == archiveIndex )
+				verifyEntry( root, rows[ i ], options, trustCache, loadedVPKs, buffers, progress );
 		}
+	}
+
+	auto end{ std::chrono::high_resolution_clock::now() };
+	Log_Info( "Verified {} changed files in {} with {} errors!", progress.entries, std::chrono::duration_cast<std::chrono::milliseconds>( end - start ), progress.errors );
+}
 
-		std::array<CryptoPP::byte, CryptoPP::SHA1::DIGESTSIZE> sha1Hash{};
-		sha1er.Final( sha1Hash.data() );
-		std::array<CryptoPP::byte, CryptoPP::CRC32::DIGESTSIZE> crc32Hash{};
-		crc32er.Final( crc32Hash.data() );
+static auto verifyEntry( const std::filesystem::path& root, const IndexRow& row, const VerifyOptions& options, TrustCache& trustCache, ArchiveCache& loadedVPKs, VerifyBuffers& buffers, VerifyCheckpoint& progress ) -> void {
+	if ( row.archive == "." ) {
+		verifyLooseFile( row, options, trustCache, buffers, progress );
+		return;
+	}
 
-		std::string sha1HashStr;
-		std::string crc32HashStr;
+	const auto path{ root / row.archive };
+	bool exists;
+	{
+		TraceSpan span{ "stat", row.archive };
+		FileIdentity identity{};
+		exists = getFileIdentity( path, identity ) || std::filesystem::exists( path );
+	}
+	if (! exists ) {
+		report( progress, row.archive + '/' + row.path, "Entry doesn't exist on disk.", "nul", "nul" );
+		return;
+	}
+	verifyArchivedFile( loadedVPKs, path.string(), row.archive, row.path, row.size, row.sha1, row.crc32, options, progress );
+}
+
+static auto verifyLooseFile( const IndexRow& row, const VerifyOptions& options, TrustCache& trustCache, VerifyBuffers& buffers, VerifyCheckpoint& progress ) -> void {
+	const auto& pathRel{ row.path };
+	buffers.path.assign( buffers.root ).append( 1, '/' ).append( pathRel );
+
+	// nothing to read, a stat is all it takes
+	if ( options.level < VerifyLevel::Crc ) {
+		FileIdentity identity{};
+		bool exists;
 		{
-			CryptoPP::StringSource sha1HashStrSink{ sha1Hash.data(), sha1Hash.size(), true, new CryptoPP::HexEncoder{ new CryptoPP::StringSink{ sha1HashStr } } };
-			CryptoPP::StringSource crc32HashStrSink{ crc32Hash.data(), crc32Hash.size(), true, new CryptoPP::HexEncoder{ new CryptoPP::StringSink{ crc32HashStr } } };
+			TraceSpan span{ "stat", pathRel };
+			exists = getFileIdentity( buffers.path, identity );
+		}
+		if (! exists ) {
+			report( progress, pathRel, "Entry doesn't exist on disk.", "nul", "nul" );
+			return;
+		}
+		if ( options.level != VerifyLevel::Exists && identity.size != row.size ) {
+			report( progress, pathRel, "Sizes don't match.", std::to_string( identity.size ), std::to_string( row.size ) );
+		}
+		Log_Verbose( "Processed entry `{}`", pathRel );
+		progress.entries += 1;
+		return;
+	}
+
+	FileIdentity identity{};
+	const int file{ openFile( buffers.path, identity ) };
+	if ( file == FILE_MISSING ) {
+		report( progress, pathRel, "Entry doesn't exist on disk.", "nul", "nul" );
+		return;
+	}
+	if ( file < 0 ) {
+		Log_Error( "Failed to open file: `{}`", buffers.path );
+		return;
+	}
+
+	// unchanged since it was last verified against this very digest, no need to read it again
+	if ( options.useTrustCache && trustCache.isTrusted( pathRel, identity, row.sha1, row.crc32 ) ) {
+		closeFile( file );
+		Log_Verbose( "Trusted file `{}`", pathRel );
+		progress.entries += 1;
+		return;
+	}
+	// another hard link to it was already read, and matched the same digests
+	if ( trustCache.isLinkVerified( identity, row.sha1, row.crc32 ) ) {
+		closeFile( file );
+		Log_Verbose( "File `{}` is a hard link to one already verified", pathRel );
+		progress.entries += 1;
+		return;
+	}
+
+	if ( identity.size != row.size ) {
+		closeFile( file );
+		trustCache.forget( pathRel );
+		report( progress, pathRel, "Sizes don't match.", std::to_string( identity.size ), std::to_string( row.size ) );
+		Log_Verbose( "Processed entry `{}`", pathRel );
+		progress.entries += 1;
+		return;
+	}
+
+	// sha1/crc32, or only crc32 when that's all we're asked for
+	const bool full{ options.level == VerifyLevel::Full };
+	std::array<CryptoPP::byte, CryptoPP::SHA1::DIGESTSIZE> sha1Hash{};
+	std::array<CryptoPP::byte, CryptoPP::CRC32::DIGESTSIZE> crc32Hash{};
+	const bool read{ hashFile( file, full, buffers, sha1Hash, crc32Hash ) };
+	closeFile( file );
+	if (! read ) {
+		trustCache.forget( pathRel );
+		Log_Error( "Failed to read file: `{}`", buffers.path );
+		return;
+	}
+
+	// only a file whose both digests matched can be trusted next time, a crc32 alone leaves it as it was
+	const bool sha1Matches{ !full || checkDigest( progress, pathRel, "Content sha1 doesn't match.", sha1Hash, row.sha1 ) };
+	const bool crc32Matches{ checkDigest( progress, pathRel, "Content crc32 doesn't match.", crc32Hash, row.crc32 ) };
+	if (! ( sha1Matches && crc32Matches ) ) {
+		trustCache.forget( pathRel );
+	} else {
+		trustCache.addVerifiedLink( identity, row.sha1, row.crc32 );
+		if ( options.useTrustCache && full )
+			trustCache.trust( pathRel, identity, row.sha1, row.crc32 );
+	}
+
+	Log_Verbose( "Processed file `{}`", pathRel );
+	progress.entries += 1;
+}
+
+static auto checkChunks( const std::filesystem::path& root, const std::filesystem::path& indexPath, TrustCache& trustCache, DeviceQueues& queues, std::vector<std::unique_ptr<VerifyWorker>>& workers, const VerifyOptions& options, const RowFilter& filter, ChunkDigests& digests ) -> bool {
+	TraceSpan span{ "check VPK files" };
+
+	// which VPKs had their entries indexed, and the loose rows which may be their files
+	std::unordered_set<std::string> archives;
+	std::vector<IndexRow> candidates;
+	{
+		IndexReader reader{ indexPath };
+		std::string lastArchive;
+		for ( IndexRowView row{}; reader.next( row ); ) {
+			if ( row.archive != "." ) {
+				// rows are grouped by archive, no need to look every one of them up
+				if ( row.archive != lastArchive ) {
+					lastArchive.assign( row.archive );
+					archives.insert( lastArchive );
+				}
+			} else if ( row.path.ends_with( ".vpk" ) ) {
+				candidates.push_back( { ".", std::string{ row.path }, row.size, std::string{ row.sha1 }, std::string{ row.crc32 }, {} } );
+			}
 		}
+		if (! reader.isIntact() )
+			return false;
+	}
 
-		if ( sha1HashStr != expectedSha1 ) {
-			Log_Report( pathRel, "Content sha1 doesn't match.", sha1HashStr, expectedSha1 );
-			errors += 1;
+	// the VPK each of them belongs to, and which of its files it is
+	std::vector<std::pair<std::string, std::uint32_t>> owners( candidates.size() );
+	// written by the workers, so not a vector<bool>
+	std::vector<char> matches( candidates.size(), 0 );
+	for ( std::size_t i = 0; i < candidates.size(); i++ ) {
+		const auto& path{ candidates[ i ].path };
+		auto& [ vpkRel, archiveIndex ]{ owners[ i ] };
+		if (! findChunkOwner( archives, path, vpkRel, archiveIndex ) ) {
+			// a VPK which was indexed as a regular file
+			vpkRel.clear();
+			continue;
 		}
 
-		if ( crc32HashStr != expectedCrc32 ) {
-			Log_Report( pathRel, "Content crc32 doesn't match.", crc32HashStr, expectedCrc32 );
-			errors += 1;
+		digests.chunks.insert( path );
+		// their entries are cheaper to check than reading them whole, or they're someone else's
+		if ( options.level < VerifyLevel::Crc || ( filter.partitioned && !filter.units.contains( vpkRel ) ) ) {
+			vpkRel.clear();
+			continue;
 		}
+		queues.push( root / path, [ &, i ]( std::size_t worker ) {
+			if ( wasInterrupted() )
+				return;
+			auto& state{ *workers[ worker ] };
+			matches[ i ] = checkChunk( candidates[ i ], state.options, trustCache, state.buffers );
+		} );
+	}
+	addWorkers( root, options, queues, workers );
+	queues.run();
+
+	unsigned checked{ 0 };
+	unsigned changed{ 0 };
+	for ( std::size_t i = 0; i < candidates.size(); i++ ) {
+		const auto& [ vpkRel, archiveIndex ]{ owners[ i ] };
+		if ( vpkRel.empty() )
+			continue;
+		checked += 1;
 
-		Log_Verbose( "Processed file `{}`", pathRel );
-		entries += 1;
+		auto& archive{ digests.archives[ vpkRel ] };
+		if ( archiveIndex == vpkpp::VPK::VPK_DIR_INDEX ) {
+			archive.directoryMatches = matches[ i ];
+		} else if ( matches[ i ] ) {
+			archive.matched.insert( archiveIndex );
+		}
+		if (! matches[ i ] ) {
+			Log_Verbose( "VPK file `{}` changed, its entries will be verified one by one", candidates[ i ].path );
+			changed += 1;
+		}
 	}
-	std::fclose( file );
+	if ( checked != 0 )
+		Log_Info( "Checked {} VPK files as a whole, {} of them changed", checked, changed );
+	return true;
+}
 
-	auto end{ std::chrono::high_resolution_clock::now() };
-	Log_Info( "Verified {} files in {} with {} errors!", entries, std::chrono::duration_cast<std::chrono::seconds>( end - start ), errors );
+static auto checkChunk( const IndexRow& row, const VerifyOptions& options, TrustCache& trustCache, VerifyBuffers& buffers ) -> bool {
+	TraceSpan span{ "check VPK file", row.path };
+	buffers.path.assign( buffers.root ).append( 1, '/' ).append( row.path );
 
-	return 0;
+	FileIdentity identity{};
+	const int file{ openFile( buffers.path, identity ) };
+	if ( file < 0 )
+		return false;
+
+	if ( options.useTrustCache && trustCache.isTrusted( row.path, identity, row.sha1, row.crc32 ) ) {
+		closeFile( file );
+		return true;
+	}
+
+	const bool full{ options.level == VerifyLevel::Full };
+	std::array<CryptoPP::byte, CryptoPP::SHA1::DIGESTSIZE> sha1Hash{};
+	std::array<CryptoPP::byte, CryptoPP::CRC32::DIGESTSIZE> crc32Hash{};
+	const bool matches{ identity.size == row.size && hashFile( file, full, buffers, sha1Hash, crc32Hash )
+		&& ( !full || matchesDigest( sha1Hash, row.sha1 ) ) && matchesDigest( crc32Hash, row.crc32 ) };
+	closeFile( file );
+
+	if (! matches ) {
+		trustCache.forget( row.path );
+	} else if ( options.useTrustCache && full ) {
+		trustCache.trust( row.path, identity, row.sha1, row.crc32 );
+	}
+	return matches;
 }
 
-static auto verifyArchivedFile( const std::string& archivePath, const std::string& archiveRel, const std::string& entryPath, std::uint64_t expectedSize, std::string_view expectedSha1, std::string_view expectedCrc32, unsigned int& entries, unsigned int& errors ) -> void {
-	using namespace vpkpp;
+static auto findChunkOwner( const std::unordered_set<std::string>& archives, const std::string& path, std::string& vpkRel, std::uint32_t& archiveIndex ) -> bool {
+	if ( archives.contains( path ) ) {
+		vpkRel = path;
+		archiveIndex = vpkpp::VPK::VPK_DIR_INDEX;
+		return true;
+	}
+	return parseArchiveChunkPath( path, vpkRel, archiveIndex ) && archives.contains( vpkRel );
+}
 
-	static std::unordered_map<std::string, std::unique_ptr<PackFile>> loadedVPKs{};
-	if (! loadedVPKs.contains( archivePath ) ) {
-		loadedVPKs[ archivePath ] = VPK::open( archivePath );
+static auto isCoveredByChunks( const ChunkDigests& digests, const std::filesystem::path& root, const IndexRow& row, ArchiveCache& loadedVPKs ) -> bool {
+	const auto it{ digests.archives.find( row.archive ) };
+	// a changed tree may have moved anything anywhere
+	if ( it == digests.archives.end() || !it->second.directoryMatches )
+		return false;
+
+	const auto vpk{ loadedVPKs.open( ( root / row.archive ).string() ) };
+	const auto entry{ vpk ? vpk->findEntry( row.path ) : std::nullopt };
+	return entry && ( entry->archiveIndex == vpkpp::VPK::VPK_DIR_INDEX || it->second.matched.contains( entry->archiveIndex ) );
+}
+
+static auto verifyArchivedFile( ArchiveCache& loadedVPKs, const std::string& archivePath, const std::string& archiveRel, const std::string& entryPath, std::uint64_t expectedSize, std::string_view expectedSha1, std::string_view expectedCrc32, const VerifyOptions& options, VerifyCheckpoint& progress ) -> void {
+	std::shared_ptr<vpkpp::PackFile> vpk;
+	{
+		TraceSpan span{ "open VPK", archiveRel };
+		vpk = loadedVPKs.open( archivePath );
 	}
-	if (! loadedVPKs[ archivePath ]) {
+	if (! vpk ) {
 		Log_Error( "Failed to open VPK at `{}` (containing file at `{}`)", archiveRel, entryPath );
 		return;
 	}
 
 	const auto fullPath{ archiveRel + '/' + entryPath };
 
-	auto entry{ loadedVPKs[ archivePath ]->findEntry( entryPath ) };
+	std::optional<vpkpp::Entry> entry;
+	{
+		TraceSpan span{ "find entry", fullPath };
+		entry = vpk->findEntry( entryPath );
+	}
 	if (! entry ) {
-		Log_Report( fullPath, "Entry doesn't exist on disk.", "nul", "nul" );
-		errors += 1;
+		report( progress, fullPath, "Entry doesn't exist on disk.", "nul", "nul" );
 		return;
 	}
 
-	auto entryData{ loadedVPKs[ archivePath ]->readEntry( entryPath ) };
-	if (! entryData ) {
-		Log_Error( "Failed to open file: `{}`", fullPath );
+	if ( options.level == VerifyLevel::Exists ) {
+		Log_Verbose( "Processed entry `{}`", fullPath );
+		progress.entries += 1;
+		return;
+	}
+
+	// the directory knows the size of every entry, and its crc32
+	if ( entry->length != expectedSize ) {
+		report( progress, fullPath, "Sizes don't match.", std::to_string( entry->length ), std::to_string( expectedSize ) );
+		Log_Verbose( "Processed entry `{}`", fullPath );
+		progress.entries += 1;
+		return;
+	}
+	if ( options.level <= VerifyLevel::Directory ) {
+		if ( options.level == VerifyLevel::Directory ) {
+			// stored in the VPK as is, same byte order as in the index
+			std::array<CryptoPP::byte, sizeof( entry->crc32 )> crc32Hash{};
+			std::memcpy( crc32Hash.data(), &entry->crc32, crc32Hash.size() );
+			checkDigest( progress, fullPath, "Directory crc32 doesn't match.", crc32Hash, expectedCrc32 );
+		}
+		Log_Verbose( "Processed entry `{}`", fullPath );
+		progress.entries += 1;
 		return;
 	}
 
-	if ( entryData->size() != expectedSize ) {
-		Log_Report( fullPath, "Sizes don't match.", std::to_string( entryData->size() ), std::to_string( expectedSize ) );
+	// sha1/crc32 of the contents, not what the directory claims, aliases of a payload already read take its digests
+	const bool full{ options.level == VerifyLevel::Full };
+	PayloadDigests digests{};
+	const auto claim{ loadedVPKs.claimPayload( archivePath, *entry, digests ) };
+	if ( claim != PayloadClaim::Known ) {
+		const bool read{ hashArchivedFile( *vpk, archivePath, entryPath, *entry, loadedVPKs.isLinked( archivePath ), options, digests ) };
+		if ( claim == PayloadClaim::Claimed )
+			loadedVPKs.sharePayload( archivePath, *entry, read ? &digests : nullptr );
+		if (! read ) {
+			Log_Error( "Failed to open file: `{}`", fullPath );
+			return;
+		}
+	} else {
+		Log_Verbose( "Entry `{}` shares its data with one already read", fullPath );
+	}
+
+	if ( digests.size != expectedSize ) {
+		report( progress, fullPath, "Sizes don't match.", std::to_string( digests.size ), std::to_string( expectedSize ) );
 		Log_Verbose( "Processed entry `{}`", fullPath );
-		entries += 1;
-		errors += 1;
+		progress.entries += 1;
 		return;
 	}
+	checkDigest( progress, fullPath, "Content crc32 doesn't match.", digests.crc32, expectedCrc32 );
+	if ( full )
+		checkDigest( progress, fullPath, "Content sha1 doesn't match.", digests.sha1, expectedSha1 );
 
-	// sha1 (crc32 is already computed)
+	Log_Verbose( "Processed file `{}`", fullPath );
+	progress.entries += 1;
+}
+
+static auto hashArchivedFile( const vpkpp::PackFile& vpk, const std::string& archivePath, const std::string& entryPath, const vpkpp::Entry& entry, bool linked, const VerifyOptions& options, PayloadDigests& digests ) -> bool {
+	const bool full{ options.level == VerifyLevel::Full };
 	CryptoPP::SHA1 sha1er{};
-	sha1er.Update( reinterpret_cast<const CryptoPP::byte*>( entryData->data() ), entryData->size() );
-	std::array<CryptoPP::byte, CryptoPP::SHA1::DIGESTSIZE> sha1Hash{};
-	sha1er.Final( sha1Hash.data() );
+	CryptoPP::CRC32 crc32er{};
+	digests.size = 0;
+	const auto hash{ [ &sha1er, &crc32er, &digests, full ]( const std::byte* data, std::size_t count ) {
+		TraceSpan span{ "hash" };
+		crc32er.Update( reinterpret_cast<const CryptoPP::byte*>( data ), count );
+		if ( full )
+			sha1er.Update( reinterpret_cast<const CryptoPP::byte*>( data ), count );
+		digests.size += count;
+	} };
 
-	std::string sha1HashStr;
-	std::string crc32HashStr;
-	{
-		CryptoPP::StringSource sha1HashStrSink{ sha1Hash.data(), sha1Hash.size(), true, new CryptoPP::HexEncoder{ new CryptoPP::StringSink{ sha1HashStr } } };
-		CryptoPP::StringSource crc32HashStrSink{ reinterpret_cast<const CryptoPP::byte*>( &entry->crc32 ), sizeof( entry->crc32 ), true, new CryptoPP::HexEncoder{ new CryptoPP::StringSink{ crc32HashStr } } };
+	// when memory is limited, big entries are hashed a piece at a time instead of being read whole, and so are those
+	// of a linked tree, which would read the files of the VPK it was parsed from
+	const auto pieceSize{ static_cast<std::size_t>( options.memoryLimit / 4 ) };
+	bool readInPieces{ false };
+	if ( linked || ( pieceSize != 0 && entry.length > pieceSize ) ) {
+		TraceSpan span{ "read entry", entryPath };
+		readInPieces = readEntryInPieces( archivePath, entry, pieceSize != 0 ? pieceSize : options.readSize != 0 ? options.readSize : READ_BUFFER_SIZE, hash );
+		if ( linked && !readInPieces )
+			return false;
 	}
+	if (! readInPieces ) {
+		sha1er.Restart();
+		crc32er.Restart();
+		digests.size = 0;
+		std::optional<std::vector<std::byte>> entryData;
+		{
+			// decompression included
+			TraceSpan span{ "read entry", entryPath };
+			ThrottledRead throttle{ static_cast<std::size_t>( entry.length ) };
+			entryData = vpk.readEntry( entryPath );
+		}
+		if (! entryData )
+			return false;
+		hash( entryData->data(), entryData->size() );
+	}
+
+	crc32er.Final( digests.crc32.data() );
+	if ( full )
+		sha1er.Final( digests.sha1.data() );
+	return true;
+}
 
-	if ( sha1HashStr != expectedSha1 ) {
-		Log_Report( fullPath, "Content sha1 doesn't match.", sha1HashStr, expectedSha1 );
-		errors += 1;
+static auto loadIndexRows( const std::filesystem::path& indexPath, std::vector<IndexRow>& rows ) -> bool {
+	IndexReader reader{ indexPath };
+	if (! reader.good() ) {
+		Log_Error( "Failed to open index file for reading: `{}`", indexPath.string() );
+		return false;
 	}
+	for ( IndexRow row{}; reader.next( row ); )
+		rows.push_back( std::move( row ) );
+	return reader.isIntact();
+}
+
+static auto sortByPhysicalLocation( const std::filesystem::path& root, ArchiveCache& loadedVPKs, const std::vector<IndexRow>& rows, std::vector<std::size_t>& order ) -> void {
+	// where the data of each row starts: the file holding it, and the offset inside of it
+	std::vector<std::pair<PhysicalLocation, std::uint64_t>> locations( rows.size() );
+	// VPK entries share a handful of chunk files
+	std::unordered_map<std::string, PhysicalLocation> chunks;
 
-	if ( crc32HashStr != expectedCrc32 ) {
-		Log_Report( fullPath, "Content crc32 doesn't match.", crc32HashStr, expectedCrc32 );
-		errors += 1;
+	for ( const auto i : order ) {
+		const auto& row{ rows[ i ] };
+		if ( row.archive == "." ) {
+			locations[ i ] = { getPhysicalLocation( root / row.path ), 0 };
+			continue;
+		}
+
+		const auto archivePath{ ( root / row.archive ).string() };
+		const auto vpk{ loadedVPKs.open( archivePath ) };
+		if (! vpk )
+			continue;
+		const auto entry{ vpk->findEntry( row.path ) };
+		if (! entry )
+			continue;
+
+		const auto chunkPath{ getArchiveChunkPath( archivePath, entry->archiveIndex ).string() };
+		auto chunk{ chunks.find( chunkPath ) };
+		if ( chunk == chunks.end() )
+			chunk = chunks.emplace( chunkPath, getPhysicalLocation( chunkPath ) ).first;
+		locations[ i ] = { chunk->second, entry->offset };
 	}
 
-	Log_Verbose( "Processed file `{}`", fullPath );
-	entries += 1;
+	// rows we know nothing about keep their place at the front
+	std::stable_sort( order.begin(), order.end(), [ &locations ]( std::size_t a, std::size_t b ) {
+		return locations[ a ] < locations[ b ];
+	} );
+}
+
+static auto checkDigest( VerifyCheckpoint& progress, std::string_view file, std::string_view message, std::span<const unsigned char> got, std::string_view expected ) -> bool {
+	if ( matchesDigest( got, expected ) )
+		return true;
+
+	report( progress, file, message, toHex( got ), expected );
+	return false;
+}
+
+static auto matchesDigest( std::span<const unsigned char> got, std::string_view expected ) -> bool {
+	std::array<unsigned char, CryptoPP::SHA1::DIGESTSIZE> bytes{};
+	const auto expectedBytes{ std::span{ bytes }.first( std::min( got.size(), bytes.size() ) ) };
+	return parseHex( expected, expectedBytes ) && std::equal( got.begin(), got.end(), expectedBytes.begin(), expectedBytes.end() );
+}
+
+static auto addWorkers( const std::filesystem::path& root, const VerifyOptions& options, const DeviceQueues& queues, std::vector<std::unique_ptr<VerifyWorker>>& workers ) -> void {
+	while ( workers.size() < queues.workerCount() ) {
+		// every worker gets its own slice of the memory limit
+		auto workerOptions{ options };
+		workerOptions.memoryLimit /= queues.workerCount();
+		workers.push_back( std::make_unique<VerifyWorker>( root, workerOptions ) );
+	}
 }
 
-static auto splitString( const std::string& string, const std::string& delim ) -> std::vector<std::string> {
-	std::vector<std::string> res{};
-	size_t last{ 0 };
-	size_t end;
+static auto openFile( const std::string& path, FileIdentity& identity ) -> int {
+	TraceSpan span{ "open", path };
+	// a single open and fstat tell whether it exists, its size and whether it changed since it was trusted
+#ifndef _WIN32
+	const int file{ ::open( path.c_str(), O_RDONLY | O_CLOEXEC ) };
+	if ( file < 0 )
+		return errno == ENOENT || errno == ENOTDIR ? FILE_MISSING : FILE_UNREADABLE;
+	if (! getFileIdentity( file, identity ) ) {
+		closeFile( file );
+		return FILE_MISSING;
+	}
+	return file;
+#else
+	if (! getFileIdentity( path, identity ) )
+		return FILE_MISSING;
+	const int file{ ::_open( path.c_str(), _O_RDONLY | _O_BINARY ) };
+	return file < 0 ? FILE_UNREADABLE : file;
+#endif
+}
 
-	while ( ( end = string.find( delim, last ) ) != std::string::npos ) {
-		// ptr + lastOffset -> segment start, offset - lastOffset -> size
-		res.push_back( string.substr( last, end - last ) );
-		last = end + delim.length();
+static auto hashFile( int file, bool full, VerifyBuffers& buffers, std::span<unsigned char, CryptoPP::SHA1::DIGESTSIZE> sha1, std::span<unsigned char, CryptoPP::CRC32::DIGESTSIZE> crc32 ) -> bool {
+	CryptoPP::SHA1 sha1er{};
+	CryptoPP::CRC32 crc32er{};
+
+	while ( true ) {
+		std::ptrdiff_t count;
+		{
+			TraceSpan span{ "read" };
+			count = readFile( file, buffers.read.data(), buffers.read.size() );
+		}
+		if ( count <= 0 ) {
+			if ( count < 0 )
+				return false;
+			break;
+		}
+
+		TraceSpan span{ "hash" };
+		if ( full )
+			sha1er.Update( buffers.read.data(), static_cast<std::size_t>( count ) );
+		crc32er.Update( buffers.read.data(), static_cast<std::size_t>( count ) );
 	}
+	sha1er.Final( sha1.data() );
+	crc32er.Final( crc32.data() );
+	return true;
+}
+
+static auto readFile( int file, unsigned char* buffer, std::size_t size ) -> std::ptrdiff_t {
+	ThrottledRead throttle{ size };
+#ifndef _WIN32
+	ssize_t count;
+	do {
+		count = ::read( file, buffer, size );
+	} while ( count < 0 && errno == EINTR );
+	return count;
+#else
+	return ::_read( file, buffer, static_cast<unsigned>( std::min<std::size_t>( size, INT_MAX ) ) );
+#endif
+}
+
+static auto closeFile( int file ) -> void {
+#ifndef _WIN32
+	::close( file );
+#else
+	::_close( file );
+#endif
+}
 
-	res.push_back( string.substr( last, string.length() - last ) );
-	return res;
+static auto report( VerifyCheckpoint& progress, std::string_view file, std::string_view message, std::string_view got, std::string_view expected ) -> void {
+	TraceSpan span{ "report", file };
+	if (! t_bCollectReports )
+		Log_Report( file, message, got, expected );
+	progress.reports.push_back( { std::string{ file }, std::string{ message }, std::string{ got }, std::string{ expected } } );
+	progress.errors += 1;
 }
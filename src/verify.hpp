@@ -3,7 +3,67 @@
 //
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <string>
 #include <string_view>
 #include <vector>
 
-auto verify( std::string_view root, std::string_view indexLocation ) -> int;
+// How thoroughly entries are checked, each level includes the ones before it
+enum class VerifyLevel
+{
+	// the file or VPK entry is there
+	Exists,
+	// it has the expected size
+	Size,
+	// VPK entries have the expected crc32 in the VPK directory, no entry is read
+	Directory,
+	// the contents have the expected crc32
+	Crc,
+	// and the expected sha1
+	Full,
+};
+
+struct VerifyOptions {
+	VerifyLevel level{ VerifyLevel::Full };
+	// continue from the last checkpoint
+	bool resume{ false };
+	// skip files that haven't changed since they were last verified
+	bool useTrustCache{ true };
+	// read files in the order they are laid out on disk instead of the index's
+	bool physicalOrder{ false };
+	// files read at once from each device, picked per device if zero
+	unsigned ioThreads{ 0 };
+	// bytes read from a file at once, the default if zero
+	std::size_t readSize{ 0 };
+	// bytes shared by open VPKs and read buffers, unlimited if zero
+	std::uint64_t memoryLimit{ 0 };
+	// keys of the shards to verify when using a sharded index, all of them if empty
+	std::vector<std::string> shards;
+	// globs of the loose files and entries to verify, found through the index's lookup table, everything if empty
+	std::vector<std::string> paths;
+	// installs verified against the index all at once, in place of the root holding it, copies of a file shared by
+	// several of them through hard links are only read once
+	std::vector<std::string> roots;
+	// install to restore the files found bad from, which are then verified again, nothing is repaired if empty
+	std::string repairFrom;
+	// globs of the files verified before all others, a glob starting with `@` names a file listing more of them one
+	// per line, the rest is verified once they're done
+	std::vector<std::string> critical;
+	// verify only the `part`th of `parts`, counting from 1, everything if `parts` is zero, the rows are split the same
+	// way by every process given the same index, and the results are saved for `mergeResults`
+	unsigned part{ 0 };
+	unsigned parts{ 0 };
+};
+
+// Returned by `verify` when some of the critical files are missing or corrupt, even if everything else is fine
+constexpr int CRITICAL_FILES_FAILED{ 2 };
+
+auto verify( std::string_view root, std::string_view indexLocation, const VerifyOptions& options ) -> int;
+
+// Combines the results saved by every part of a verification split with `VerifyOptions::parts` into a single report,
+// and returns the worst of their statuses
+auto mergeResults( std::string_view root, std::string_view indexLocation ) -> int;
+
+// Loads the index once, then verifies the files changed since the last request every time one is received
+auto watch( std::string_view root, std::string_view indexLocation, const VerifyOptions& options ) -> int;
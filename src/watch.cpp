@@ -0,0 +1,165 @@
+#include "watch.hpp"
+
+#include <array>
+#include <csignal>
+
+#include <fmt/format.h>
+
+#if defined( __linux__ )
+	#include <cerrno>
+	#include <cstring>
+	#include <poll.h>
+	#include <sys/inotify.h>
+	#include <unistd.h>
+#endif
+
+#include "log.hpp"
+
+#if defined( __linux__ )
+static constexpr std::uint32_t WATCH_EVENTS{ IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF };
+#endif
+
+static volatile std::sig_atomic_t s_VerifyRequested{ 0 };
+
+static auto onVerifyRequest( int signal ) -> void;
+static auto joinPath( const std::string& directory, std::string_view name ) -> std::string;
+
+FileWatcher::FileWatcher( const std::filesystem::path& root ) : root{ root } {
+#if defined( __linux__ )
+	this->fd = ::inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+	if ( this->fd < 0 ) {
+		Log_Error( "Failed to start watching `{}`: {}", root.string(), std::strerror( errno ) );
+		return;
+	}
+	this->addDirectory( "", nullptr );
+#else
+	Log_Error( "Watching for changes is not supported on this platform." );
+#endif
+}
+
+FileWatcher::~FileWatcher() {
+#if defined( __linux__ )
+	if ( this->fd >= 0 )
+		::close( this->fd );
+#endif
+}
+
+auto FileWatcher::good() const -> bool {
+	return this->fd >= 0;
+}
+
+auto FileWatcher::poll( std::chrono::milliseconds timeout, std::unordered_set<std::string>& dirty, std::unordered_set<std::string>& removed ) -> bool {
+#if defined( __linux__ )
+	pollfd request{ this->fd, POLLIN, 0 };
+	if ( ::poll( &request, 1, static_cast<int>( timeout.count() ) ) <= 0 )
+		return true;
+
+	bool complete{ true };
+	alignas( inotify_event ) std::array<char, 64 * 1024> buffer{};
+	for ( ssize_t length; ( length = ::read( this->fd, buffer.data(), buffer.size() ) ) > 0; ) {
+		for ( ssize_t offset = 0; offset < length; ) {
+			const auto* event{ reinterpret_cast<const inotify_event*>( buffer.data() + offset ) };
+			offset += static_cast<ssize_t>( sizeof( inotify_event ) + event->len );
+
+			if ( event->mask & IN_Q_OVERFLOW ) {
+				complete = false;
+				continue;
+			}
+			if ( event->mask & IN_IGNORED ) {
+				this->directories.erase( event->wd );
+				continue;
+			}
+
+			const auto directory{ this->directories.find( event->wd ) };
+			if ( directory == this->directories.end() || event->len == 0 )
+				continue;
+
+			const auto pathRel{ joinPath( directory->second, event->name ) };
+			if ( event->mask & IN_ISDIR ) {
+				// whatever was moved in with a new directory changed too, and whatever went away with an old one
+				if ( event->mask & ( IN_CREATE | IN_MOVED_TO ) ) {
+					this->addDirectory( pathRel, &dirty );
+				} else if ( event->mask & ( IN_DELETE | IN_MOVED_FROM ) ) {
+					this->removeDirectory( pathRel );
+					removed.insert( pathRel );
+				}
+				continue;
+			}
+			dirty.insert( pathRel );
+		}
+	}
+	return complete;
+#else
+	(void) timeout;
+	(void) dirty;
+	(void) removed;
+	return true;
+#endif
+}
+
+auto FileWatcher::addDirectory( const std::string& pathRel, std::unordered_set<std::string>* dirty ) -> void {
+#if defined( __linux__ )
+	const auto path{ this->root / pathRel };
+	const int wd{ ::inotify_add_watch( this->fd, path.c_str(), WATCH_EVENTS | IN_ONLYDIR ) };
+	if ( wd < 0 ) {
+		Log_Warn( "Failed to watch directory `{}`: {}", path.string(), std::strerror( errno ) );
+		return;
+	}
+	this->directories.insert_or_assign( wd, pathRel );
+
+	std::error_code err;
+	for ( const auto& entry : std::filesystem::directory_iterator{ path, err } ) {
+		auto name{ entry.path().filename().string() };
+		if ( entry.is_directory( err ) && !entry.is_symlink( err ) ) {
+			this->addDirectory( joinPath( pathRel, name ), dirty );
+		} else if ( dirty ) {
+			dirty->insert( joinPath( pathRel, name ) );
+		}
+	}
+#else
+	(void) pathRel;
+	(void) dirty;
+#endif
+}
+
+auto FileWatcher::removeDirectory( const std::string& pathRel ) -> void {
+#if defined( __linux__ )
+	const auto prefix{ pathRel + '/' };
+	for ( auto it{ this->directories.begin() }; it != this->directories.end(); ) {
+		if ( it->second != pathRel && !it->second.starts_with( prefix ) ) {
+			++it;
+			continue;
+		}
+		// already gone if it was deleted, its IN_IGNORED then finds nothing to erase
+		::inotify_rm_watch( this->fd, it->first );
+		it = this->directories.erase( it );
+	}
+#else
+	(void) pathRel;
+#endif
+}
+
+auto installVerifyRequestHandler() -> void {
+#ifdef SIGUSR1
+	std::signal( SIGUSR1, onVerifyRequest );
+#endif
+}
+
+auto takeVerifyRequest() -> bool {
+	if ( s_VerifyRequested == 0 )
+		return false;
+	s_VerifyRequested = 0;
+	return true;
+}
+
+static auto onVerifyRequest( int signal ) -> void {
+	s_VerifyRequested = 1;
+	// some platforms reset the handler after each signal
+	std::signal( signal, onVerifyRequest );
+}
+
+static auto joinPath( const std::string& directory, std::string_view name ) -> std::string {
+	if ( directory.empty() )
+		return std::string{ name };
+	return fmt::format( "{}/{}", directory, name );
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// Collects the files changed below a directory, only supported on Linux through inotify
+class FileWatcher {
+public:
+	explicit FileWatcher( const std::filesystem::path& root );
+	~FileWatcher();
+	FileWatcher( const FileWatcher& ) = delete;
+	auto operator=( const FileWatcher& ) -> FileWatcher& = delete;
+
+	[[nodiscard]] auto good() const -> bool;
+	// Waits up to `timeout` for changes, adding the paths of changed files relative to the root to `dirty`, and those
+	// of directories deleted or moved away with everything in them to `removed`, returns false if events were lost, in
+	// which case anything may have changed
+	auto poll( std::chrono::milliseconds timeout, std::unordered_set<std::string>& dirty, std::unordered_set<std::string>& removed ) -> bool;
+private:
+	// Watches a directory and all of its subdirectories, adding the files already in them to `dirty`
+	auto addDirectory( const std::string& pathRel, std::unordered_set<std::string>* dirty ) -> void;
+	// Stops watching a directory and its subdirectories, a directory moved away would report its changes as ours
+	auto removeDirectory( const std::string& pathRel ) -> void;
+
+	std::filesystem::path root;
+	int fd{ -1 };
+	// watch descriptor -> directory relative to the root, empty for the root itself
+	std::unordered_map<int, std::string> directories;
+};
+
+// SIGUSR1 asks a watching verifier to check what changed, the flag is cleared once taken
+auto installVerifyRequestHandler() -> void;
+auto takeVerifyRequest() -> bool;
@@ -0,0 +1,73 @@
+// Verifying files must not allocate for each of them, whether they're hashed or still trusted from an earlier run
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+#include "checkpoint.hpp"
+#include "devices.hpp"
+#include "fixtures.hpp"
+#include "layout.hpp"
+#include "log.hpp"
+#include "verify.hpp"
+
+// the queues, rows and buffers of a batch are kept for the next one, only saving a checkpoint allocates, which a slow
+// machine may do while verifying
+static constexpr std::size_t ALLOCATIONS_PER_CHECKPOINT{ 32 };
+
+static std::atomic<std::size_t> g_allocations{ 0 };
+
+auto operator new( std::size_t size ) -> void* {
+	g_allocations.fetch_add( 1, std::memory_order_relaxed );
+	if ( auto* memory{ std::malloc( size != 0 ? size : 1 ) } )
+		return memory;
+	throw std::bad_alloc{};
+}
+
+auto operator delete( void* memory ) noexcept -> void {
+	std::free( memory );
+}
+
+auto operator delete( void* memory, std::size_t ) noexcept -> void {
+	std::free( memory );
+}
+
+// Creates an index of `count` loose files, trusted by a first verification if `trusted`, then returns what verifying
+// them again allocated, and how many checkpoints it may have saved meanwhile
+static auto countVerifyAllocations( std::size_t count, bool trusted, std::size_t& checkpoints ) -> std::size_t {
+	TempDirectory root{ fmt::format( "allocations-{}", count ) };
+	for ( std::size_t i = 0; i < count; i++ )
+		writeFile( root.path / fmt::format( "materials/a_directory_name_long_enough_to_be_allocated_{:02}/file-{:06}.vmt", i % 16, i ), fmt::format( "contents of file {}", i ) );
+	if ( trusted )
+		waitForRacyWindow();
+
+	EXPECT( createIndex( root.path ) == 0, "creating the index failed" );
+	VerifyOptions options{};
+	options.ioThreads = 2;
+	options.useTrustCache = trusted;
+	if ( trusted )
+		EXPECT( verify( root.path.string(), "index.rsv", options ) == 0, "the first verification failed" );
+
+	const auto start{ std::chrono::steady_clock::now() };
+	const auto before{ g_allocations.load() };
+	EXPECT( verify( root.path.string(), "index.rsv", options ) == 0, "the verification failed" );
+	const auto allocations{ g_allocations.load() - before };
+	checkpoints = static_cast<std::size_t>( ( std::chrono::steady_clock::now() - start ) / CHECKPOINT_INTERVAL );
+	return allocations;
+}
+
+auto main() -> int {
+	// every file is opened, read and compared to the index when not trusted, and only looked up in the trust cache
+	// when it is, both of them fill all of the batches in flight, whose rows are allocated once and then reused
+	const auto small{ PHYSICAL_ORDER_BATCH * DEVICE_BATCHES };
+	const auto large{ small * 4 };
+	for ( const bool trusted : { false, true } ) {
+		std::size_t checkpoints{ 0 };
+		const auto smallAllocations{ countVerifyAllocations( small, trusted, checkpoints ) };
+		const auto largeAllocations{ countVerifyAllocations( large, trusted, checkpoints ) };
+		fmt::print( "{} files: {} allocations, {} files: {} allocations{}\n", small, smallAllocations, large, largeAllocations, trusted ? ", trusted" : "" );
+
+		EXPECT( largeAllocations <= smallAllocations + checkpoints * ALLOCATIONS_PER_CHECKPOINT, "{} more allocations for {} more files{}", largeAllocations - smallAllocations, large - small, trusted ? ", trusted" : "" );
+	}
+	return 0;
+}
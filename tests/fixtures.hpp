@@ -0,0 +1,65 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <fmt/format.h>
+
+#include "create.hpp"
+
+// Fails the test with a message if `condition` doesn't hold
+#define EXPECT( condition, ... )                                                                     \
+	do {                                                                                             \
+		if (! ( condition ) ) {                                                                      \
+			fmt::print( stderr, "{}:{}: `{}` failed: ", __FILE__, __LINE__, #condition );              \
+			fmt::print( stderr, __VA_ARGS__ );                                                       \
+			fmt::print( stderr, "\n" );                                                              \
+			std::exit( 1 );                                                                          \
+		}                                                                                            \
+	} while ( false )
+
+// An empty directory, removed with all it holds when done with
+class TempDirectory {
+public:
+	explicit TempDirectory( std::string_view name )
+		: path{ std::filesystem::temp_directory_path() / fmt::format( "verifier-{}-{}", name, std::chrono::steady_clock::now().time_since_epoch().count() ) } {
+		std::filesystem::create_directories( this->path );
+	}
+	~TempDirectory() {
+		std::error_code err;
+		std::filesystem::remove_all( this->path, err );
+	}
+	TempDirectory( const TempDirectory& ) = delete;
+	auto operator=( const TempDirectory& ) -> TempDirectory& = delete;
+
+	const std::filesystem::path path;
+};
+
+// Writes `contents` to `path`, creating the directories leading to it
+inline auto writeFile( const std::filesystem::path& path, std::string_view contents ) -> void {
+	std::filesystem::create_directories( path.parent_path() );
+	std::ofstream writer{ path, std::ios::out | std::ios::binary | std::ios::trunc };
+	writer.write( contents.data(), static_cast<std::streamsize>( contents.size() ) );
+}
+
+inline auto readFile( const std::filesystem::path& path ) -> std::string {
+	std::ifstream reader{ path, std::ios::in | std::ios::binary };
+	return { std::istreambuf_iterator<char>{ reader }, std::istreambuf_iterator<char>{} };
+}
+
+// Files modified this recently are never trusted, see `TrustCache`
+inline auto waitForRacyWindow() -> void {
+	std::this_thread::sleep_for( std::chrono::milliseconds{ 2500 } );
+}
+
+// Indexes everything in `root` to `<root>/index.rsv`, returns what `createFromRoot` did
+inline auto createIndex( const std::filesystem::path& root, const CreateOptions& options = {} ) -> int {
+	// the index is written in the root, it must not index itself while at it
+	return createFromRoot( root.string(), "index.rsv", false, { "index\\.rsv.*" }, {}, {}, {}, options );
+}
@@ -0,0 +1,114 @@
+// A compact index ends with a trailer counting its rows and their checksum, reading one which doesn't add up must tell
+#include <string>
+#include <vector>
+
+#include "fixtures.hpp"
+#include "index.hpp"
+#include "verify.hpp"
+
+static constexpr std::size_t ROWS{ 100 };
+static constexpr std::string_view TRAILER_START{ "\xFD#end\xFF" };
+
+// Writes a compact index of `ROWS` rows, and returns its contents
+static auto writeIndex( const std::filesystem::path& path ) -> std::string {
+	std::vector<IndexRow> rows;
+	for ( std::size_t i = 0; i < ROWS; i++ ) {
+		const auto archive{ i % 3 == 0 ? std::string{ "." } : fmt::format( "hl2/pak0{}_dir.vpk", i % 3 ) };
+		rows.push_back( { archive, fmt::format( "materials/file-{:04}.vmt", i ), i * 10, std::string( 40, 'A' + i % 6 ), "0A1B2C3D", {} } );
+	}
+	EXPECT( writeCompactIndex( path, rows ), "writing `{}` failed", path.string() );
+	return readFile( path );
+}
+
+// Reads every row of `path`, returns how many there were, and whether the reader found them intact
+static auto readIndex( const std::filesystem::path& path, bool& good, bool& intact ) -> std::size_t {
+	IndexReader reader{ path };
+	good = reader.good();
+	std::size_t count{ 0 };
+	for ( IndexRowView row{}; reader.next( row ); )
+		count += 1;
+	intact = reader.isIntact();
+	return count;
+}
+
+// Replaces the values of the trailer of `contents`
+static auto withTrailer( std::string contents, std::string_view rows, std::string_view crc32 ) -> std::string {
+	const auto start{ contents.rfind( TRAILER_START ) };
+	EXPECT( start != std::string::npos, "no trailer found" );
+	return contents.replace( start + 1, std::string::npos, fmt::format( "#end\xFF{}\xFF{}\xFF\xFD", rows, crc32 ) );
+}
+
+// The values of the trailer of `contents`
+static auto getTrailer( const std::string& contents, std::string& rows, std::string& crc32 ) -> void {
+	const auto start{ contents.rfind( TRAILER_START ) + TRAILER_START.size() };
+	const auto rowsEnd{ contents.find( '\xFF', start ) };
+	rows = contents.substr( start, rowsEnd - start );
+	crc32 = contents.substr( rowsEnd + 1, contents.find( '\xFF', rowsEnd + 1 ) - rowsEnd - 1 );
+}
+
+// Verifying against an index which doesn't match its trailer fails, however its rows are read, and trusts nothing
+static auto testVerify() -> void {
+	TempDirectory root{ "index-trailer-verify" };
+	for ( unsigned i = 0; i < 20; i++ )
+		writeFile( root.path / fmt::format( "materials/file-{:02}.vmt", i ), fmt::format( "contents of file {}", i ) );
+	EXPECT( createIndex( root.path ) == 0, "creating the index failed" );
+	const auto path{ root.path / "index.rsv" };
+	std::string rows;
+	std::string crc32;
+	const auto contents{ readFile( path ) };
+	getTrailer( contents, rows, crc32 );
+	crc32[ 0 ] = crc32[ 0 ] == '0' ? '1' : '0';
+	writeFile( path, withTrailer( contents, rows, crc32 ) );
+
+	VerifyOptions options{};
+	EXPECT( verify( root.path.string(), "index.rsv", options ) == 1, "verifying against a damaged index succeeded" );
+	EXPECT( !std::filesystem::exists( root.path / "index.rsv.trust" ), "files were trusted from a damaged index" );
+	options.part = 1;
+	options.parts = 2;
+	EXPECT( verify( root.path.string(), "index.rsv", options ) == 1, "verifying a part of a damaged index succeeded" );
+	options.parts = 0;
+	options.critical = { "materials/*" };
+	EXPECT( verify( root.path.string(), "index.rsv", options ) != 0, "verifying critical files of a damaged index succeeded" );
+}
+
+auto main() -> int {
+	TempDirectory directory{ "index-trailer" };
+	const auto path{ directory.path / "index.rsv" };
+	const auto contents{ writeIndex( path ) };
+	std::string rows;
+	std::string crc32;
+	getTrailer( contents, rows, crc32 );
+	EXPECT( rows == std::to_string( ROWS ), "the trailer counts {} rows", rows );
+
+	bool good;
+	bool intact;
+	// as written
+	EXPECT( readIndex( path, good, intact ) == ROWS && good && intact, "a good trailer wasn't accepted" );
+
+	// a checksum which isn't that of the rows
+	auto badCrc32{ crc32 };
+	badCrc32[ 0 ] = badCrc32[ 0 ] == '0' ? '1' : '0';
+	writeFile( path, withTrailer( contents, rows, badCrc32 ) );
+	EXPECT( readIndex( path, good, intact ) == ROWS && good && !intact, "a bad checksum wasn't noticed" );
+
+	// a row changed after it was written, paths are stored relative to the previous one so its digest is
+	auto changed{ contents };
+	changed[ changed.find( std::string( 40, 'C' ) ) ] = 'D';
+	writeFile( path, changed );
+	EXPECT( readIndex( path, good, intact ) == ROWS && good && !intact, "a changed row wasn't noticed" );
+
+	// more rows than there are
+	writeFile( path, withTrailer( contents, std::to_string( ROWS + 1 ), crc32 ) );
+	EXPECT( readIndex( path, good, intact ) == ROWS && good && !intact, "a wrong row count wasn't noticed" );
+
+	// cut short right after the last row, it's rejected before reading any
+	writeFile( path, contents.substr( 0, contents.rfind( TRAILER_START ) + 1 ) );
+	EXPECT( readIndex( path, good, intact ) == 0 && !good, "an index without its trailer was read" );
+
+	// and in the middle of the trailer
+	writeFile( path, contents.substr( 0, contents.size() - 3 ) );
+	EXPECT( readIndex( path, good, intact ) == 0 && !good, "an index with half a trailer was read" );
+
+	testVerify();
+	return 0;
+}
@@ -0,0 +1,109 @@
+// Parts of a verification must share the rows evenly, each exactly once, and merging their results must report the
+// worst of them, or fail when one is missing
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "checkpoint.hpp"
+#include "fixtures.hpp"
+#include "verify.hpp"
+
+// Verifies every part of `root` in turn, and returns what each of them saved
+static auto verifyParts( const std::filesystem::path& root, unsigned parts ) -> std::vector<VerifyCheckpoint> {
+	std::vector<VerifyCheckpoint> results( parts );
+	for ( unsigned part = 1; part <= parts; part++ ) {
+		VerifyOptions options{};
+		options.useTrustCache = false;
+		options.part = part;
+		options.parts = parts;
+		EXPECT( verify( root.string(), "index.rsv", options ) == 0, "verifying part {} of {} failed", part, parts );
+
+		int status{ -1 };
+		const auto path{ root / fmt::format( "index.rsv.part-{}-of-{}.results", part, parts ) };
+		EXPECT( readVerifyResults( path, results[ part - 1 ], status ), "part {} of {} saved no results", part, parts );
+		EXPECT( status == 0, "part {} of {} saved status {}", part, parts, status );
+	}
+	return results;
+}
+
+static auto countEntries( const std::vector<VerifyCheckpoint>& results ) -> unsigned {
+	unsigned entries{ 0 };
+	for ( const auto& part : results )
+		entries += part.entries;
+	return entries;
+}
+
+// Files of the same size are dealt one by one, no part gets more than one file over another
+static auto testEvenFiles() -> void {
+	TempDirectory root{ "partitions-even" };
+	for ( unsigned i = 0; i < 90; i++ )
+		writeFile( root.path / fmt::format( "materials/file-{:02}.vmt", i ), "the same size" );
+	EXPECT( createIndex( root.path ) == 0, "creating the index failed" );
+
+	const auto results{ verifyParts( root.path, 4 ) };
+	EXPECT( countEntries( results ) == 90, "{} files verified out of 90", countEntries( results ) );
+	const auto [ least, most ]{ std::minmax_element( results.begin(), results.end(), []( const auto& a, const auto& b ) { return a.entries < b.entries; } ) };
+	EXPECT( most->entries - least->entries <= 1, "parts verified between {} and {} files", least->entries, most->entries );
+}
+
+// Parts are balanced by size as well as by count, a large file weighs as much as many small ones
+static auto testWeightedFiles() -> void {
+	TempDirectory root{ "partitions-weighted" };
+	writeFile( root.path / "large.bin", std::string( 2 * 1024 * 1024, 'x' ) );
+	for ( unsigned i = 0; i < 60; i++ )
+		writeFile( root.path / fmt::format( "small/file-{:02}.txt", i ), "small" );
+	EXPECT( createIndex( root.path ) == 0, "creating the index failed" );
+
+	const auto results{ verifyParts( root.path, 2 ) };
+	EXPECT( countEntries( results ) == 61, "{} files verified out of 61", countEntries( results ) );
+	EXPECT( std::min( results[ 0 ].entries, results[ 1 ].entries ) == 1, "the large file shares its part with {} others", std::min( results[ 0 ].entries, results[ 1 ].entries ) - 1 );
+}
+
+// Merging reports what every part found, and fails if any of them is missing or stale
+static auto testMerge() -> void {
+	TempDirectory root{ "partitions-merge" };
+	for ( unsigned i = 0; i < 30; i++ )
+		writeFile( root.path / fmt::format( "materials/file-{:02}.vmt", i ), fmt::format( "contents of file {}", i ) );
+	EXPECT( createIndex( root.path ) == 0, "creating the index failed" );
+	EXPECT( mergeResults( root.path.string(), "index.rsv" ) == 1, "merging without any results succeeded" );
+
+	verifyParts( root.path, 3 );
+	EXPECT( mergeResults( root.path.string(), "index.rsv" ) == 0, "merging clean parts failed" );
+
+	// a corrupt file is reported by exactly one part
+	writeFile( root.path / "materials/file-07.vmt", "contents of file 8" );
+	const auto results{ verifyParts( root.path, 3 ) };
+	EXPECT( countEntries( results ) == 30, "{} files verified out of 30", countEntries( results ) );
+	const auto reporting{ std::count_if( results.begin(), results.end(), []( const auto& part ) {
+		return std::any_of( part.reports.begin(), part.reports.end(), []( const auto& report ) { return report.file == "materials/file-07.vmt"; } );
+	} ) };
+	EXPECT( reporting == 1, "the corrupt file was reported by {} parts", reporting );
+
+	// the worst status of the parts wins
+	const auto last{ root.path / "index.rsv.part-3-of-3.results" };
+	EXPECT( writeVerifyResults( last, results[ 2 ], CRITICAL_FILES_FAILED ), "rewriting the results of part 3 failed" );
+	EXPECT( mergeResults( root.path.string(), "index.rsv" ) == CRITICAL_FILES_FAILED, "the status of part 3 was lost" );
+
+	// a part which didn't finish
+	std::filesystem::remove( last );
+	EXPECT( mergeResults( root.path.string(), "index.rsv" ) == 1, "merging with a missing part succeeded" );
+
+	// parts split another way, left over from an earlier run
+	verifyParts( root.path, 3 );
+	verifyParts( root.path, 2 );
+	EXPECT( mergeResults( root.path.string(), "index.rsv" ) == 1, "merging parts of two splits succeeded" );
+	for ( unsigned part = 1; part <= 3; part++ )
+		std::filesystem::remove( root.path / fmt::format( "index.rsv.part-{}-of-3.results", part ) );
+	EXPECT( mergeResults( root.path.string(), "index.rsv" ) == 0, "merging the parts of a single split failed" );
+
+	// the index changed since the parts were verified
+	std::filesystem::last_write_time( root.path / "index.rsv", std::filesystem::last_write_time( root.path / "index.rsv" ) + std::chrono::seconds{ 10 } );
+	EXPECT( mergeResults( root.path.string(), "index.rsv" ) == 1, "merging parts of another index succeeded" );
+}
+
+auto main() -> int {
+	testEvenFiles();
+	testWeightedFiles();
+	testMerge();
+	return 0;
+}